@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pish_arena.h"
+#include "pish_buf.h"
+#include "pish_complete.h"
+#include "pish_history.h"
+#include "pish_parse.h"
+
+/*
+ * Benchmarks of the costs the shell itself adds: parsing, the history, and
+ * starting commands, pipelines and redirections. Parsing and the history
+ * are timed in this process, everything else by running the pish binary on
+ * generated scripts, where the time of an empty script is subtracted.
+ * Every result is one JSON object on a line of its own, ie
+ *   {"bench":"parse_semi","shell":"pish","ops":1000,"runs":200,
+ *    "ns_per_op":85.2}
+ * ns_per_op is the median over all the runs, an op is what the name says:
+ * one command of a chain, one history entry, one pipeline and so on, but
+ * history_search is the time of one search through all the entries.
+ * complete_command and complete_path are the time of one Tab, in $PATH and
+ * in a directory of ops files, after the first one listed the directories.
+ * expand_var times an assignment and an expansion, substitution a $(...),
+ * heredoc and herestring a built-in reading a small document.
+ * run_builtin_traced is run_builtin with PISH_TRACE on.
+ * The fileop_ benchmarks time the built-in file utilities, and
+ * fileop_touch_external the real touch for comparison.
+ *
+ * Usage: pish_bench PISH [PISH_FORK]
+ *        pish_bench --startup BUDGET_US PISH
+ *        pish_bench --batch JOBS PISH
+ * PISH_FORK is a build with -DPISH_NO_SPAWN to compare fork+exec with.
+ * --startup only times how fast PISH starts and runs a trivial script, and
+ * fails if that takes more than BUDGET_US.
+ * --batch runs a script whose lines depend on each other with set -o batch
+ * on JOBS jobs, and fails if it leaves other files or output than without,
+ * see check_batch().
+ */
+
+extern char **environ;
+
+/* Where the generated scripts and the history file go */
+static char work_dir[] = "/tmp/pish_bench.XXXXXX";
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *samples, int runs) {
+    qsort(samples, runs, sizeof(double), compare_double);
+    return samples[runs / 2];
+}
+
+static void report(const char *bench, const char *shell, long ops, int runs,
+                   double ns_per_op) {
+    printf("{\"bench\":\"%s\",\"shell\":\"%s\",\"ops\":%ld,\"runs\":%d,"
+           "\"ns_per_op\":%.1f}\n",
+           bench, shell, ops, runs, ns_per_op);
+    fflush(stdout);
+}
+
+/*
+ * Time parse_chain() on a line made of ops copies of part, which ends in an
+ * operator, and a last true
+ */
+static void bench_parse(const char *bench, const char *part, long ops,
+                        int runs) {
+    struct pish_buf line = {0};
+    for (long i = 0; i < ops; i++) {
+        buf_append(&line, part, strlen(part));
+    }
+    buf_append(&line, "true", 4);
+    struct pish_arena arena = {0};
+    double samples[runs];
+    for (int r = 0; r < runs; r++) {
+        struct arena_mark mark = arena_mark(&arena);
+        double start = now_ns();
+        int error;
+        parse_chain(&arena, line.data, PARSE_QUIET, &error);
+        samples[r] = (now_ns() - start) / ops;
+        arena_release(&arena, mark);
+        if (error) {
+            fprintf(stderr, "pish_bench: %s does not parse\n", bench);
+            exit(EXIT_FAILURE);
+        }
+    }
+    report(bench, "-", ops, runs, median(samples, runs));
+    buf_free(&line);
+}
+
+/*
+ * Time add_history() for ops different entries, into a history file in
+ * the work directory
+ */
+static void bench_history(long ops, int runs) {
+    char *path;
+    if (asprintf(&path, "%s/history", work_dir) < 0) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+    // never the history of the user, clear_history() empties it
+    setenv("HISTFILE", path, 1);
+    free(path);
+    load_history();
+    double samples[runs];
+    char entry[64];
+    for (int r = 0; r < runs; r++) {
+        clear_history();
+        double start = now_ns();
+        for (long i = 0; i < ops; i++) {
+            snprintf(entry, sizeof(entry), "echo  entry %ld\t%d", i, r);
+            add_history(entry);
+        }
+        flush_history();
+        samples[r] = (now_ns() - start) / ops;
+    }
+    report("history_add", "-", ops, runs, median(samples, runs));
+}
+
+/*
+ * Time history_search() in a history of ops entries, for text which only the
+ * oldest entry contains. The first search builds the index, the median is
+ * what the searches after it take.
+ */
+static void bench_history_search(long ops, int runs) {
+    clear_history();
+    char entry[64];
+    for (long i = 0; i < ops; i++) {
+        snprintf(entry, sizeof(entry), "make -C src/module%ld all", i);
+        add_history(entry);
+    }
+    flush_history();
+    long last = history_last();
+    double samples[runs];
+    for (int r = 0; r < runs; r++) {
+        double start = now_ns();
+        long found = history_search("module0 ", 8, last + 1);
+        samples[r] = now_ns() - start;
+        if (found != 1) {
+            fprintf(stderr, "pish_bench: history_search found %ld\n", found);
+            exit(EXIT_FAILURE);
+        }
+    }
+    report("history_search", "-", ops, runs, median(samples, runs));
+}
+
+/*
+ * Time complete_word() for a command name, and for a path in a directory of
+ * ops files in the work directory
+ */
+static void bench_complete(long ops, int runs) {
+    char path[256];
+    for (long i = 0; i < ops; i++) {
+        snprintf(path, sizeof(path), "%s/file%ld", work_dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    char **matches;
+    double samples[runs];
+    complete_word("s", 1, 1, &matches);
+    for (int r = 0; r < runs; r++) {
+        double start = now_ns();
+        complete_word("s", 1, 1, &matches);
+        samples[r] = now_ns() - start;
+    }
+    report("complete_command", "-", 1, runs, median(samples, runs));
+    int len = snprintf(path, sizeof(path), "%s/file12", work_dir);
+    complete_word(path, len, 0, &matches);
+    for (int r = 0; r < runs; r++) {
+        double start = now_ns();
+        size_t n = complete_word(path, len, 0, &matches);
+        samples[r] = now_ns() - start;
+        if (n != 11) {
+            fprintf(stderr, "pish_bench: complete_path found %zu\n", n);
+            exit(EXIT_FAILURE);
+        }
+    }
+    report("complete_path", "-", ops, runs, median(samples, runs));
+}
+
+/*
+ * Write a script made of ops lines of line into the work directory
+ * @return          The malloc'd path of the script
+ */
+static char *write_script(const char *name, const char *line, long ops) {
+    char *path;
+    if (asprintf(&path, "%s/%s.pish", work_dir, name) < 0) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+    FILE *script = fopen(path, "w");
+    if (script == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < ops; i++) {
+        fprintf(script, "%s\n", line);
+    }
+    fclose(script);
+    return path;
+}
+
+/*
+ * Run the shell on a script once
+ * @param output    Where its stdout goes, ie /dev/null
+ * @return          How long it took in ns
+ */
+static double run_shell(const char *shell, const char *script,
+                        const char *output) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output,
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *argv[] = {(char *)shell, (char *)script, NULL};
+    double start = now_ns();
+    pid_t pid;
+    if (posix_spawn(&pid, shell, &actions, NULL, argv, environ) != 0) {
+        perror(shell);
+        exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now_ns() - start;
+    posix_spawn_file_actions_destroy(&actions);
+    if (!WIFEXITED(status)) {
+        fprintf(stderr, "pish_bench: %s %s did not exit\n", shell, script);
+        exit(EXIT_FAILURE);
+    }
+    return elapsed;
+}
+
+/*
+ * Time how long the shell takes to run an empty script, which the other
+ * script benchmarks subtract
+ * @return          The median in ns
+ */
+static double bench_startup(const char *shell, const char *label, int runs) {
+    char *script = write_script("empty", "", 0);
+    double samples[runs];
+    for (int r = 0; r < runs; r++) {
+        samples[r] = run_shell(shell, script, "/dev/null");
+    }
+    free(script);
+    double startup = median(samples, runs);
+    report("startup", label, 1, runs, startup);
+    return startup;
+}
+
+/*
+ * Time a script of ops copies of line, without the startup of the shell
+ * @return          The median ns per line
+ */
+static double bench_script(const char *bench, const char *shell,
+                           const char *label, const char *line, long ops,
+                           int runs, double startup) {
+    char *script = write_script(bench, line, ops);
+    double samples[runs];
+    for (int r = 0; r < runs; r++) {
+        samples[r] = (run_shell(shell, script, "/dev/null") - startup) / ops;
+    }
+    free(script);
+    double ns = median(samples, runs);
+    report(bench, label, ops, runs, ns);
+    return ns;
+}
+
+/*
+ * The benchmarks which run a build of the shell
+ */
+static void bench_shell(const char *shell, const char *label) {
+    double startup = bench_startup(shell, label, 50);
+    double external =
+        bench_script("run_external", shell, label, "true", 200, 10, startup);
+    bench_script("run_builtin", shell, label, "test 1", 2000, 10, startup);
+    // the records go to stdout, which is /dev/null
+    setenv("PISH_TRACE", "1", 1);
+    bench_script("run_builtin_traced", shell, label, "test 1", 2000, 10,
+                 startup);
+    unsetenv("PISH_TRACE");
+    double redirect = bench_script("run_redirect", shell, label,
+                                   "true > /dev/null", 200, 10, startup);
+    report("redirect_overhead", label, 200, 10, redirect - external);
+    bench_script("pipe_2", shell, label, "true | true", 100, 10, startup);
+    bench_script("pipe_4", shell, label, "true | true | true | true", 100,
+                 10, startup);
+    bench_script("pipe_8", shell, label,
+                 "true | true | true | true | true | true | true | true", 50,
+                 10, startup);
+    bench_script("subshell", shell, label, "(test 1; test 2)", 2000, 10,
+                 startup);
+    bench_script("expand_var", shell, label, "X=abc; test \"$X\" = abc", 2000,
+                 10, startup);
+    bench_script("substitution", shell, label, "X=$(test 1)", 200, 10,
+                 startup);
+    bench_script("heredoc", shell, label, "test 1 <<EOF\nkey=value\nEOF",
+                 2000, 10, startup);
+    bench_script("herestring", shell, label, "test 1 <<< key=value", 2000, 10,
+                 startup);
+    // the file utilities, built in and with the real programs
+    static const char *const fileops[][2] = {
+        {"fileop_mkdir", "mkdir -p %s/dir/sub"},
+        {"fileop_touch", "touch %s/file"},
+        {"fileop_cat", "cat %s/file"},
+        {"fileop_rm", "rm -f %s/gone"},
+        {"fileop_touch_external", "set +o fileops; touch %s/file"},
+    };
+    for (size_t i = 0; i < sizeof(fileops) / sizeof(fileops[0]); i++) {
+        char line[256];
+        snprintf(line, sizeof(line), fileops[i][1], work_dir);
+        bench_script(fileops[i][0], shell, label, line, 200, 10, startup);
+    }
+}
+
+/*
+ * Time the cold start of a shell: an empty script, and a trivial one
+ * @return          0 if the trivial script ran within budget_us, 1 otherwise
+ */
+static int bench_cold_start(const char *shell, long budget_us) {
+    bench_startup(shell, shell, 200);
+    char *script = write_script("trivial", "echo hello", 1);
+    double samples[200];
+    for (int r = 0; r < 200; r++) {
+        samples[r] = run_shell(shell, script, "/dev/null");
+    }
+    free(script);
+    double ns = median(samples, 200);
+    report("cold_start", shell, 1, 200, ns);
+    if (ns > budget_us * 1e3) {
+        fprintf(stderr, "pish_bench: %s took %.0fus, over the %ldus budget\n",
+                shell, ns / 1e3, budget_us);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Check set -o batch with jobs jobs forced, on lines which depend on each
+ * other through the paths they name: a directory and a copy into it, a slow
+ * write and a read of the file, appends to one log. The script runs once in
+ * a directory of its own without batching and once with it, and both must
+ * leave the same files and print the same output.
+ * @return          0 if they match, 1 otherwise
+ */
+static int check_batch(const char *shell, int jobs) {
+    static const char *const lines[] = {
+        "mkdir -p d%d",
+        "echo %d > f%d",
+        "cp f%d d%d/",
+        "(sleep 0.05; echo slow %d) > s%d",
+        "cat s%d",
+        "cat s%d > d%d/copy",
+        "echo %d >> log",
+        "sleep 0.1",
+    };
+    char *scripts[2];
+    double ns[2];
+    for (int batch = 0; batch < 2; batch++) {
+        const char *name = batch ? "batch" : "plain";
+        struct pish_buf text = {0};
+        char line[256];
+        snprintf(line, sizeof(line), "%smkdir %s/%s\ncd %s/%s\n",
+                 batch ? "set -o batch\n" : "", work_dir, name, work_dir,
+                 name);
+        buf_append(&text, line, strlen(line));
+        for (int i = 0; i < 8; i++) {
+            for (size_t j = 0; j < sizeof(lines) / sizeof(lines[0]); j++) {
+                // every %d of a line is the same number
+                snprintf(line, sizeof(line), lines[j], i, i, i);
+                buf_append(&text, line, strlen(line));
+                buf_append(&text, "\n", 1);
+            }
+        }
+        buf_append(&text, "cat log\n", 8);
+        scripts[batch] = write_script(name, text.data, 1);
+        buf_free(&text);
+        char *output;
+        if (asprintf(&output, "%s/%s.out", work_dir, name) < 0) {
+            perror("asprintf");
+            exit(EXIT_FAILURE);
+        }
+        char count[16];
+        snprintf(count, sizeof(count), "%d", jobs);
+        if (batch) {
+            setenv("PISH_BATCH_JOBS", count, 1);
+        }
+        ns[batch] = run_shell(shell, scripts[batch], output);
+        unsetenv("PISH_BATCH_JOBS");
+        free(output);
+        free(scripts[batch]);
+    }
+    report("batch_plain", shell, 1, 1, ns[0]);
+    report("batch_jobs", shell, jobs, 1, ns[1]);
+    char *command;
+    if (asprintf(&command,
+                 "cd '%s' && diff -r plain batch && cmp plain.out batch.out",
+                 work_dir) < 0) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+    int differ = system(command) != 0;
+    free(command);
+    if (differ) {
+        fprintf(stderr, "pish_bench: set -o batch with %d jobs left other "
+                        "files or output than running line by line\n",
+                jobs);
+    }
+    return differ;
+}
+
+static void remove_work_dir(void) {
+    char *command;
+    if (asprintf(&command, "rm -rf '%s'", work_dir) >= 0) {
+        if (system(command) != 0) {
+            fprintf(stderr, "pish_bench: could not remove %s\n", work_dir);
+        }
+        free(command);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int startup_only = argc == 4 && strcmp(argv[1], "--startup") == 0;
+    int batch_only = argc == 4 && strcmp(argv[1], "--batch") == 0;
+    if (!startup_only && !batch_only &&
+        (argc < 2 || argc > 3 || argv[1][0] == '-')) {
+        fprintf(stderr,
+                "Usage: %s PISH [PISH_FORK]\n"
+                "       %s --startup BUDGET_US PISH\n"
+                "       %s --batch JOBS PISH\n",
+                argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (mkdtemp(work_dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    atexit(remove_work_dir);
+    // the shells must not pick up a cache or profile of the caller
+    unsetenv("PISH_SCRIPT_CACHE");
+    unsetenv("PISH_PROFILE");
+    unsetenv("PISH_TRACE");
+    if (startup_only) {
+        return bench_cold_start(argv[3], atol(argv[2]));
+    }
+    if (batch_only) {
+        return check_batch(argv[3], atoi(argv[2]));
+    }
+    bench_parse("parse_semi", "true; ", 1000, 200);
+    bench_parse("parse_and", "true && ", 1000, 200);
+    bench_parse("parse_mixed", "ls -l /tmp > out 2>&1 && wc -l < out | "
+                               "sort || (cd /; pwd); ",
+                1000, 100);
+    bench_history(10000, 10);
+    bench_history_search(100000, 20);
+    bench_complete(1000, 20);
+    bench_shell(argv[1], "pish");
+    if (argc == 3) {
+        bench_shell(argv[2], "pish-fork");
+    }
+    return 0;
+}
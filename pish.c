@@ -1,16 +1,41 @@
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <pwd.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wait.h>
 
+#include "pish_arena.h"
+#include "pish_buf.h"
+#include "pish_builtins.h"
+#include "pish_cache.h"
+#include "pish_complete.h"
+#include "pish_edit.h"
+#include "pish_expand.h"
+#include "pish_fileops.h"
+#include "pish_hash.h"
+#include "pish_heredoc.h"
 #include "pish_history.h"
-#define MAX_COMMAND_LENGTH 256
+#include "pish_input.h"
+#include "pish_jobs.h"
+#include "pish_parallel.h"
+#include "pish_parse.h"
+#include "pish_profile.h"
+#include "pish_serve.h"
+#include "pish_spawn.h"
+#include "pish_trace.h"
+#include "pish_user.h"
+#include "pish_vars.h"
 
 /*
  * Script mode flag. If set to 0, the shell reads from stdin. If set to 1,
@@ -18,20 +43,61 @@
  */
 static int script_mode = 0;
 static int last_exit_status = 0;
+/* set -o pipefail, a pipeline fails if any of its stages does */
+static int option_pipefail = 0;
+/* set -o batch, a script runs lines which are independent at once */
+static int option_batch = 0;
+/* set +o fileops, cat, cp, mkdir, rm and touch run the real programs */
+static int option_fileops = 1;
+/* set -x, every simple command is printed before it runs */
+static int option_xtrace = 0;
+/*
+ * The exit status of every stage of the last pipeline, a simple command or
+ * subshell counts as a pipeline of one. Kept for PIPESTATUS.
+ */
+static int *pipe_status = NULL;
+static int npipe_status = 0;
+static int pipe_status_capacity = 0;
+/*
+ * Holds the parsed tree and everything else needed while one command line
+ * runs, see execute_chain()
+ */
+static struct pish_arena arena;
 
+/*
+ * The input is read through the line editor, see pish_edit.h, which needs
+ * the prompt it was printed after
+ */
+static int line_editing = 0;
+static struct pish_buf prompt_text = {0};
+
+/*
+ * Print a prompt and keep it for the line editor
+ */
+static void show_prompt(const char *text, size_t len) {
+    buf_set(&prompt_text, text, len);
+    fwrite(text, 1, len, stdout);
+    fflush(stdout);
+}
 /*
  * Prints a prompt IF NOT in script mode (see script_mode global flag).
  */
 void prompt(void) {
     if (!script_mode) {
         char *working_dir = getcwd(NULL, 0);
-        struct passwd *user = getpwuid(getuid());
+        const struct passwd *user = current_user();
+        const char *name = user != NULL ? user->pw_name : "?";
+        char *text;
 #ifdef PISH_AUTOGRADER
-        printf("%s@pish %s$\n", user->pw_name, working_dir);
+        int len = asprintf(&text, "%s@pish %s$\n", name, working_dir);
 #else
-        printf("\e[0;35m%s@pish \e[0;34m%s\e[0m$ ", user->pw_name, working_dir);
+        int len = asprintf(&text, "\e[0;35m%s@pish \e[0;34m%s\e[0m$ ", name,
+                           working_dir);
 #endif
-        fflush(stdout);
+        if (len >= 0) {
+            show_prompt(text, len);
+            free(text);
+        }
         free(working_dir);
     }
 }
@@ -43,759 +109,1800 @@ void usage_error(void) {
     fflush(stderr);
 }
 /*
- * Helper function which trims whitespace from a string
- * @param string    A string to remove the leading and trailing whitespace
- * @return          The parsed string without the leading and trailing
- * whitespace
+ * Wait for a child process and return its exit status
+ * @param pid       The child to wait for
+ * @return          The exit status of the child
  */
-char *trim_whitespace(char *string) {
-    char *end;
-    // remove leading space type characters
-    while (isspace((unsigned char)*string)) {
-        string++;
-    }
-    // if we are at the end of a string, then we return the string which is just
-    // a null-terminator
-    if (*string == '\0') {
-        return string;
-    }
-    // remove the trailing space type characters
-    end = string + strlen(string) - 1;
-    while (end > string && isspace((unsigned char)*end)) {
-        end--;
+static int wait_child(pid_t pid) {
+    int status;
+    if (wait_process(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return 1;
     }
-    // null terminate the string
-    *(end + 1) = '\0';
-    return string;
+    return exit_status(status);
 }
+void exec_in_child(struct pish_node *node);
+int is_builtin(const struct pish_node *cmd);
 /*
- * Break down a line of input by whitespace, and put the results into
- * a struct pish_arg to be used by other functions.
- *
- * @param command_str   A char buffer containing the input command
- * @param arg           Broken down args will be stored here
- */
-void parse_command(char *command_str, struct pish_arg *arg) {
-    // get the token before the first tab character from command_str
-    char *saveptr;
-    char *token = strtok_r(command_str, " \t", &saveptr);
-    arg->argc = 0;
-    // remove all tab characters
-    while (token != NULL) {
-        char *argument = malloc(strlen(token) + 1);
-        if (argument == NULL) {
-            perror("malloc failed in parse_command");
-            exit(EXIT_FAILURE);
+ * Check whether a node can be launched with posix_spawn(), which is only
+ * possible when the child needs no shell-side logic before exec
+ * @param node      The node to check
+ * @return          1 for an external simple command without assignments in
+ * front of it, 0 otherwise
+ */
+static int is_spawnable(struct pish_node *node) {
+    return node->kind == NODE_COMMAND && node->argc > 0 &&
+           node->nassigns == 0 && !is_builtin(node);
+}
+/*
+ * Replace the current process with a program, finding it through the hash
+ * table instead of letting execvp() search $PATH. The program gets the
+ * exported variables as its environment. Only returns if the program could
+ * not be executed, with errno set.
+ * @param argv      The NULL-terminated arguments, argv[0] is the command
+ */
+static void exec_command(char **argv) {
+    const char *path = hash_lookup(argv[0]);
+    if (path == NULL) {
+        return;
+    }
+    // the records of the trace would be lost with the process
+    trace_flush();
+    char **envp = vars_environ();
+    execve(path, argv, envp);
+    if (errno == ENOENT && path != argv[0]) {
+        // the cached path is gone, search $PATH again
+        hash_forget(argv[0]);
+        path = hash_lookup(argv[0]);
+        if (path != NULL) {
+            execve(path, argv, envp);
         }
-        strcpy(argument, token);
-        arg->argv[arg->argc] = argument;
-        arg->argc++;
-
-        token = strtok_r(NULL, " \t", &saveptr);
     }
-    arg->argv[arg->argc] = NULL; // Null-terminate the argv array
 }
-
 /*
  * Run a simple command
  *
  * Built-in commands are handled internally by the pish program.
  * Otherwise, use fork/exec to create child processes to run the program.
+ * Any redirections of the command are applied in the same child right
+ * before it calls exec. External commands are launched with posix_spawn()
+ * unless pish was built with PISH_NO_SPAWN.
  *
- * If the command is empty, it does nothing.
- * If NOT in script mode, adds the command to history file.
- * @param arg       The arg stored as a struct which contains the arg count and
- * the char* array of args
- */
-void run(struct pish_arg *arg) {
-    // if the arg count is 0, we simply return
-    if (arg->argc == 0) {
-        last_exit_status = 0;
+ * @param cmd       The command node which contains the arg count, the
+ * char* array of args and the redirections to apply
+ */
+void run(struct pish_node *cmd) {
+    struct timespec start;
+    profile_clock(&start);
+    if (PISH_USE_SPAWN && is_spawnable(cmd)) {
+        pid_t pid;
+        int status = spawn_command(cmd, -1, -1, -1, &pid);
+        if (status == 0) {
+            profile_launch(pid, &start, cmd, NULL);
+        }
+        last_exit_status = status == 0 ? wait_child(pid) : status;
         return;
     }
+    // resolve the command before forking so the parent's hash table keeps
+    // the result
+    if (cmd->argc > 0 && !is_builtin(cmd)) {
+        hash_lookup(cmd->argv[0]);
+    }
     pid_t pid = fork();
     if (pid < 0) {
         perror("fork");
         last_exit_status = 1;
         return;
     } else if (pid == 0) {
-        // normal exec behavior
-        execvp(arg->argv[0], arg->argv);
-        perror(arg->argv[0]);
-        exit(127);
+        exec_in_child(cmd);
     } else {
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
-            last_exit_status = 1;
-            return;
-        }
+        profile_launch(pid, &start, cmd, NULL);
         // store the last exit status
-        if (WIFEXITED(status)) {
-            last_exit_status = WEXITSTATUS(status);
-        } else if (WIFSIGNALED(status)) {
-            last_exit_status = 128 + WTERMSIG(status);
-        } else {
-            last_exit_status = 1;
+        last_exit_status = wait_child(pid);
+        // the child could not exec the cached path, look it up again next time
+        if (last_exit_status == 127 && cmd->argc > 0) {
+            hash_forget(cmd->argv[0]);
         }
     }
 }
-int execute_chain(char *chain);
+int execute_node(struct pish_node *node);
+int execute_chain(const char *chain);
+int run_builtin(struct pish_node *cmd);
+static const struct builtin *find_builtin(const struct pish_node *cmd);
+static int is_pure_builtin(struct pish_node *cmd);
+static int run_builtin_here(struct pish_node *cmd, int in_fd, int out_fd);
 /*
- * Run a redirection
- * @param command_str The full command string
- * @param file        The file to redirect output/input to
- * @param flags       The flags for open() for the specific redirection
- * @param dest_fd     The file descriptor for the file to redirect to
- * @return The exit status of the command
+ * Check whether a command runs one of the built-in commands which
+ * run_command() handles in the shell itself
+ * @param cmd       The command node, with at least its name in argv
+ * @return          1 if it runs a built-in command, 0 otherwise
  */
-int run_redirect(char *command_str, char *file, int flags, int dest_fd) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        return 1;
-    } else if (pid == 0) {
-        // code executes the redirection
-        char *target = file;
-        if (file[0] == '&') {
-            target = file + 1;
-        }
+int is_builtin(const struct pish_node *cmd) {
+    return find_builtin(cmd) != NULL;
+}
+/*
+ * Apply the redirections of a command or subshell to the current process.
+ * This is called in the forked child right before it runs the command, or in
+ * the shell itself around a built-in command.
+ * @param node       The node whose redirections to apply, in order
+ * @return           0 on success, -1 if a redirection failed
+ */
+int apply_redirects(struct pish_node *node) {
+    for (int i = 0; i < node->nredirs; i++) {
+        struct pish_redir *redir = &node->redirs[i];
         // if we have a moving file descritor ie <&(digit)-
-        if (strcmp(target, "-") == 0) {
-            if (close(dest_fd) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
+        if (redir->kind == REDIR_CLOSE) {
+            close(redir->fd);
+            continue;
+        }
+        int fd;
+        if (redir->kind == REDIR_DUP) {
+            fd = redir->dup_fd;
+        } else if (redir->kind == REDIR_DOC) {
+            if ((fd = heredoc_open(redir->path, strlen(redir->path))) < 0) {
+                return -1;
+            }
+        } else {
+            // 0644 means that the file can be read by owner, users in the
+            // file group, and anyone else on the system
+            fd = open(redir->path, redir->flags, 0644);
+            if (fd < 0) {
+                perror(redir->path);
+                return -1;
             }
-            // execute the command and also exit the child with the exit status
-            exit(execute_chain(command_str));
-        }
-        // 0644 means that the file can be read by owner, users in the file
-        // group, and anyone else on the system
-        int fd = open(file, flags, 0644);
-        if (fd < 0) {
-            perror(file);
-            exit(EXIT_FAILURE);
         }
-        // redirect output towards fd to dest_fd
-        if (dup2(fd, dest_fd) < 0) {
+        // redirect output towards fd to the redirected fd
+        if (fd != redir->fd && dup2(fd, redir->fd) < 0) {
             perror("dup2");
-            exit(EXIT_FAILURE);
+            return -1;
         }
         // only close if the opened fd is different from the destination fd so
         // we don't close our dup2'd fd
-        if (fd != dest_fd) {
+        if (redir->kind != REDIR_DUP && fd != redir->fd) {
             close(fd);
+        } else if (redir->kind == REDIR_DOC) {
+            // the document landed on its fd, which must outlive an exec
+            fcntl(fd, F_SETFD, 0);
         }
-        // execute and store the exit status of the command it executes
-        exit(execute_chain(command_str));
-    } else {
-        int status;
-        // wait for the child process to finish and store the exit status of the
-        // process in status
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) {
-            // return the returned status
-            return WEXITSTATUS(status);
-        }
-        // unsuccessful exit
-        return 1;
     }
+    return 0;
 }
 /*
- * This method handles the execution of a subshell
- * @param command_str    The command to be run in the subshell without the
- * beginning and trailing parenthesis
- * @return The exit status of the subshell
+ * An fd which the shell replaces for a while, see swap_fds()
  */
-int run_subshell(char *command_str) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        return 1;
-    } else if (pid == 0) {
-        // recursively executes the line inside the subshell as if another
-        // subshell exists inside of the subshell, it is called by
-        // execute_chain()
-        int subshell_status = execute_chain(command_str);
-        // exit the child process with the exit status of the command
-        exit(subshell_status);
-    } else {
-        // return the exit status to the parent shell
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
-            return 1;
+struct saved_fd {
+    int target; /* The fd which gets replaced */
+    int copy;   /* A copy of what it was, -1 if it was not open */
+    int flags;  /* Its fd flags, to keep FD_CLOEXEC */
+};
+/*
+ * Swap the stdin, stdout and redirections of a node into the shell itself.
+ * The fds they replace are saved first so restore_fds() can put them back.
+ * @param node      The command or subshell whose redirections to apply
+ * @param in_fd     The fd to use as stdin, or -1 to keep the shell's stdin
+ * @param out_fd    The fd to use as stdout, or -1 to keep the shell's stdout
+ * @param saved     Filled with every fd which gets replaced, it must have
+ * room for nredirs + 2 of them
+ * @param count     Set to the number of saved fds
+ * @return          0 on success, -1 if a redirection failed
+ */
+static int swap_fds(struct pish_node *node, int in_fd, int out_fd,
+                    struct saved_fd *saved, int *count) {
+    int nsaved = 0;
+    for (int i = -2; i < node->nredirs; i++) {
+        int fd = i == -2   ? (in_fd >= 0 ? STDIN_FILENO : -1)
+                 : i == -1 ? (out_fd >= 0 ? STDOUT_FILENO : -1)
+                           : node->redirs[i].fd;
+        int seen = fd < 0;
+        for (int j = 0; j < nsaved && !seen; j++) {
+            seen = saved[j].target == fd;
+        }
+        if (!seen) {
+            saved[nsaved].target = fd;
+            saved[nsaved].copy = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            saved[nsaved++].flags = fcntl(fd, F_GETFD);
         }
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
-        } else if (WIFSIGNALED(status)) {
-            // add 128 for errors
-            return 128 + WTERMSIG(status);
+    }
+    *count = nsaved;
+    // output the shell already buffered still goes to the old stdout
+    fflush(stdout);
+    if ((in_fd < 0 || dup2(in_fd, STDIN_FILENO) >= 0) &&
+        (out_fd < 0 || dup2(out_fd, STDOUT_FILENO) >= 0) &&
+        apply_redirects(node) == 0) {
+        return 0;
+    }
+    return -1;
+}
+/*
+ * Put back the fds which swap_fds() replaced, in the reverse order. An fd
+ * which was not open before is closed again.
+ */
+static void restore_fds(const struct saved_fd *saved, int count) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = count - 1; i >= 0; i--) {
+        if (saved[i].copy >= 0) {
+            // dup2() would drop FD_CLOEXEC, ie of the script being read
+            dup3(saved[i].copy, saved[i].target,
+                 (saved[i].flags & FD_CLOEXEC) ? O_CLOEXEC : 0);
+            close(saved[i].copy);
         } else {
-            return 1;
+            close(saved[i].target);
         }
     }
 }
 /*
- * The function is responsible for handling pipes between a left and a right
- * command
- * @param left_cmd      The command at the left of the pipe
- * @param right_cmd     The command at the right of the pipe
- * @return              The exit status of the command
+ * The node to run for a command or subshell, which is a copy with its words
+ * expanded when the parser found it has any, see pish_expand.h. With set -x
+ * a command is printed once it is expanded.
+ * @param node      The command or subshell as it was parsed
+ * @return          The node to run, or NULL if the expansion failed
  */
-int run_pipe(char *left_cmd, char *right_cmd) {
-    pid_t left_pid;
-    pid_t right_pid;
-    int p[2];
-    int status;
-    // create the pipe
-    if (pipe(p) < 0) {
-        perror("pipe");
-        return 1;
+static struct pish_node *expanded(struct pish_node *node) {
+    if (node->flags & NODE_EXPAND) {
+        node = expand_node(&arena, node);
     }
-    // handle the left command
-    left_pid = fork();
-    if (left_pid < 0) {
-        perror("fork");
+    if (option_xtrace && node != NULL && node->kind == NODE_COMMAND) {
+        trace_command(node);
+    }
+    return node;
+}
+/*
+ * This method handles the execution of a subshell. A subshell which
+ * mark_subshells() found cannot change the state of the shell runs in the
+ * shell itself, with its redirections swapped in around it. Any other
+ * subshell is forked. Its redirections are expanded first.
+ * @param node      The subshell node, its child is the parsed contents
+ * without the beginning and trailing parenthesis
+ * @return The exit status of the subshell
+ */
+int run_subshell(struct pish_node *node) {
+    if ((node = expanded(node)) == NULL) {
         return 1;
     }
-    if (left_pid == 0) {
-        // close the read end of the pipe
-        close(p[0]);
-        // re-direct stdout to the write end of the pipe
-        dup2(p[1], STDOUT_FILENO);
-        // close the write end file descriptor
-        close(p[1]);
-        // run the left command but output is instead the write end of the pipe
-        // instead of stdout
-        int exit_status = execute_chain(left_cmd);
-        exit(exit_status);
+    if (node->flags & NODE_INLINE) {
+        struct saved_fd saved[node->nredirs + 2];
+        int count;
+        int status = 1;
+        if (swap_fds(node, -1, -1, saved, &count) == 0) {
+            status = node->child ? execute_node(node->child) : 0;
+        }
+        restore_fds(saved, count);
+        return status;
     }
-
-    right_pid = fork();
-    if (right_pid < 0) {
+    struct timespec start;
+    profile_clock(&start);
+    pid_t pid = fork();
+    if (pid < 0) {
         perror("fork");
         return 1;
+    } else if (pid == 0) {
+        // executes the tree inside the subshell, any subshell nested inside
+        // of it forks again through execute_node()
+        exec_in_child(node);
     }
-    if (right_pid == 0) {
-        // close the write end of the pipe
-        close(p[1]);
-        // re-direct stdin to the read end of the pipe
-        dup2(p[0], STDIN_FILENO);
+    profile_launch(pid, &start, node, NULL);
+    // return the exit status to the parent shell
+    return wait_child(pid);
+}
+/*
+ * Exit a forked child. Only our own output is flushed, exit() would also
+ * flush the script FILE and move the file offset it shares with the parent.
+ * @param status    The exit status of the child
+ */
+static void child_exit(int status) {
+    trace_flush();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+/*
+ * Run a node in a child process which has already been forked, without
+ * forking again when the node can replace the child with exec.
+ * Redirections are applied first, then simple commands exec directly and
+ * subshells run in the child itself. Never returns.
+ * @param node      The node to run
+ */
+void exec_in_child(struct pish_node *node) {
+    if (apply_redirects(node) < 0) {
+        child_exit(EXIT_FAILURE);
+    }
+    if (node->kind == NODE_SUBSHELL) {
+        // the jobs of the parent are not children of the subshell
+        jobs_forget();
+        child_exit(node->child ? execute_node(node->child) : 0);
+    }
+    if (node->kind == NODE_COMMAND) {
+        // a command which is only redirections, ie > file
+        if (node->argc == 0) {
+            child_exit(0);
+        }
+        // a stage of a pipeline or a job gets what is assigned in front of
+        // it in the environment of the child
+        for (int i = 0; i < node->nassigns; i++) {
+            var_assign(node->assigns[i], 1);
+        }
+        if (is_builtin(node)) {
+            child_exit(run_builtin(node));
+        }
+        exec_command(node->argv);
+        perror(node->argv[0]);
+        child_exit(127);
+    }
+    child_exit(execute_node(node));
+}
+/*
+ * Remember the exit status of every stage of a pipeline for PIPESTATUS
+ * @param statuses  The status of each stage, in order
+ * @param n         The number of stages
+ */
+static void set_pipe_status(const int *statuses, int n) {
+    if (n > pipe_status_capacity) {
+        pipe_status_capacity = n > 8 ? n : 8;
+        pipe_status = realloc(pipe_status, pipe_status_capacity * sizeof(int));
+        if (pipe_status == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(pipe_status, statuses, n * sizeof(int));
+    npipe_status = n;
+}
+/*
+ * Open a pidfd for a child, which poll() reports readable once it exits
+ * @return          The pidfd, or -1 if the kernel has none
+ */
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+/* How long a stage may run on after its reader exited, see wait_stages() */
+#define PIPE_GRACE_MS 100
 
-        close(p[0]);
-        // run the right command but output is instead the read end of the the
-        // pipe instead of stdin
-        int exit_status = execute_chain(right_cmd);
-        exit(exit_status);
-    }
-    // close both ends of the pipe in the parent
-    close(p[0]);
-    close(p[1]);
-    // wait for the children to finish
-    waitpid(left_pid, NULL, 0);
-    waitpid(right_pid, &status, 0);
-    // return the exit status
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+/*
+ * Check whether a stage of a pipeline writes to the pipe after it, and not
+ * to where its own redirections send stdout
+ */
+static int writes_to_pipe(const struct pish_node *stage) {
+    for (int i = 0; i < stage->nredirs; i++) {
+        if (stage->redirs[i].fd == STDOUT_FILENO) {
+            return 0;
+        }
     }
     return 1;
 }
-static char prevDir[MAX_COMMAND_LENGTH];
 /*
- * This function is responsible for the execution of a command including the
- * parsing of separation operators
- * @param chain      The command to execute as a string
- * @return           The status of the command which executes
+ * Reap every stage of a pipeline in whatever order they finish, with one
+ * loop which polls a pidfd of each one.
+ *
+ * A stage whose reader is gone can only write into a broken pipe. It gets
+ * SIGPIPE on its next write anyway, but a producer which computes for long
+ * between writes would keep running after ie | head is done. Such a stage
+ * is sent SIGPIPE once it outlives its reader by PIPE_GRACE_MS. The grace
+ * lets a stage which is about to exit, ie false | true, exit with its own
+ * status, so PIPESTATUS and pipefail see what other shells do.
+ *
+ * Without pidfds the stages are only waited for, from the last to the first.
+ * @param node      The pipeline node
+ * @param pids      The pid of every stage, -1 for those which are not
+ * running. Every entry is -1 once this returns.
+ * @param statuses  Filled with the status of every stage which was running
  */
-int execute_chain(char *chain) {
-    // store the parenthesis level for the subshell
-    int paren_level = 0;
-    char *scanner = chain;
-    // parse the string for subshells and semi-colon separation (1st priority)
-    while (*scanner != '\0') {
-        if (*scanner == '(') {
-            // keep track of the level of parenthesis
-            paren_level++;
-        } else if (*scanner == ')') {
-            // don't want the parenthesis level to be negative
-            if (paren_level > 0)
-                paren_level--;
-        } else if (*scanner == ';' && paren_level == 0) {
-            *scanner = '\0';
-            // recursively execute the left side and the right side of the
-            // semi-colon in the chain
-            execute_chain(chain);
-            return execute_chain(scanner + 1);
-        }
-        scanner++;
-    }
-    paren_level = 0;
-    scanner = chain;
-    // re-parse the string for parenthesis and && and || separation (2nd
-    // priority)
-    while (*scanner != '\0') {
-        if (*scanner == '(') {
-            paren_level++;
-        } else if (*scanner == ')') {
-            if (paren_level > 0)
-                paren_level--;
-        } else if (paren_level == 0) {
-            // upon reaching a &&, execute the left side then execute the right
-            // side if the left side has an exit status of 0
-            if (strncmp(scanner, "&&", 2) == 0) {
-                *scanner = '\0';
-                int status = execute_chain(chain);
-                if (status == 0) {
-                    return execute_chain(scanner + 2);
-                } else {
-                    return status;
-                }
+static void wait_stages(struct pish_node *node, pid_t *pids, int *statuses) {
+    int nstages = node->nchildren;
+    struct pollfd *fds = arena_alloc(&arena, nstages * sizeof(struct pollfd));
+    // when a stage whose reader exited gets SIGPIPE, 0 while its reader runs
+    long *deadlines = arena_alloc(&arena, nstages * sizeof(long));
+    int running = 0;
+    for (int i = 0; i < nstages; i++) {
+        fds[i].fd = pids[i] > 0 ? open_pidfd(pids[i]) : -1;
+        fds[i].events = POLLIN;
+        deadlines[i] = 0;
+        if (fds[i].fd >= 0) {
+            running++;
+        }
+    }
+    // stages which are not running, ie a built-in which ran in the shell or
+    // a command which could not be launched, no longer read their input
+    long now = now_ms();
+    for (int i = 1; i < nstages; i++) {
+        if (pids[i] <= 0 && writes_to_pipe(node->children[i - 1])) {
+            deadlines[i - 1] = now + PIPE_GRACE_MS;
+        }
+    }
+    while (running > 0) {
+        int timeout = -1;
+        for (int i = 0; i < nstages; i++) {
+            if (fds[i].fd >= 0 && deadlines[i] > 0) {
+                long left = deadlines[i] > now ? deadlines[i] - now : 0;
+                timeout = timeout < 0 || left < timeout ? left : timeout;
+            }
+        }
+        int ready = poll(fds, nstages, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        now = now_ms();
+        for (int i = nstages - 1; i >= 0; i--) {
+            if (fds[i].fd < 0) {
+                continue;
             }
-            // upon reaching a ||, execute the left side then execute the right
-            // side if the left side has an non-zero exit status
-            else if (strncmp(scanner, "||", 2) == 0) {
-                *scanner = '\0';
-                int status = execute_chain(chain);
-                if (status != 0) {
-                    return execute_chain(scanner + 2);
-                } else {
-                    return status;
+            if (ready > 0 && fds[i].revents != 0) {
+                statuses[i] = wait_child(pids[i]);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                pids[i] = -1;
+                running--;
+                if (i > 0 && writes_to_pipe(node->children[i - 1])) {
+                    deadlines[i - 1] = now + PIPE_GRACE_MS;
                 }
+            } else if (deadlines[i] > 0 && deadlines[i] <= now) {
+                // the stage is not reaped yet, so its pid cannot be reused
+                kill(pids[i], SIGPIPE);
+                deadlines[i] = 0;
             }
         }
-        scanner++;
-    }
-    scanner = chain + strlen(chain) - 1;
-    paren_level = 0;
-    // parse the chain from right to left to check for pipes (3rd priority)
-    while (scanner >= chain) {
-        if (*scanner == ')') {
-            paren_level++;
-        } else if (*scanner == '(') {
-            paren_level--;
-        }
-        // only handle pipes which are not inside subshells
-        else if (*scanner == '|' && paren_level == 0) {
-            // ensure that it is a pipe and not a ||
-            if (scanner != chain && *(scanner - 1) == '|') {
-                scanner--;
-            } else {
-                *scanner = '\0';
-                return run_pipe(chain, scanner + 1);
+    }
+    // the stages without a pidfd, or all that are left if poll() failed
+    for (int i = nstages - 1; i >= 0; i--) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+        if (pids[i] > 0) {
+            statuses[i] = wait_child(pids[i]);
+            pids[i] = -1;
+        }
+    }
+}
+/*
+ * The function is responsible for running a pipeline. All the pipes are
+ * created up front and every stage is launched directly into its command,
+ * then the shell waits for all the stages. External commands are spawned,
+ * only subshells and built-in commands fork a copy of the shell. One pure
+ * built-in stage, ie echo or history, runs in the shell itself once all the
+ * other stages have started. The stages are then reaped by wait_stages().
+ * The words of every stage are expanded before the pipes exist, so the
+ * child of a $(...) does not keep them open.
+ * @param node      The pipeline node whose children are the stages
+ * @return          The exit status of the last stage. With pipefail, the
+ * status of the last stage which failed, or 0 if none did.
+ */
+int run_pipe(struct pish_node *node) {
+    int nstages = node->nchildren;
+    int npipes = nstages - 1;
+    int *pipes = arena_alloc(&arena, 2 * npipes * sizeof(int));
+    pid_t *pids = arena_alloc(&arena, nstages * sizeof(pid_t));
+    int *statuses = arena_alloc(&arena, nstages * sizeof(int));
+    // a stage whose expansion failed is NULL and does not run
+    struct pish_node **stages =
+        arena_alloc(&arena, nstages * sizeof(struct pish_node *));
+    for (int i = 0; i < nstages; i++) {
+        pids[i] = -1;
+        statuses[i] = 1;
+        stages[i] = expanded(node->children[i]);
+    }
+    // create all the pipes, pipe i connects stage i to stage i + 1. They are
+    // close on exec so spawned stages only keep the ends they dup2
+    for (int i = 0; i < npipes; i++) {
+        if (pipe2(pipes + 2 * i, O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (int j = 0; j < 2 * i; j++) {
+                close(pipes[j]);
             }
+            return 1;
         }
-        scanner--;
     }
-    paren_level = 0;
-    scanner = chain + strlen(chain) - 1;
-    // parse the chain from right to left to check for redirection operators
-    // (lowest priority)
-    while (scanner >= chain) {
-        if (*scanner == ')') {
-            paren_level++;
-            scanner--;
-            continue;
+    int inline_stage = -1;
+    for (int i = 0; i < nstages && inline_stage < 0; i++) {
+        if (stages[i] != NULL && is_pure_builtin(stages[i])) {
+            inline_stage = i;
         }
-        if (*scanner == '(') {
-            paren_level--;
-            scanner--;
+    }
+    int started = 0;
+    for (; started < nstages; started++) {
+        struct pish_node *stage = stages[started];
+        int in_fd = started > 0 ? pipes[2 * (started - 1)] : -1;
+        int out_fd = started < npipes ? pipes[2 * started + 1] : -1;
+        if (started == inline_stage || stage == NULL) {
             continue;
         }
-        if (paren_level != 0) {
-            scanner--;
+        struct timespec start;
+        profile_clock(&start);
+        if (PISH_USE_SPAWN && is_spawnable(stage)) {
+            // a stage which fails to launch still lets the others run
+            statuses[started] =
+                spawn_command(stage, in_fd, out_fd, -1, &pids[started]);
+            if (statuses[started] != 0) {
+                pids[started] = -1;
+            }
+            profile_launch(pids[started], &start, stage, NULL);
             continue;
         }
-        if (*scanner == '>' || *scanner == '<') {
-            // rediretion operator can vary in length so we keep track of the
-            // start and end of the operator
-            char *op_end = scanner;
-            char *op_start = scanner;
-            int flags;
-            int default_fd;
-            // handles <
-            if (*op_end == '<') {
-                flags = O_RDONLY;
-                default_fd = STDIN_FILENO;
-            } else {
-                // handles >>
-                if (op_end > chain && *(op_end - 1) == '>') {
-                    op_start--;
-                    flags = O_WRONLY | O_CREAT | O_APPEND;
-                    default_fd = STDOUT_FILENO;
-                } else if (op_end > chain && *(op_end - 1) == '<') {
-                    // handles <>
-                    op_start--;
-                    flags = O_RDWR | O_CREAT;
-                    default_fd = STDIN_FILENO;
-                } else {
-                    // handles >
-                    flags = O_WRONLY | O_CREAT | O_TRUNC;
-                    default_fd = STDOUT_FILENO;
-                }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            // re-direct stdin to the read end of the previous pipe and stdout
+            // to the write end of the next one
+            if (in_fd >= 0) {
+                dup2(in_fd, STDIN_FILENO);
             }
-            char *file = trim_whitespace(op_end + 1);
-            int dest_fd = default_fd;
-            char *term_point = op_start;
-            // handle redirection of a specific file direction ie 1>> or 2<
-            if (op_start > chain && isdigit(*(op_start - 1))) {
-                char *num_end = op_start - 1;
-                char *num_start = num_end;
-                // look for the start of the operator
-                while (num_start > chain && isdigit(*(num_start - 1))) {
-                    num_start--;
-                }
-                // if a space exists between the fd and the operator ie 1 >>
-                if (num_start == chain || isspace(*(num_start - 1))) {
-                    char num_buf[16];
-                    int len = (num_end - num_start) + 1;
-                    if (len < 15) {
-                        strncpy(num_buf, num_start, len);
-                        num_buf[len] = '\0';
-                        dest_fd = atoi(num_buf);
-                        term_point = num_start;
-                    }
-                }
+            if (out_fd >= 0) {
+                dup2(out_fd, STDOUT_FILENO);
             }
-            *term_point = '\0';
-            // run redirect with the data parsed from the command
-            return run_redirect(chain, file, flags, dest_fd);
+            // close every pipe file descriptor so the readers see EOF
+            for (int j = 0; j < 2 * npipes; j++) {
+                close(pipes[j]);
+            }
+            exec_in_child(stage);
         }
-        scanner--;
+        pids[started] = pid;
+        profile_launch(pid, &start, stage, NULL);
     }
-    // keep track of the local exit status
-    int local_status = 0;
-    char *trimmed_cmd = trim_whitespace(chain);
-    // check if the start of the trimmed and parsed command starts with a bang
-    // character
-    if (strlen(trimmed_cmd) > 0 && *trimmed_cmd == '!') {
-        // if it does, handle the command and negate the exit status
-        char *post_bang_cmd = trimmed_cmd + 1;
-        int status = execute_chain(post_bang_cmd);
-        if (status == 0) {
-            local_status = 1;
-        } else {
-            local_status = 0;
-        }
-    }
-    // upon reaching a parenthesis opening, we run the contents inside the
-    // parenthesis as a subshell
-    else if (*trimmed_cmd == '(') {
-        // check it is a valid subshell syntax ie it has a closing parenthesis
-        char *end = trimmed_cmd + strlen(trimmed_cmd) - 1;
-        if (*end == ')') {
-            *end = '\0';
-            char *subshell_cmd = trimmed_cmd + 1;
-            local_status = run_subshell(subshell_cmd);
-        } else {
-            fprintf(stderr, "pish: syntax error: missing ')'\n");
-            local_status = 2;
-        }
+    int in_fd = -1;
+    int out_fd = -1;
+    if (inline_stage >= 0 && started == nstages) {
+        in_fd = inline_stage > 0 ? pipes[2 * (inline_stage - 1)] : -1;
+        out_fd = inline_stage < npipes ? pipes[2 * inline_stage + 1] : -1;
     }
-    // if the trimmed command is empty, do nothing
-    else if (strlen(trimmed_cmd) == 0) {
-        local_status = 0;
+    // close all the pipes in the parent, except the ones of the stage which
+    // runs here since the others must see EOF
+    for (int j = 0; j < 2 * npipes; j++) {
+        if (pipes[j] != in_fd && pipes[j] != out_fd) {
+            close(pipes[j]);
+        }
     }
-    // execute the basic command which has been parsed already for all the
-    // special characters
-    else {
-        struct pish_arg *cmd = malloc(sizeof(struct pish_arg));
-        if (cmd == NULL) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
+    if (inline_stage >= 0 && started == nstages) {
+        // a reader which exits early must not kill the shell with SIGPIPE
+        struct sigaction ignore, old;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &old);
+        statuses[inline_stage] =
+            run_builtin_here(stages[inline_stage], in_fd, out_fd);
+        sigaction(SIGPIPE, &old, NULL);
+        if (in_fd >= 0) {
+            close(in_fd);
         }
-        parse_command(trimmed_cmd, cmd);
-        // if the command is empty, do nothing
-        if (cmd->argv[0] == NULL) {
-            local_status = 0;
+        if (out_fd >= 0) {
+            close(out_fd);
         }
-        // if the command is cd, change directory
-        else if (strcmp(cmd->argv[0], "cd") == 0) {
-            if (cmd->argc != 2) {
-                usage_error();
-                local_status = 1;
-            } else {
-                char *cwd = getcwd(NULL, 0);
-                // handle cd - which changes to the previous directory the shell
-                // was in
-                if (strcmp(cmd->argv[1], "-") == 0) {
-                    if (prevDir[0] == '\0') {
-                        printf("%s\n", cwd);
-                    } else {
-                        char temp[MAX_COMMAND_LENGTH];
-                        strcpy(temp, prevDir);
-                        strcpy(prevDir, cwd);
-                        if (chdir(temp) == -1) {
-                            perror("cd");
-                            local_status = 1;
-                            strcpy(prevDir, temp);
-                        } else {
-                            local_status = 0;
-                            char *new_cwd = getcwd(NULL, 0);
-                            printf("%s\n", new_cwd);
-                            free(new_cwd);
-                        }
-                    }
-                } else {
-                    // store the old directory
-                    strcpy(prevDir, cwd);
-                    // change the directory
-                    if (chdir(cmd->argv[1]) == -1) {
-                        perror("cd");
-                        local_status = 1;
-                    } else {
-                        local_status = 0;
-                    }
-                }
-                free(cwd);
-            }
+    }
+    wait_stages(node, pids, statuses);
+    set_pipe_status(statuses, nstages);
+    if (started < nstages) {
+        return 1;
+    }
+    int status = statuses[nstages - 1];
+    for (int i = nstages - 2; i >= 0 && option_pipefail && status == 0; i--) {
+        status = statuses[i];
+    }
+    return status;
+}
+/*
+ * Start a command in the background and add it to the job table without
+ * waiting for it. Simple external commands are spawned directly, anything
+ * else runs in a forked copy of the shell. With job control the job gets its
+ * own process group, otherwise its stdin is /dev/null like in other shells.
+ * @param node      The background node, its child is the command to start
+ * @return          0, the status of the job is only known to wait
+ */
+int run_background(struct pish_node *node) {
+    struct pish_node *child = expanded(node->child);
+    if (child == NULL) {
+        return 1;
+    }
+    pid_t pgid = job_control() ? 0 : -1;
+    int in_fd = -1;
+    if (!job_control()) {
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pid_t pid;
+    struct timespec start;
+    profile_clock(&start);
+    if (PISH_USE_SPAWN && is_spawnable(child)) {
+        int status = spawn_command(child, in_fd, -1, pgid, &pid);
+        if (status != 0) {
+            pid = -1;
         }
-        // if the command executed is exit
-        else if (strcmp(cmd->argv[0], "exit") == 0) {
-            // arg count should be greater than 2
-            if (cmd->argc > 2) {
-                usage_error();
-                local_status = 1;
+    } else {
+        if (child->kind == NODE_COMMAND && child->argc > 0 &&
+            !is_builtin(child)) {
+            hash_lookup(child->argv[0]);
+        }
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+        } else if (pid == 0) {
+            if (pgid == 0) {
+                setpgid(0, 0);
             }
-            // exit with the desired exit code
-            else if (cmd->argc == 2) {
-                char *endptr;
-                long status_val = strtol(cmd->argv[1], &endptr, 10);
-                // check that the inputted exit code is a valid number
-                if (*endptr != '\0' || endptr == cmd->argv[1]) {
-                    fprintf(stderr, "pish: exit: numeric argument required\n");
-                    local_status = 2;
-                } else {
-                    exit((int)status_val & 255);
-                }
-            } else {
-                exit(last_exit_status);
+            if (in_fd >= 0) {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
             }
+            jobs_forget();
+            exec_in_child(child);
+        } else if (pgid == 0) {
+            // also set in the parent, so the group exists before fg needs it
+            setpgid(pid, pid);
         }
-        // if the executed command is history
-        else if (strcmp(cmd->argv[0], "history") == 0) {
-            // print history if just history
-            if (cmd->argc == 1) {
-                print_history();
-                local_status = 0;
-            }
-            // clear history if requested
-            else if (cmd->argc == 2 && (strcmp(cmd->argv[1], "-c") == 0)) {
-                clear_history();
-                local_status = 0;
-            } else {
-                usage_error();
-                local_status = 1;
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (pid > 0) {
+        profile_launch(pid, &start, child, NULL);
+        // the job shows the command as it was written
+        struct pish_buf command = {0};
+        format_node(node->child, &command);
+        job_add(pid, command.data);
+        buf_free(&command);
+    }
+    return 0;
+}
+/* The directory before the last cd, malloc'd, NULL until the first one */
+static char *prev_dir = NULL;
+/*
+ * cd dir, or cd - to go back to the previous directory
+ */
+static int builtin_cd(int argc, char **argv) {
+    if (argc != 2) {
+        usage_error();
+        return 1;
+    }
+    char *cwd = getcwd(NULL, 0);
+    // handle cd - which changes to the previous directory the shell was in
+    const char *target = argv[1];
+    if (strcmp(argv[1], "-") == 0) {
+        if (prev_dir == NULL) {
+            if (cwd != NULL) {
+                printf("%s\n", cwd);
             }
+            free(cwd);
+            return 0;
+        }
+        target = prev_dir;
+    }
+    if (chdir(target) == -1) {
+        perror("cd");
+        free(cwd);
+        return 1;
+    }
+    if (target == prev_dir) {
+        char *new_cwd = getcwd(NULL, 0);
+        printf("%s\n", new_cwd != NULL ? new_cwd : prev_dir);
+        free(new_cwd);
+    }
+    // the directory which was left is the previous one now
+    free(prev_dir);
+    prev_dir = cwd;
+    return 0;
+}
+/*
+ * exit [status]
+ */
+static int builtin_exit(int argc, char **argv) {
+    // arg count should be at most 2
+    if (argc > 2) {
+        usage_error();
+        return 1;
+    }
+    // exit with the desired exit code
+    if (argc == 2) {
+        char *endptr;
+        long status_val = strtol(argv[1], &endptr, 10);
+        // check that the inputted exit code is a valid number
+        if (*endptr != '\0' || endptr == argv[1]) {
+            fprintf(stderr, "pish: exit: numeric argument required\n");
+            return 2;
         }
-        // handle exec, replacing the shell
-        else if (strcmp(cmd->argv[0], "exec") == 0) {
-            if (cmd->argc < 2) {
-                usage_error();
+        exit((int)status_val & 255);
+    }
+    exit(last_exit_status);
+}
+/*
+ * history to print the history, history -c to clear it
+ */
+static int builtin_history(int argc, char **argv) {
+    if (argc == 1) {
+        print_history();
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+        clear_history();
+        return 0;
+    }
+    usage_error();
+    return 1;
+}
+/*
+ * exec command [arg ...], replacing the shell
+ */
+static int builtin_exec(int argc, char **argv) {
+    if (argc < 2) {
+        usage_error();
+        return 1;
+    }
+    exec_command(argv + 1);
+    perror(argv[1]);
+    exit(127);
+}
+/*
+ * Show, fill or reset the table of commands found through $PATH
+ */
+static int builtin_hash(int argc, char **argv) {
+    int local_status = 0;
+    if (argc == 1) {
+        hash_print();
+    } else if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+        hash_clear();
+    } else {
+        for (int i = 1; i < argc; i++) {
+            if (hash_lookup(argv[i]) == NULL) {
+                fprintf(stderr, "pish: hash: %s: not found\n", argv[i]);
                 local_status = 1;
-            } else {
-                execvp(cmd->argv[1], cmd->argv + 1);
-                perror(cmd->argv[1]);
-                exit(127);
             }
         }
-        // if it isn't a built-in command, run the command
-        else {
-            run(cmd);
-            local_status = last_exit_status;
+    }
+    return local_status;
+}
+static int builtin_jobs(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    return jobs_print();
+}
+static int builtin_fg(int argc, char **argv) {
+    if (argc > 2) {
+        usage_error();
+        return 1;
+    }
+    return jobs_fg(argc == 2 ? argv[1] : NULL);
+}
+static int builtin_bg(int argc, char **argv) {
+    if (argc > 2) {
+        usage_error();
+        return 1;
+    }
+    return jobs_bg(argc == 2 ? argv[1] : NULL);
+}
+/*
+ * Run many command lines at once, each one like execute_chain() would
+ */
+static int builtin_parallel(int argc, char **argv) {
+    return parallel_main(argc, argv, execute_chain);
+}
+/*
+ * An option of the shell which set -o turns on and set +o off
+ */
+struct shell_option {
+    const char *name;
+    int *value;
+};
+
+static const struct shell_option shell_options[] = {
+    {"batch", &option_batch},
+    {"fileops", &option_fileops},
+    {"pipefail", &option_pipefail},
+    {"xtrace", &option_xtrace},
+};
+/*
+ * set -o name to turn an option on, set +o name to turn it off, set -o to
+ * list every option. set -x and set +x turn xtrace on and off.
+ */
+static int builtin_set(int argc, char **argv) {
+    int noptions = sizeof(shell_options) / sizeof(shell_options[0]);
+    if (argc == 2 &&
+        (strcmp(argv[1], "-x") == 0 || strcmp(argv[1], "+x") == 0)) {
+        option_xtrace = argv[1][0] == '-';
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "-o") == 0) {
+        for (int i = 0; i < noptions; i++) {
+            printf("%-15s\t%s\n", shell_options[i].name,
+                   *shell_options[i].value ? "on" : "off");
         }
-        // free created cmd struct
-        for (int i = 0; i < cmd->argc; i++) {
-            free(cmd->argv[i]);
+        return 0;
+    }
+    if (argc != 3 ||
+        (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)) {
+        usage_error();
+        return 2;
+    }
+    for (int i = 0; i < noptions; i++) {
+        if (strcmp(argv[2], shell_options[i].name) == 0) {
+            *shell_options[i].value = argv[1][0] == '-';
+            return 0;
         }
-        free(cmd);
     }
+    fprintf(stderr, "pish: set: %s: invalid option name\n", argv[2]);
+    return 2;
+}
+/*
+ * Flags of a built-in command
+ *   BUILTIN_PURE       It never changes the state of the shell, so it can run
+ *                      in the shell itself even where other shells would use
+ *                      a subshell, ie as a stage of a pipeline
+ *   BUILTIN_LISTING    It is pure when run without arguments, ie hash
+ *   BUILTIN_FILEOP     A file utility, which is only built in with fileops
+ *                      on and for the arguments fileop_accepts()
+ */
+#define BUILTIN_PURE 1
+#define BUILTIN_LISTING 2
+#define BUILTIN_FILEOP 4
 
-    return local_status;
+struct builtin {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    int flags;
+};
+
+/*
+ * Every built-in command, sorted by name for find_builtin()
+ */
+static const struct builtin builtins[] = {
+    {"[", builtin_test, BUILTIN_PURE},
+    {"bg", builtin_bg, 0},
+    {"cat", builtin_cat, BUILTIN_PURE | BUILTIN_FILEOP},
+    {"cd", builtin_cd, 0},
+    {"cp", builtin_cp, BUILTIN_PURE | BUILTIN_FILEOP},
+    {"echo", builtin_echo, BUILTIN_PURE},
+    {"exec", builtin_exec, 0},
+    {"exit", builtin_exit, 0},
+    {"export", builtin_export, BUILTIN_LISTING},
+    {"fg", builtin_fg, 0},
+    {"hash", builtin_hash, BUILTIN_LISTING},
+    {"history", builtin_history, BUILTIN_LISTING},
+    {"jobs", builtin_jobs, BUILTIN_PURE},
+    {"mkdir", builtin_mkdir, BUILTIN_PURE | BUILTIN_FILEOP},
+    {"parallel", builtin_parallel, BUILTIN_PURE},
+    {"printf", builtin_printf, BUILTIN_PURE},
+    {"pwd", builtin_pwd, BUILTIN_PURE},
+    {"rm", builtin_rm, BUILTIN_PURE | BUILTIN_FILEOP},
+    {"set", builtin_set, BUILTIN_LISTING},
+    {"test", builtin_test, BUILTIN_PURE},
+    {"touch", builtin_touch, BUILTIN_PURE | BUILTIN_FILEOP},
+    {"unset", builtin_unset, 0},
+    {"wait", jobs_wait, 0},
+};
+
+static int compare_builtin(const void *key, const void *entry) {
+    return strcmp(key, ((const struct builtin *)entry)->name);
 }
 /*
- * This function takes an inputted line and checks if the line should cause a
- * continuation i.e it ends in \ or && or ||
- * @param line      The line to check
- * @return          0 if no continuation should occur, 1 if is a \ character, 2
- * if it is a && or an ||, 3 if it is a pipe
+ * Find the built-in command a command runs
+ * @param cmd       The command node, with at least its name in argv
+ * @return          The built-in, or NULL if the command is not one
  */
-int check_for_continuation(char *line) {
-    int len = strlen(line);
-    if (len == 0) {
+static const struct builtin *find_builtin(const struct pish_node *cmd) {
+    const struct builtin *builtin =
+        bsearch(cmd->argv[0], builtins, sizeof(builtins) / sizeof(builtins[0]),
+                sizeof(builtins[0]), compare_builtin);
+    if (builtin != NULL && (builtin->flags & BUILTIN_FILEOP) &&
+        (!option_fileops || !fileop_accepts(cmd->argc, cmd->argv))) {
+        return NULL;
+    }
+    return builtin;
+}
+/*
+ * Check whether a command can run inside the shell as a stage of a pipeline
+ * @param cmd       The stage to check
+ * @return          1 for a pure built-in command, 0 otherwise
+ */
+static int is_pure_builtin(struct pish_node *cmd) {
+    if (cmd->kind != NODE_COMMAND || cmd->argc == 0) {
         return 0;
     }
-    char *line_copy = strdup(line);
-    if (!line_copy) {
-        perror("strdup");
-        exit(EXIT_FAILURE);
-    }
-    char *trimmed_line = trim_whitespace(line_copy);
-    len = strlen(trimmed_line);
-    // if the last character in the command is a '\'
-    if (len > 0 && line[len - 1] == '\\') {
-        line[len - 1] = '\0';
-        free(line_copy);
+    const struct builtin *builtin = find_builtin(cmd);
+    return builtin != NULL &&
+           ((builtin->flags & BUILTIN_PURE) ||
+            ((builtin->flags & BUILTIN_LISTING) && cmd->argc == 1));
+}
+/*
+ * Run a built-in command in the current process
+ * @param cmd        The command node to run, argv[0] is a built-in command
+ * @return           The exit status of the command
+ */
+int run_builtin(struct pish_node *cmd) {
+    return find_builtin(cmd)->run(cmd->argc, cmd->argv);
+}
+/*
+ * Run a built-in command in the shell itself, with its stdin, stdout and
+ * redirections swapped in for as long as it runs. The fds it replaces are
+ * saved first and put back afterwards, so no child is needed.
+ * @param cmd       The command node to run, argv[0] is a built-in command
+ * @param in_fd     The fd to use as stdin, or -1 to keep the shell's stdin
+ * @param out_fd    The fd to use as stdout, or -1 to keep the shell's stdout
+ * @return          The exit status of the command
+ */
+static int run_builtin_here(struct pish_node *cmd, int in_fd, int out_fd) {
+    struct saved_fd saved[cmd->nredirs + 2];
+    int count;
+    int status = 1;
+    if (swap_fds(cmd, in_fd, out_fd, saved, &count) == 0) {
+        status = run_builtin(cmd);
+    }
+    restore_fds(saved, count);
+    return status;
+}
+/*
+ * Run a command which has no name once it is expanded, ie X=1 or > file.
+ * Its assignments set variables of the shell and its redirections are
+ * applied in a child, like for any command.
+ * @param cmd       The expanded command node
+ * @return          The status of the last $(...) in its words, 1 if a
+ * redirection failed, 0 otherwise
+ */
+static int run_assignments(struct pish_node *cmd) {
+    int substituted = substitution_status();
+    for (int i = 0; i < cmd->nassigns; i++) {
+        var_assign(cmd->assigns[i], 0);
+    }
+    if (cmd->nredirs > 0) {
+        run(cmd);
+        if (last_exit_status != 0) {
+            return last_exit_status;
+        }
+    }
+    return substituted >= 0 ? substituted : 0;
+}
+static int run_expanded(struct pish_node *cmd);
+/*
+ * Run a command with assignments in front of it, ie LC_ALL=C sort. They are
+ * exported for as long as it runs and put back afterwards, so a built-in
+ * sees them like a spawned command does in its environment.
+ * @param cmd       The expanded command node, with a name
+ * @return          The exit status of the command
+ */
+static int run_with_assigns(struct pish_node *cmd) {
+    struct var_saved saved[cmd->nassigns];
+    for (int i = 0; i < cmd->nassigns; i++) {
+        const char *assign = cmd->assigns[i];
+        var_save(assign, strchr(assign, '=') - assign, &saved[i]);
+        var_assign(assign, 1);
+    }
+    struct pish_node bare = *cmd;
+    bare.nassigns = 0;
+    bare.assigns = NULL;
+    int status = run_expanded(&bare);
+    for (int i = cmd->nassigns - 1; i >= 0; i--) {
+        var_restore(&saved[i]);
+    }
+    return status;
+}
+/*
+ * Run a simple command once its words are expanded. Built-in commands run
+ * in the shell itself, along with their redirections, everything else is
+ * run in a child process by run().
+ * @param cmd        The expanded command node to run
+ * @return           The exit status of the command
+ */
+static int run_expanded(struct pish_node *cmd) {
+    if (cmd->argc == 0) {
+        return run_assignments(cmd);
+    }
+    if (cmd->nassigns > 0) {
+        return run_with_assigns(cmd);
+    }
+    if (is_builtin(cmd)) {
+        return run_builtin_here(cmd, -1, -1);
+    }
+    run(cmd);
+    return last_exit_status;
+}
+/*
+ * Run a simple command, expanding its words first
+ * @param cmd        The command node to run
+ * @return           The exit status of the command
+ */
+int run_command(struct pish_node *cmd) {
+    if ((cmd = expanded(cmd)) == NULL) {
         return 1;
     }
-    // if the last character is a && or a ||
-    if (len >= 2 && (strcmp(&trimmed_line[len - 2], "&&") == 0 ||
-                     strcmp(&trimmed_line[len - 2], "||") == 0)) {
-        free(line_copy);
-        return 2;
+    return run_expanded(cmd);
+}
+/*
+ * Run a node under the time keyword and report what it used on stderr
+ * @param node      The time node, its child is the command to time
+ * @return          The exit status of the command
+ */
+static int run_time(struct pish_node *node) {
+    struct usage_mark mark;
+    usage_begin(&mark);
+    int status = node->child ? execute_node(node->child) : 0;
+    usage_report(&mark);
+    return status;
+}
+/*
+ * Find the and-or nodes of a list like a && b || c, which is parsed left
+ * associative into ((a && b) || c). The left operands are followed in a
+ * loop, so a list of any length, ie from a generated script, does not
+ * recurse once per operator.
+ * @param node      The last operator of the list, its root
+ * @param count     Set to the number of operators
+ * @return          Every operator from the root down, in the arena
+ */
+static struct pish_node **and_or_list(struct pish_node *node, int *count) {
+    int n = 0;
+    for (struct pish_node *op = node;
+         op->kind == NODE_AND || op->kind == NODE_OR; op = op->left) {
+        n++;
     }
-    // if the last character is a pipe operator
-    if (len >= 1 && trimmed_line[len - 1] == '|' &&
-        (len < 2 || trimmed_line[len - 2] != '|')) {
-        free(line_copy);
-        return 3;
+    struct pish_node **ops = arena_alloc(&arena, n * sizeof(*ops));
+    for (int i = 0; i < n; i++, node = node->left) {
+        ops[i] = node;
     }
-    // if the last character is a redirection operator
-    if (len > 0 &&
-        (trimmed_line[len - 1] == '>' || trimmed_line[len - 1] == '<')) {
-        free(line_copy);
-        return 4;
+    *count = n;
+    return ops;
+}
+/*
+ * The analysis pass run over every tree before it executes. It finds the
+ * subshells which cannot change the state of the shell and flags them with
+ * NODE_INLINE, so they run without a fork. A subshell can change the state
+ * when it runs a built-in which is not pure, ie cd or exit, assigns a
+ * variable, or starts a background job the shell would have to track. A
+ * command whose name is a $ may turn out to be any of those. External
+ * commands and pipelines run in their own processes anyway.
+ * @param node      The root of the tree, every subshell in it is checked
+ * @return          1 if the node leaves the state of the shell alone
+ */
+static int mark_subshells(struct pish_node *node) {
+    int pure = 1;
+    switch (node->kind) {
+    case NODE_SEQUENCE:
+    case NODE_PIPELINE:
+        for (int i = 0; i < node->nchildren; i++) {
+            pure &= mark_subshells(node->children[i]);
+        }
+        // stages of a pipeline other than the pure built-in are forked
+        return node->kind == NODE_PIPELINE ? 1 : pure;
+    case NODE_AND:
+    case NODE_OR: {
+        int count;
+        struct pish_node **ops = and_or_list(node, &count);
+        pure &= mark_subshells(ops[count - 1]->left);
+        for (int i = 0; i < count; i++) {
+            pure &= mark_subshells(ops[i]->right);
+        }
+        return pure;
+    }
+    case NODE_SUBSHELL:
+        if (node->child == NULL || mark_subshells(node->child)) {
+            node->flags |= NODE_INLINE;
+        }
+        return 1;
+    case NODE_BANG:
+        return mark_subshells(node->child);
+    case NODE_TIME:
+        return node->child == NULL || mark_subshells(node->child);
+    case NODE_BACKGROUND:
+        mark_subshells(node->child);
+        return 0;
+    case NODE_COMMAND:
+        if (node->argc == 0) {
+            return node->nassigns == 0;
+        }
+        if ((node->flags & NODE_EXPAND) && word_expands(node->argv[0])) {
+            return 0;
+        }
+        return !is_builtin(node) || is_pure_builtin(node);
     }
-    free(line_copy);
     return 0;
 }
 /*
- * The main loop of pish.
- * @param fp    The input for the shell, stdin or a script
- * @return      Returns the exit status of the shell
+ * Run an and-or list from its first command to its last. The right side of
+ * && only runs if the status so far is 0, the right side of || only if it
+ * is not.
+ * @param node      The root of the list, see and_or_list()
+ * @return          The status of the last command which ran
  */
-int pish(FILE *fp) {
-    while (1) {
-        // prompt the user if the shell is not in script mode
-        if (!script_mode) {
-            prompt();
+static int run_and_or(struct pish_node *node) {
+    int count;
+    struct pish_node **ops = and_or_list(node, &count);
+    // each operator is traced as a node of its own, which all start with
+    // the list and nest like the tree
+    struct timespec start;
+    int tracing = 0;
+    for (int i = 0; i < count; i++) {
+        tracing = trace_begin(&start);
+    }
+    int status = execute_node(ops[count - 1]->left);
+    for (int i = count - 1; i >= 0; i--) {
+        int left = status;
+        int ran = (ops[i]->kind == NODE_AND) == (status == 0);
+        if (ran) {
+            status = execute_node(ops[i]->right);
+        }
+        if (tracing) {
+            trace_operator(&start, ops[i], left, ran, status);
+        }
+    }
+    return status;
+}
+/*
+ * This function walks the parsed command tree and executes each node. The
+ * status of every node is kept for $? as soon as it is known, and with
+ * PISH_TRACE set each node is traced once it is done, see pish_trace.h.
+ * @param node       The node to execute
+ * @return           The status of the command which executes
+ */
+int execute_node(struct pish_node *node) {
+    struct timespec start;
+    // run_and_or() traces every operator of a list itself
+    int tracing = node->kind != NODE_AND && node->kind != NODE_OR &&
+                  trace_begin(&start);
+    int status = 0;
+    switch (node->kind) {
+    case NODE_SEQUENCE:
+        // run every command in order, the last one gives the status
+        for (int i = 0; i < node->nchildren; i++) {
+            status = execute_node(node->children[i]);
         }
-        char *full_command = NULL;
-        int continuation_type = 0;
-        // do while loop runs until there is no more continuation, it handles
-        // the continuation of the commands
-        do {
-            char line_buffer[MAX_COMMAND_LENGTH];
-            // if there is no more lines to run then execute the previously
-            // stored command
-            if (fgets(line_buffer, MAX_COMMAND_LENGTH, fp) == NULL) {
-                // if there exists a previous command, execute it
-                if (full_command) {
-                    last_exit_status = execute_chain(full_command);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        status = run_and_or(node);
+        break;
+    case NODE_PIPELINE:
+        status = run_pipe(node);
+        break;
+    case NODE_SUBSHELL:
+        status = run_subshell(node);
+        set_pipe_status(&status, 1);
+        break;
+    case NODE_BANG:
+        // negate the exit status of the command
+        status = execute_node(node->child) == 0 ? 1 : 0;
+        break;
+    case NODE_BACKGROUND:
+        status = run_background(node);
+        break;
+    case NODE_TIME:
+        status = run_time(node);
+        break;
+    case NODE_COMMAND:
+        status = run_command(node);
+        set_pipe_status(&status, 1);
+        break;
+    }
+    last_exit_status = status;
+    if (tracing) {
+        trace_end(&start, node, status);
+    }
+    return status;
+}
+/*
+ * This function is responsible for the execution of a command line. The line
+ * is parsed once into a tree of nodes which is then executed. Everything
+ * allocated for the line comes from the arena and is released in one go
+ * once it has run.
+ * @param chain      The command to execute as a string
+ * @return           The status of the command which executes
+ */
+int execute_chain(const char *chain) {
+    struct arena_mark mark = arena_mark(&arena);
+    int error;
+    struct pish_node *root = parse_chain(&arena, chain, 0, &error);
+    int status = 0;
+    if (error) {
+        status = 2;
+    }
+    // if the command is empty, do nothing
+    else if (root != NULL) {
+        mark_subshells(root);
+        status = execute_node(root);
+    }
+    arena_release(&arena, mark);
+    return status;
+}
+/*
+ * The lines of a script which set -o batch runs at once. Consecutive lines
+ * which cannot change the state of the shell, as mark_subshells() finds, are
+ * queued until a line which can, an empty line, a syntax error or the end of
+ * the script. Then all of them run at once through parallel_nodes(), each in
+ * a forked copy of the shell, with their stdout written in the order of the
+ * lines. A line only joins the queue if it shares no path with the lines
+ * already in it, see batch_paths(), otherwise it waits for them and starts
+ * the next batch. So mkdir d then cp f d/, or > out then cat out, still run
+ * in order. Paths a command uses without naming them, ie make reading its
+ * Makefile, are not seen: an empty line keeps such lines apart.
+ */
+struct batch {
+    struct pish_node **roots;
+    int count;
+    int capacity;
+    const char **paths; /* The paths the queued lines name, see batch_paths() */
+    int npaths;
+    int paths_capacity;
+    int holding;            /* The arena holds trees of the batch */
+    struct arena_mark mark; /* Where the first tree starts in the arena */
+};
+
+/*
+ * Make a word into an absolute path from the current directory, with . and
+ * .. resolved by hand, so d, ./d/ and e/../d are the same path. Symbolic
+ * links are not followed.
+ * @return          The path, allocated in the arena
+ */
+static const char *batch_path(const char *cwd, const char *word) {
+    char *path = arena_alloc(&arena, strlen(cwd) + strlen(word) + 3);
+    size_t len = 0;
+    const char *parts[] = {*word == '/' ? "" : cwd, word};
+    for (int i = 0; i < 2; i++) {
+        for (const char *s = parts[i]; *s != '\0';) {
+            const char *end = strchrnul(s, '/');
+            size_t n = end - s;
+            if (n == 2 && s[0] == '.' && s[1] == '.') {
+                while (len > 0 && path[--len] != '/') {
                 }
-                // if we are not in script mode and the file is stdin, print a
-                // new line
-                if (!script_mode && isatty(fileno(stdin)))
-                    printf("\n");
-                return last_exit_status;
+            } else if (n > 0 && !(n == 1 && s[0] == '.')) {
+                path[len++] = '/';
+                memcpy(path + len, s, n);
+                len += n;
             }
-            // null-terminate the buffer at the new line character (enter
-            // character)
-            line_buffer[strcspn(line_buffer, "\n")] = '\0';
+            s = *end == '/' ? end + 1 : end;
+        }
+    }
+    if (len == 0) {
+        path[len++] = '/';
+    }
+    path[len] = '\0';
+    return path;
+}
 
-            char *trimmed_line = trim_whitespace(line_buffer);
-            // if this is the first line of a command then store it in
-            // full_command
-            if (full_command == NULL) {
-                full_command = strdup(trimmed_line);
-                if (full_command == NULL) {
-                    perror("strdup failed");
-                    exit(EXIT_FAILURE);
-                }
+/*
+ * Add a path to the ones of the batch
+ */
+static void batch_add_path(struct batch *batch, const char *cwd,
+                           const char *word) {
+    if (batch->npaths == batch->paths_capacity) {
+        batch->paths_capacity =
+            batch->paths_capacity ? batch->paths_capacity * 2 : 64;
+        batch->paths = realloc(batch->paths, batch->paths_capacity *
+                                                 sizeof(*batch->paths));
+        if (batch->paths == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    batch->paths[batch->npaths++] = batch_path(cwd, word);
+}
+
+/*
+ * Add the paths a tree names to the batch: the arguments of its commands
+ * which are not options, or the value of an --option=value, the values of
+ * their assignments, their names when they have a /, and the files they
+ * redirect. Numbers are not paths, ie the mode of chmod 644 or sleep 0.5.
+ * @param cwd       The current directory, which a batch cannot change
+ * @return          1 if the paths are known, 0 if a word still has to be
+ * expanded, which could name any path
+ */
+static int batch_paths(struct batch *batch, struct pish_node *node,
+                       const char *cwd) {
+    if (node == NULL) {
+        return 1;
+    }
+    if (node->flags & NODE_EXPAND) {
+        return 0;
+    }
+    int known = 1;
+    switch (node->kind) {
+    case NODE_SEQUENCE:
+    case NODE_PIPELINE:
+        for (int i = 0; i < node->nchildren; i++) {
+            known &= batch_paths(batch, node->children[i], cwd);
+        }
+        return known;
+    case NODE_AND:
+    case NODE_OR:
+        return batch_paths(batch, node->left, cwd) &&
+               batch_paths(batch, node->right, cwd);
+    case NODE_SUBSHELL:
+    case NODE_BANG:
+    case NODE_BACKGROUND:
+    case NODE_TIME:
+        known = batch_paths(batch, node->child, cwd);
+        break;
+    case NODE_COMMAND:
+        for (int i = 0; i < node->nassigns; i++) {
+            const char *value = strchr(node->assigns[i], '=') + 1;
+            if (*value != '\0') {
+                batch_add_path(batch, cwd, value);
+            }
+        }
+        for (int i = 0; i < node->argc; i++) {
+            const char *word = node->argv[i];
+            if (word[0] == '-') {
+                word = strchr(word, '=') ? strchr(word, '=') + 1 : "";
+            }
+            int number = isdigit((unsigned char)word[0]) &&
+                         word[strspn(word, "0123456789.")] == '\0';
+            if ((i > 0 || strchr(word, '/')) && *word != '\0' && !number) {
+                batch_add_path(batch, cwd, word);
+            }
+        }
+        break;
+    }
+    for (int i = 0; i < node->nredirs; i++) {
+        if (node->redirs[i].kind == REDIR_FILE) {
+            batch_add_path(batch, cwd, node->redirs[i].path);
+        }
+    }
+    return known;
+}
+
+/*
+ * Check whether one of the paths of the batch from first on is one of the
+ * paths before first, or is in one of their directories, or the other way
+ */
+static int batch_shares_path(struct batch *batch, int first) {
+    for (int i = first; i < batch->npaths; i++) {
+        for (int j = 0; j < first; j++) {
+            const char *a = batch->paths[i];
+            const char *b = batch->paths[j];
+            size_t la = strlen(a);
+            size_t lb = strlen(b);
+            const char *longer = la > lb ? a : b;
+            size_t shorter = la > lb ? lb : la;
+            if (strncmp(a, b, shorter) == 0 &&
+                (longer[shorter] == '\0' || longer[shorter] == '/' ||
+                 shorter == 1)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Run the lines queued in a batch and take the status of the last one. A
+ * single line runs in the shell itself.
+ */
+static void batch_run(struct batch *batch) {
+    if (batch->count == 1) {
+        last_exit_status = execute_node(batch->roots[0]);
+    } else if (batch->count > 1) {
+        int *statuses = arena_alloc(&arena, batch->count * sizeof(int));
+        parallel_nodes(batch->roots, batch->count, execute_node, statuses);
+        last_exit_status = statuses[batch->count - 1];
+    }
+    batch->count = 0;
+}
+/*
+ * Release the arena from the first tree of the batch on, or from mark when
+ * the batch holds nothing
+ */
+static void batch_release(struct batch *batch, struct arena_mark mark) {
+    arena_release(&arena, batch->holding ? batch->mark : mark);
+    batch->holding = 0;
+    batch->npaths = 0;
+}
+/*
+ * Queue a command line of a script in the batch, or run it once the lines
+ * queued before it have run
+ * @param root      The parsed line, NULL for an empty one
+ * @param mark      Where the arena stood before root was parsed
+ */
+static void batch_node(struct batch *batch, struct pish_node *root,
+                       struct arena_mark mark) {
+    char cwd[PATH_MAX];
+    int first = batch->npaths;
+    if (root != NULL && mark_subshells(root) && getcwd(cwd, sizeof(cwd)) &&
+        batch_paths(batch, root, cwd)) {
+        // the line waits for the queued ones it shares a path with, its own
+        // paths are the first ones of the next batch
+        if (batch_shares_path(batch, first)) {
+            batch_run(batch);
+            memmove(batch->paths, batch->paths + first,
+                    (batch->npaths - first) * sizeof(*batch->paths));
+            batch->npaths -= first;
+        }
+        if (batch->count == batch->capacity) {
+            batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+            batch->roots = realloc(batch->roots,
+                                   batch->capacity * sizeof(*batch->roots));
+            if (batch->roots == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
             }
-            // otherwise, handle the successive execution
-            else {
-                const char *separator;
-                // continutation type = 1 means it ends with a \ character,
-                // otherwise its a && or a || or a |
-                if (continuation_type == 1) {
-                    separator = "";
-                } else {
-                    separator = " ";
+        }
+        batch->roots[batch->count++] = root;
+        if (!batch->holding) {
+            batch->mark = mark;
+            batch->holding = 1;
+        }
+        return;
+    }
+    batch_run(batch);
+    last_exit_status = root != NULL ? execute_node(root) : 0;
+    batch_release(batch, mark);
+}
+/*
+ * Queue a command line of a script in the batch, see batch_node(). A line
+ * with a syntax error runs through execute_chain() after the batch, so the
+ * error is reported where the line is.
+ */
+static void batch_line(struct batch *batch, const char *chain) {
+    struct arena_mark mark = arena_mark(&arena);
+    int error;
+    struct pish_node *root = parse_chain(&arena, chain, PARSE_QUIET, &error);
+    if (error) {
+        batch_run(batch);
+        batch_release(batch, mark);
+        last_exit_status = execute_chain(chain);
+        return;
+    }
+    batch_node(batch, root, mark);
+}
+/*
+ * Run what is left in the batch, ie at the end of the script
+ */
+static void batch_finish(struct batch *batch) {
+    batch_run(batch);
+    batch_release(batch, arena_mark(&arena));
+    free(batch->roots);
+    batch->roots = NULL;
+    batch->capacity = 0;
+    free(batch->paths);
+    batch->paths = NULL;
+    batch->paths_capacity = 0;
+}
+/*
+ * Trim the whitespace of a line whose length is already known, without
+ * scanning it with strlen()
+ * @param line      The line to trim, it is NUL-terminated again in place
+ * @param len       The length of the line, updated to the trimmed length
+ * @return          The start of the trimmed line
+ */
+static char *trim_line(char *line, size_t *len) {
+    char *end = line + *len;
+    while (line < end && isspace((unsigned char)*line)) {
+        line++;
+    }
+    while (end > line && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    *len = end - line;
+    return line;
+}
+/*
+ * Read the next line of the input, through the line editor when the shell
+ * is interactive on a terminal
+ */
+static ssize_t next_line(struct pish_reader *reader, char **line) {
+    // what was traced is written before the shell waits for its user
+    if (!script_mode) {
+        trace_flush();
+    }
+    if (line_editing && !script_mode) {
+        return edit_line(prompt_text.data, line);
+    }
+    // the history waiting to be written is written when it is due, the
+    // line editor does the same while it waits for a key
+    int due;
+    while (!script_mode && (due = history_flush_timeout()) >= 0 &&
+           !reader_wait(reader, due)) {
+    }
+    return read_line(reader, line);
+}
+/*
+ * Read one command from the input, joining the lines of a command which
+ * continues, ie ends in \, && or || or has a ( or quote open, and the lines
+ * of its here-documents. Each line is scanned once by scan_line(), which
+ * keeps where the command stands between lines.
+ * @param reader    The input to read from
+ * @param command   Set to the command with its whitespace trimmed
+ * @return          0 if a command was read, 1 if the input ended in the middle
+ * of the command which was read, -1 if there is no more input
+ */
+static int read_command(struct pish_reader *reader,
+                        struct pish_buf *command) {
+    struct pish_scan scan;
+    enum scan_result joint = SCAN_DONE;
+    int first_line = 1;
+    scan_begin(&scan);
+    buf_set(command, "", 0);
+    do {
+        char *line;
+        ssize_t line_len = next_line(reader, &line);
+        // if there is no more lines, the previously stored command is all
+        // there is
+        if (line_len < 0) {
+            scan_end(&scan);
+            return first_line ? -1 : 1;
+        }
+        size_t len = line_len;
+        // a line inside quotes is part of a word and kept as it is
+        char *trimmed_line =
+            joint == SCAN_QUOTE ? line : trim_line(line, &len);
+        // the end of the previous line decides how this one is joined to it
+        if (joint == SCAN_JOIN) {
+            buf_append(command, " ", 1);
+        } else if (joint == SCAN_NEWLINE && len > 0) {
+            buf_append(command, "; ", 2);
+        } else if (joint == SCAN_QUOTE) {
+            buf_append(command, "\n", 1);
+        }
+        // an empty line changes nothing, the command goes on like it did
+        if (len > 0 || first_line) {
+            joint = scan_line(&scan, trimmed_line, &len);
+        }
+        buf_append(command, trimmed_line, len);
+        first_line = 0;
+        // the lines after a << are its here-document, kept as they are
+        if (scan.ndocs > 0) {
+            ssize_t doc_len;
+            do {
+                if (!script_mode) {
+                    show_prompt("> ", 2);
                 }
-                // need to keep track of lengths to modify full_command size in
-                // memory
-                size_t old_len = strlen(full_command);
-                size_t sep_len = strlen(separator);
-                size_t new_part_len = strlen(trimmed_line);
-                // allocate more memory for the additional lines
-                char *new_full_command =
-                    realloc(full_command, old_len + sep_len + new_part_len + 1);
-                if (new_full_command == NULL) {
-                    perror("realloc failed");
-                    exit(EXIT_FAILURE);
+                doc_len = next_line(reader, &line);
+                if (doc_len < 0) {
+                    scan_end(&scan);
+                    return 1;
                 }
-                full_command = new_full_command;
-                // add the added lines and the corresponding space if it needs
-                // one
-                strcat(full_command, separator);
-                strcat(full_command, trimmed_line);
+                buf_append(command, "\n", 1);
+                buf_append(command, line, doc_len);
+            } while (scan_document(&scan, line, doc_len) > 0);
+            // the next line is joined after the break which ends the last
+            if (joint != SCAN_DONE) {
+                buf_append(command, "\n", 1);
             }
-
-            continuation_type = check_for_continuation(full_command);
-            // print out the continuation message if it isn't in script mode
-            if (continuation_type != 0 && !script_mode) {
-                printf("> ");
+        }
+        // print out the continuation message if it isn't in script mode
+        if (joint != SCAN_DONE && !script_mode) {
+            show_prompt("> ", 2);
+        }
+    } while (joint != SCAN_DONE);
+    scan_end(&scan);
+    return 0;
+}
+/*
+ * The main loop of pish.
+ * @param fd    The input for the shell, stdin or a script
+ * @return      Returns the exit status of the shell
+ */
+int pish(int fd) {
+    struct pish_reader reader;
+    struct pish_buf full_command = {0};
+    struct batch batch = {0};
+    reader_init(&reader, fd);
+    while (1) {
+        // prompt the user if the shell is not in script mode
+        if (!script_mode) {
+            jobs_notify();
+            prompt();
+        } else {
+            jobs_reap();
+        }
+        int result = read_command(&reader, &full_command);
+        if (result < 0) {
+            break;
+        }
+        // replace history events such as !! and !n, like other shells this
+        // is only done for interactive input
+        if (!script_mode) {
+            int history_error;
+            char *expanded = expand_history(full_command.data, &history_error);
+            if (history_error) {
+                buf_set(&full_command, "", 0);
+            } else if (expanded) {
+                // show the command which is actually run
+                printf("%s\n", expanded);
                 fflush(stdout);
+                buf_set(&full_command, expanded, strlen(expanded));
+                free(expanded);
+            }
+        }
+        if (script_mode && option_batch) {
+            // the line may wait in the batch, see struct batch
+            if (full_command.len > 0) {
+                batch_line(&batch, full_command.data);
+            } else {
+                batch_node(&batch, NULL, arena_mark(&arena));
             }
-        } while (continuation_type != 0);
-        // if the full command isn't null or empty
-        if (full_command && strlen(full_command) > 0) {
+        }
+        // if the full command isn't empty
+        else if (full_command.len > 0) {
             // add the command to history
             if (!script_mode) {
-                char *history_copy = strdup(full_command);
-                if (history_copy == NULL) {
-                    perror("strdup failed for history");
-                    exit(EXIT_FAILURE);
-                }
-                struct pish_arg history_arg;
-                parse_command(history_copy, &history_arg);
-                if (history_arg.argc > 0) {
-                    add_history(&history_arg);
-                }
-                for (int i = 0; i < history_arg.argc; i++) {
-                    free(history_arg.argv[i]);
-                }
-                free(history_copy);
+                add_history(full_command.data);
             }
             // execute the command chain
-            char *command_copy = strdup(full_command);
-            if (command_copy == NULL) {
-                perror("strdup failed");
-                exit(EXIT_FAILURE);
-            }
-            last_exit_status = execute_chain(command_copy);
-            free(command_copy);
+            last_exit_status = execute_chain(full_command.data);
         } else {
             last_exit_status = 0;
         }
-        if (full_command) {
-            free(full_command);
-            full_command = NULL;
+        if (result > 0) {
+            break;
         }
     }
+    batch_finish(&batch);
+    // if we are not in script mode and the file is stdin, print a new line
+    if (!script_mode && isatty(fileno(stdin)))
+        printf("\n");
+    buf_free(&full_command);
+    reader_free(&reader);
     return last_exit_status;
 }
+/*
+ * Parse every command of a script into the cache, without running anything.
+ * Commands with a syntax error are kept as text so the error is reported
+ * when the command is reached, like it is without the cache.
+ * @param cache     The cache to fill, see cache_begin()
+ * @param path      The path of the script
+ * @param fd        The open script
+ */
+static void compile_script(struct script_cache *cache, const char *path,
+                           int fd) {
+    struct pish_reader reader;
+    struct pish_buf command = {0};
+    reader_init(&reader, fd);
+    cache_begin(cache, fd, path);
+    int result = 0;
+    while (result == 0 && (result = read_command(&reader, &command)) >= 0) {
+        if (command.len == 0) {
+            cache_add(cache, UNIT_EMPTY, NULL, NULL);
+            continue;
+        }
+        struct arena_mark mark = arena_mark(&arena);
+        int error;
+        struct pish_node *root =
+            parse_chain(&arena, command.data, PARSE_QUIET, &error);
+        if (error) {
+            cache_add(cache, UNIT_TEXT, NULL, command.data);
+        } else if (root == NULL) {
+            cache_add(cache, UNIT_EMPTY, NULL, NULL);
+        } else {
+            cache_add(cache, UNIT_TREE, root, NULL);
+        }
+        arena_release(&arena, mark);
+    }
+    cache_finish(cache, path);
+    buf_free(&command);
+    reader_free(&reader);
+}
+/*
+ * Run a script through the compiled script cache. The parsed script is
+ * mapped from the cache when it is up to date, otherwise the script is
+ * compiled and the cache written before it runs.
+ * @param path      The path of the script
+ * @param fd        The open script
+ * @return          The exit status of the last command
+ */
+static int run_cached_script(const char *path, int fd) {
+    struct script_cache cache;
+    if (cache_open(&cache, path, fd) < 0) {
+        compile_script(&cache, path, fd);
+    }
+    struct batch batch = {0};
+    while (1) {
+        struct arena_mark mark = arena_mark(&arena);
+        struct pish_node *root;
+        const char *text;
+        enum cache_unit unit = cache_next(&cache, &arena, &root, &text);
+        if (unit == UNIT_END) {
+            arena_release(&arena, mark);
+            break;
+        }
+        jobs_reap();
+        if (option_batch) {
+            // the line may wait in the batch, see struct batch
+            if (unit == UNIT_TEXT) {
+                batch_run(&batch);
+                batch_release(&batch, mark);
+                last_exit_status = execute_chain(text);
+            } else {
+                batch_node(&batch, unit == UNIT_TREE ? root : NULL, mark);
+            }
+            continue;
+        }
+        if (unit == UNIT_TREE) {
+            mark_subshells(root);
+            last_exit_status = execute_node(root);
+        } else if (unit == UNIT_TEXT) {
+            last_exit_status = execute_chain(text);
+        } else {
+            last_exit_status = 0;
+        }
+        arena_release(&arena, mark);
+    }
+    batch_finish(&batch);
+    cache_close(&cache);
+    return last_exit_status;
+}
+/*
+ * Run a script in script mode, through the script cache if it is enabled
+ * @param path      The path of the script
+ * @return          The exit status of pish for the script
+ */
+static int run_script(const char *path) {
+    script_mode = 1;
+    jobs_init(0);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    if (cache_enabled()) {
+        run_cached_script(path, fd);
+    } else {
+        pish(fd);
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
+/*
+ * Run the command of a $(...) in its forked child, with stdout already
+ * going to the pipe the shell reads
+ * @param chain     The command line inside the parentheses
+ */
+static void substitute_child(const char *chain) {
+    // the jobs of the parent are not children of the substitution
+    jobs_forget();
+    child_exit(execute_chain(chain));
+}
+/*
+ * Run a request of a --serve client, in a forked copy of a worker
+ * @param kind      Whether arg is a script or a command line
+ * @return          The exit status to send to the client
+ */
+static int run_request(enum serve_kind kind, const char *arg) {
+    if (kind == SERVE_SCRIPT) {
+        return run_script(arg);
+    }
+    script_mode = 1;
+    jobs_init(0);
+    return execute_chain(arg);
+}
 
 /*
  * The entry point of the pish program.
- * @param argv      Stores the script which the shell should run
+ * @param argv      Stores the script which the shell should run, or
+ *                  --serve SOCKET [WORKERS], or --client SOCKET script, or
+ *                  --client SOCKET -c command, see pish_serve.h
  */
 int main(int argc, char *argv[]) {
+    static const struct expand_shell expand_hooks = {
+        substitute_child, &last_exit_status, &pipe_status, &npipe_status};
+    profile_init();
+    trace_init();
+    expand_init(&expand_hooks);
     // if there is no script, assume the input is stdin
     if (argc == 1) {
-        pish(stdin);
+        // the history is loaded when it is first used
+        jobs_init(1);
+        line_editing = edit_available();
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+            complete_add_builtin(builtins[i].name);
+        }
+        pish(STDIN_FILENO);
     }
     // run the shell in script mode if there is a script to run
     else if (argc == 2) {
-        script_mode = 1;
-        FILE *fp = fopen(argv[1], "r");
-        if (fp == NULL) {
-            perror(argv[1]);
-            return EXIT_FAILURE;
-        }
-        pish(fp);
-        fclose(fp);
+        return run_script(argv[1]);
+    } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "--serve") == 0) {
+        int workers = argc == 4 ? atoi(argv[3]) : SERVE_WORKERS;
+        return serve_main(argv[2], workers, run_request);
+    } else if (argc == 4 && strcmp(argv[1], "--client") == 0) {
+        return client_main(argv[2], SERVE_SCRIPT, argv[3]);
+    } else if (argc == 5 && strcmp(argv[1], "--client") == 0 &&
+               strcmp(argv[3], "-c") == 0) {
+        return client_main(argv[2], SERVE_COMMAND, argv[4]);
     } else {
         usage_error();
         exit(1);
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pish_arena.h"
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *prev; /* The block which was current before this one */
+    size_t size;              /* Usable bytes in data */
+    size_t used;
+    size_t last;              /* Offset of the most recent allocation */
+    char data[];
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/*
+ * Start a new block holding at least size bytes, reusing a released block
+ * when it is big enough
+ */
+static void new_block(struct pish_arena *arena, size_t size) {
+    struct arena_block *block = arena->spare;
+    if (block != NULL && block->size >= size) {
+        arena->spare = block->prev;
+    } else {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (block == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        block->size = block_size;
+    }
+    block->used = 0;
+    block->last = 0;
+    block->prev = arena->current;
+    arena->current = block;
+}
+
+/*
+ * Allocate size bytes, aligned for any type, from the arena
+ */
+void *arena_alloc(struct pish_arena *arena, size_t size) {
+    size = align_up(size ? size : 1);
+    struct arena_block *block = arena->current;
+    if (block == NULL || block->size - block->used < size) {
+        new_block(arena, size);
+        block = arena->current;
+    }
+    block->last = block->used;
+    block->used += size;
+    return block->data + block->last;
+}
+
+/*
+ * Grow an allocation, like realloc(). The most recent allocation grows in
+ * place when its block has room, otherwise the contents are copied.
+ */
+void *arena_grow(struct pish_arena *arena, void *ptr, size_t old_size,
+                 size_t new_size) {
+    struct arena_block *block = arena->current;
+    if (ptr != NULL && block != NULL && (char *)ptr == block->data + block->last &&
+        block->last + align_up(new_size) <= block->size) {
+        block->used = block->last + align_up(new_size);
+        return ptr;
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (ptr != NULL) {
+        memcpy(grown, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return grown;
+}
+
+/*
+ * Copy len bytes of str into the arena as a NUL-terminated string
+ */
+char *arena_strndup(struct pish_arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*
+ * Remember the current position of the arena, see arena_release()
+ */
+struct arena_mark arena_mark(struct pish_arena *arena) {
+    struct arena_mark mark = {arena->current,
+                              arena->current ? arena->current->used : 0};
+    return mark;
+}
+
+/*
+ * Free everything allocated since mark was taken. The blocks which are no
+ * longer used are kept for later allocations.
+ */
+void arena_release(struct pish_arena *arena, struct arena_mark mark) {
+    while (arena->current != NULL && arena->current != mark.block) {
+        struct arena_block *block = arena->current;
+        arena->current = block->prev;
+        block->prev = arena->spare;
+        arena->spare = block;
+    }
+    if (arena->current != NULL) {
+        arena->current->used = mark.used;
+        arena->current->last = mark.used;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __PISH_ARENA_H__
+#define __PISH_ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * A bump allocator for everything that only lives while one command line is
+ * parsed and executed: tokens, argv arrays, nodes of the tree and so on.
+ * Nothing is freed on its own, the whole arena is released in one call once
+ * the command line is done. Released blocks are kept and reused by the next
+ * command line, so a long-lived shell stops calling malloc for parsing.
+ * A zeroed struct pish_arena is an empty arena.
+ */
+struct arena_block;
+
+struct pish_arena {
+    struct arena_block *current; /* The block allocations come from */
+    struct arena_block *spare;   /* Released blocks waiting to be reused */
+};
+
+/*
+ * A position in the arena. Releasing to it frees everything allocated after
+ * arena_mark() returned it, which lets nested users share one arena.
+ */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+};
+
+void *arena_alloc(struct pish_arena *arena, size_t size);
+void *arena_grow(struct pish_arena *arena, void *ptr, size_t old_size,
+                 size_t new_size);
+char *arena_strndup(struct pish_arena *arena, const char *str, size_t len);
+struct arena_mark arena_mark(struct pish_arena *arena);
+void arena_release(struct pish_arena *arena, struct arena_mark mark);
+
+#endif // __PISH_ARENA_H__
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pish_buf.h"
+
+/*
+ * Make room for extra more bytes plus the NUL terminator
+ */
+void buf_reserve(struct pish_buf *buf, size_t extra) {
+    if (buf->len + extra + 1 <= buf->cap) {
+        return;
+    }
+    size_t cap = buf->cap ? buf->cap : 64;
+    while (cap < buf->len + extra + 1) {
+        cap *= 2;
+    }
+    char *grown = realloc(buf->data, cap);
+    if (grown == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    buf->data = grown;
+    buf->cap = cap;
+}
+
+/*
+ * Append len bytes of str to the buffer
+ */
+void buf_append(struct pish_buf *buf, const char *str, size_t len) {
+    buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+/*
+ * Replace the contents of the buffer with len bytes of str
+ */
+void buf_set(struct pish_buf *buf, const char *str, size_t len) {
+    buf->len = 0;
+    buf_append(buf, str, len);
+}
+
+/*
+ * Release the memory of the buffer, leaving it empty
+ */
+void buf_free(struct pish_buf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
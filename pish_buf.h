@@ -0,0 +1,23 @@
+#ifndef __PISH_BUF_H__
+#define __PISH_BUF_H__
+
+#include <stddef.h>
+
+/*
+ * A growable string. data is always NUL-terminated once anything has been
+ * appended, and len is tracked so appending never needs strlen. The capacity
+ * doubles, so building a string of n bytes costs O(n).
+ * A zeroed struct pish_buf is an empty buffer.
+ */
+struct pish_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+void buf_reserve(struct pish_buf *buf, size_t extra);
+void buf_append(struct pish_buf *buf, const char *str, size_t len);
+void buf_set(struct pish_buf *buf, const char *str, size_t len);
+void buf_free(struct pish_buf *buf);
+
+#endif // __PISH_BUF_H__
@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pish_builtins.h"
+
+/*
+ * How octal escapes are written, which differs between the format of printf
+ * and echo -e or the %b conversion of printf
+ */
+enum escape_style {
+    ESCAPE_FORMAT, /* \NNN */
+    ESCAPE_BOTH,   /* \0NNN and \NNN */
+};
+
+static int is_octal(char c) {
+    return c >= '0' && c <= '7';
+}
+
+/*
+ * Print the character one backslash escape stands for
+ * @param s         The escape, right after the backslash
+ * @param style     Which octal escapes are understood
+ * @param stop      Set to 1 for \c, which ends all output
+ * @return          The first character after the escape
+ */
+static const char *print_escape(const char *s, enum escape_style style,
+                                int *stop) {
+    int value;
+    int digits = 0;
+    switch (*s) {
+    case 'a':
+        putchar('\a');
+        return s + 1;
+    case 'b':
+        putchar('\b');
+        return s + 1;
+    case 'c':
+        *stop = 1;
+        return s + 1;
+    case 'e':
+        putchar('\033');
+        return s + 1;
+    case 'f':
+        putchar('\f');
+        return s + 1;
+    case 'n':
+        putchar('\n');
+        return s + 1;
+    case 'r':
+        putchar('\r');
+        return s + 1;
+    case 't':
+        putchar('\t');
+        return s + 1;
+    case 'v':
+        putchar('\v');
+        return s + 1;
+    case '\\':
+        putchar('\\');
+        return s + 1;
+    case 'x':
+        if (!isxdigit((unsigned char)s[1])) {
+            break;
+        }
+        value = 0;
+        for (s++; digits < 2 && isxdigit((unsigned char)*s); s++, digits++) {
+            int c = tolower((unsigned char)*s);
+            value = value * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        }
+        putchar(value);
+        return s;
+    }
+    if (is_octal(*s)) {
+        // \0NNN has up to three digits after the 0
+        if (*s == '0' && style != ESCAPE_FORMAT) {
+            s++;
+        }
+        value = 0;
+        for (; digits < 3 && is_octal(*s); s++, digits++) {
+            value = value * 8 + *s - '0';
+        }
+        putchar(value & 0xff);
+        return s;
+    }
+    if (style == ESCAPE_FORMAT && *s == '"') {
+        putchar('"');
+        return s + 1;
+    }
+    // not an escape, the backslash is printed as is
+    putchar('\\');
+    return s;
+}
+
+/*
+ * Print a string with its backslash escapes replaced
+ * @return          1 if a \c ended all output
+ */
+static int print_escaped(const char *s, enum escape_style style) {
+    int stop = 0;
+    while (*s && !stop) {
+        if (*s == '\\' && s[1] != '\0') {
+            s = print_escape(s + 1, style, &stop);
+        } else {
+            putchar(*s++);
+        }
+    }
+    return stop;
+}
+
+/*
+ * echo [-neE] [string ...], like /bin/echo an argument which is not a valid
+ * set of options is printed
+ */
+int builtin_echo(int argc, char **argv) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        const char *c = argv[i] + 1;
+        while (*c == 'n' || *c == 'e' || *c == 'E') {
+            c++;
+        }
+        if (*c != '\0') {
+            break;
+        }
+        for (c = argv[i] + 1; *c; c++) {
+            if (*c == 'n') {
+                newline = 0;
+            } else {
+                escapes = *c == 'e';
+            }
+        }
+    }
+    for (int first = i; i < argc; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        if (!escapes) {
+            fputs(argv[i], stdout);
+        } else if (print_escaped(argv[i], ESCAPE_BOTH)) {
+            return 0;
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+/*
+ * Convert a numeric argument of printf, which may also be a character such
+ * as 'a to get its value
+ * @param status    Set to 1 if the argument is not a valid number
+ */
+static long long printf_number(const char *arg, int *status) {
+    if (arg == NULL || *arg == '\0') {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (errno == ERANGE && arg[0] != '-') {
+        // too big to be signed, like 0xffffffffffffffff for %x
+        errno = 0;
+        value = (long long)strtoull(arg, &end, 0);
+    }
+    if (errno == ERANGE) {
+        fprintf(stderr, "printf: '%s': %s\n", arg, strerror(errno));
+        *status = 1;
+    } else if (*end != '\0' || end == arg) {
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+static double printf_double(const char *arg, int *status) {
+    if (arg == NULL || *arg == '\0') {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    double value = strtod(arg, &end);
+    if (*end != '\0' || end == arg) {
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+/*
+ * printf format [argument ...]. The format is used again as long as there are
+ * arguments left, missing arguments are empty strings or 0.
+ */
+int builtin_printf(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "printf: missing operand\n");
+        return 1;
+    }
+    const char *format = argv[1];
+    char **args = argv + 2;
+    int nargs = argc - 2;
+    int used = 0;
+    int status = 0;
+    do {
+        int used_before = used;
+        const char *f = format;
+        while (*f) {
+            if (*f == '\\' && f[1] != '\0') {
+                int stop = 0;
+                f = print_escape(f + 1, ESCAPE_FORMAT, &stop);
+                if (stop) {
+                    return status;
+                }
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f++);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f += 2;
+                continue;
+            }
+            // copy the flags, width and precision into a format of our own
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *f++;
+            while (*f && strchr("-+ #0", *f) && n < 8) {
+                spec[n++] = *f++;
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*f != '.') {
+                        break;
+                    }
+                    spec[n++] = *f++;
+                }
+                if (*f == '*') {
+                    const char *arg = used < nargs ? args[used++] : NULL;
+                    n += snprintf(spec + n, 16, "%d",
+                                  (int)printf_number(arg, &status));
+                    f++;
+                } else {
+                    for (int digits = 0; isdigit((unsigned char)*f); f++) {
+                        if (digits++ < 9) {
+                            spec[n++] = *f;
+                        }
+                    }
+                }
+            }
+            char conversion = *f;
+            if (conversion == '\0' ||
+                !strchr("sbcdiouxXeEfFgGaA", conversion)) {
+                fflush(stdout);
+                fprintf(stderr,
+                        "printf: %%%c: invalid conversion specification\n",
+                        conversion);
+                return 1;
+            }
+            f++;
+            const char *arg = used < nargs ? args[used++] : NULL;
+            switch (conversion) {
+            case 's':
+                strcpy(spec + n, "s");
+                printf(spec, arg ? arg : "");
+                break;
+            case 'b':
+                if (arg != NULL && print_escaped(arg, ESCAPE_BOTH)) {
+                    return status;
+                }
+                break;
+            case 'c':
+                strcpy(spec + n, "c");
+                printf(spec, arg ? arg[0] : '\0');
+                break;
+            case 'd':
+            case 'i':
+                strcpy(spec + n, "lld");
+                printf(spec, printf_number(arg, &status));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                printf(spec, (unsigned long long)printf_number(arg, &status));
+                break;
+            default:
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                printf(spec, printf_double(arg, &status));
+                break;
+            }
+        }
+        // a format which takes no arguments is only printed once
+        if (used == used_before) {
+            break;
+        }
+    } while (used < nargs);
+    return status;
+}
+
+/*
+ * pwd [-L|-P], print the current directory
+ */
+int builtin_pwd(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") != 0 && strcmp(argv[i], "-P") != 0) {
+            fprintf(stderr, "pwd: invalid option -- '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+/*
+ * The arguments of a test expression and how far it has been read
+ */
+struct test_expr {
+    const char *name; /* test or [, for error messages */
+    char **argv;
+    int argc;
+    int pos;
+    int error;
+};
+
+static int test_or(struct test_expr *t);
+
+static int is_unary_op(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+           strchr("bcdefgGhLknOprsStuwxz", op[1]) != NULL;
+}
+
+static int is_binary_op(const char *op) {
+    static const char *ops[] = {"=",   "==",  "!=",  "<",   ">",
+                                "-eq", "-ne", "-lt", "-le", "-gt",
+                                "-ge", "-nt", "-ot", "-ef", NULL};
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static long long test_integer(struct test_expr *t, const char *arg) {
+    char *end;
+    long long value = strtoll(arg, &end, 10);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (*end != '\0' || end == arg) {
+        fprintf(stderr, "%s: invalid integer '%s'\n", t->name, arg);
+        t->error = 1;
+    }
+    return value;
+}
+
+/*
+ * Evaluate a unary file or string test such as -f path or -z string
+ */
+static int test_unary(struct test_expr *t, const char *op, const char *arg) {
+    struct stat st;
+    switch (op[1]) {
+    case 'n':
+        return *arg != '\0';
+    case 'z':
+        return *arg == '\0';
+    case 't':
+        return isatty((int)test_integer(t, arg));
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    }
+    if (stat(arg, &st) != 0) {
+        return 0;
+    }
+    switch (op[1]) {
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'g':
+        return (st.st_mode & S_ISGID) != 0;
+    case 'G':
+        return st.st_gid == getegid();
+    case 'k':
+        return (st.st_mode & S_ISVTX) != 0;
+    case 'O':
+        return st.st_uid == geteuid();
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 'u':
+        return (st.st_mode & S_ISUID) != 0;
+    }
+    return 1; // -e
+}
+
+/*
+ * Evaluate a binary test such as a = b, n -lt m or file -nt file
+ */
+static int test_binary(struct test_expr *t, const char *left, const char *op,
+                       const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    } else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    } else if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        struct stat a, b;
+        int have_a = stat(left, &a) == 0;
+        int have_b = stat(right, &b) == 0;
+        if (op[1] == 'e') {
+            return have_a && have_b && a.st_dev == b.st_dev &&
+                   a.st_ino == b.st_ino;
+        }
+        if (op[1] == 'o') {
+            // -ot is -nt with the files swapped
+            struct stat swap = a;
+            a = b;
+            b = swap;
+            int have = have_a;
+            have_a = have_b;
+            have_b = have;
+        }
+        if (!have_a) {
+            return 0;
+        }
+        return !have_b || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+               (a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+                a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+    }
+    long long a = test_integer(t, left);
+    long long b = test_integer(t, right);
+    if (strcmp(op, "-eq") == 0) {
+        return a == b;
+    } else if (strcmp(op, "-ne") == 0) {
+        return a != b;
+    } else if (strcmp(op, "-lt") == 0) {
+        return a < b;
+    } else if (strcmp(op, "-le") == 0) {
+        return a <= b;
+    } else if (strcmp(op, "-gt") == 0) {
+        return a > b;
+    }
+    return a >= b;
+}
+
+static const char *test_next(struct test_expr *t) {
+    return t->pos < t->argc ? t->argv[t->pos] : NULL;
+}
+
+/*
+ * primary: ( expr ) | ! primary | unary-op operand | operand binary-op
+ * operand | operand
+ */
+static int test_primary(struct test_expr *t) {
+    const char *arg = test_next(t);
+    if (arg == NULL) {
+        fprintf(stderr, "%s: argument expected\n", t->name);
+        t->error = 1;
+        return 0;
+    }
+    t->pos++;
+    if (strcmp(arg, "!") == 0) {
+        return !test_primary(t);
+    }
+    if (strcmp(arg, "(") == 0) {
+        int result = test_or(t);
+        const char *close = test_next(t);
+        if (close == NULL || strcmp(close, ")") != 0) {
+            fprintf(stderr, "%s: ')' expected\n", t->name);
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return result;
+    }
+    const char *next = test_next(t);
+    if (next != NULL && is_binary_op(next) && t->pos + 1 < t->argc) {
+        t->pos += 2;
+        return test_binary(t, arg, next, t->argv[t->pos - 1]);
+    }
+    if (is_unary_op(arg) && next != NULL) {
+        t->pos++;
+        return test_unary(t, arg, next);
+    }
+    return *arg != '\0';
+}
+
+static int test_and(struct test_expr *t) {
+    int result = test_primary(t);
+    while (!t->error && test_next(t) && strcmp(test_next(t), "-a") == 0) {
+        t->pos++;
+        // both sides are always parsed so errors are found
+        int right = test_primary(t);
+        result = result && right;
+    }
+    return result;
+}
+
+static int test_or(struct test_expr *t) {
+    int result = test_and(t);
+    while (!t->error && test_next(t) && strcmp(test_next(t), "-o") == 0) {
+        t->pos++;
+        int right = test_and(t);
+        result = result || right;
+    }
+    return result;
+}
+
+/*
+ * Evaluate up to four arguments with the rules POSIX gives for them, which
+ * decide by the number of arguments whether ie -n is an operator or a string
+ */
+static int test_short(struct test_expr *t, char **argv, int argc) {
+    switch (argc) {
+    case 0:
+        return 0;
+    case 1:
+        return argv[0][0] != '\0';
+    case 2:
+        if (strcmp(argv[0], "!") == 0) {
+            return argv[1][0] == '\0';
+        }
+        if (is_unary_op(argv[0])) {
+            return test_unary(t, argv[0], argv[1]);
+        }
+        break;
+    case 3:
+        if (is_binary_op(argv[1])) {
+            return test_binary(t, argv[0], argv[1], argv[2]);
+        }
+        if (strcmp(argv[1], "-a") == 0 || strcmp(argv[1], "-o") == 0) {
+            break;
+        }
+        if (strcmp(argv[0], "!") == 0) {
+            return !test_short(t, argv + 1, 2);
+        }
+        if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) {
+            return argv[1][0] != '\0';
+        }
+        break;
+    case 4:
+        if (strcmp(argv[0], "!") == 0) {
+            return !test_short(t, argv + 1, 3);
+        }
+        if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) {
+            return test_short(t, argv + 1, 2);
+        }
+        break;
+    }
+    // anything else is parsed as an expression
+    t->argv = argv;
+    t->argc = argc;
+    t->pos = 0;
+    int result = test_or(t);
+    if (!t->error && t->pos < t->argc) {
+        fprintf(stderr, "%s: extra argument '%s'\n", t->name, t->argv[t->pos]);
+        t->error = 1;
+    }
+    return result;
+}
+
+/*
+ * test expression and [ expression ]
+ * @return          0 if the expression is true, 1 if it is false and 2 if it
+ * is invalid
+ */
+int builtin_test(int argc, char **argv) {
+    struct test_expr t = {0};
+    t.name = argv[0];
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    int result = test_short(&t, argv + 1, argc - 1);
+    if (t.error) {
+        return 2;
+    }
+    return result ? 0 : 1;
+}
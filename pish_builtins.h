@@ -0,0 +1,14 @@
+#ifndef __PISH_BUILTINS_H__
+#define __PISH_BUILTINS_H__
+
+/*
+ * Built-in versions of small utilities which scripts run all the time, so
+ * they do not cost a fork and exec of /bin/echo or /bin/[ each. They take the
+ * same arguments and print the same output as the coreutils programs.
+ */
+int builtin_echo(int argc, char **argv);
+int builtin_printf(int argc, char **argv);
+int builtin_pwd(int argc, char **argv);
+int builtin_test(int argc, char **argv);
+
+#endif // __PISH_BUILTINS_H__
@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pish_cache.h"
+
+/*
+ * Layout of a cache file. All integers are in host byte order, the cache is
+ * never shared between machines.
+ *   header     "PISHC" and a version byte, the size, mtime, inode and
+ *              device of the script, the length of the cache file, then
+ *              the length and bytes of the resolved path of the script
+ *   units      one unit byte per command line followed by its contents,
+ *              ending with UNIT_END
+ * A tree is written in prefix order: the kind byte of a node, then the
+ * fields it uses (see struct pish_node), then its children. Commands and
+ * subshells end with a byte for NODE_EXPAND. Strings are written as a
+ * length and the bytes with their NUL so they can be used straight from the
+ * mapping.
+ */
+#define CACHE_MAGIC "PISHC"
+#define CACHE_VERSION 4
+#define NO_STRING UINT32_MAX
+
+struct cache_header {
+    char magic[5];
+    uint8_t version;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t length; /* Of the whole cache file, to catch truncated files */
+};
+
+/*
+ * Caching is opt-in, enable it with PISH_SCRIPT_CACHE=1
+ */
+int cache_enabled(void) {
+    const char *value = getenv("PISH_SCRIPT_CACHE");
+    return value != NULL && *value != '\0' && strcmp(value, "0") != 0;
+}
+
+/*
+ * Fill in the key of a script from its open descriptor
+ */
+static int script_header(int script_fd, struct cache_header *header) {
+    struct stat st;
+    if (fstat(script_fd, &st) < 0) {
+        return -1;
+    }
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, 5);
+    header->version = CACHE_VERSION;
+    header->size = st.st_size;
+    header->mtime_sec = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+    header->ino = st.st_ino;
+    header->dev = st.st_dev;
+    return 0;
+}
+
+/*
+ * Build the path of the cache file of a script, named after a hash of the
+ * resolved path of the script
+ * @param dir       Set to the directory of the cache, if not NULL
+ * @return          A malloc'd path, or NULL if there is nowhere to cache
+ */
+static char *cache_path(const char *resolved, char **dir) {
+    const char *base = getenv("PISH_CACHE_DIR");
+    char *cache_dir;
+    if (base != NULL && *base != '\0') {
+        cache_dir = strdup(base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base != '\0') {
+        if (asprintf(&cache_dir, "%s/pish", base) < 0) {
+            cache_dir = NULL;
+        }
+    } else if ((base = getenv("HOME")) != NULL && *base != '\0') {
+        if (asprintf(&cache_dir, "%s/.cache/pish", base) < 0) {
+            cache_dir = NULL;
+        }
+    } else {
+        return NULL;
+    }
+    if (cache_dir == NULL) {
+        return NULL;
+    }
+    // FNV-1a hash of the path
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = resolved; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ull;
+    }
+    char *path;
+    if (asprintf(&path, "%s/%016llx.pishc", cache_dir,
+                 (unsigned long long)hash) < 0) {
+        path = NULL;
+    }
+    if (dir != NULL) {
+        *dir = cache_dir;
+    } else {
+        free(cache_dir);
+    }
+    return path;
+}
+
+static void reset(struct script_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+/*
+ * Read len bytes at the current position, or NULL if the data is too short
+ */
+static const void *take(struct script_cache *cache, size_t len) {
+    if (cache->len - cache->pos < len) {
+        return NULL;
+    }
+    const void *ptr = cache->data + cache->pos;
+    cache->pos += len;
+    return ptr;
+}
+
+static int take_u32(struct script_cache *cache, uint32_t *value) {
+    const void *ptr = take(cache, sizeof(*value));
+    if (ptr == NULL) {
+        return -1;
+    }
+    memcpy(value, ptr, sizeof(*value));
+    return 0;
+}
+
+static int take_i32(struct script_cache *cache, int *value) {
+    int32_t v;
+    const void *ptr = take(cache, sizeof(v));
+    if (ptr == NULL) {
+        return -1;
+    }
+    memcpy(&v, ptr, sizeof(v));
+    *value = v;
+    return 0;
+}
+
+static int take_u8(struct script_cache *cache, uint8_t *value) {
+    const uint8_t *ptr = take(cache, 1);
+    if (ptr == NULL) {
+        return -1;
+    }
+    *value = *ptr;
+    return 0;
+}
+
+/*
+ * Read a string written by put_string(). It is not copied, the result points
+ * into the cache data.
+ */
+static int take_string(struct script_cache *cache, char **str) {
+    uint32_t len;
+    if (take_u32(cache, &len) < 0) {
+        return -1;
+    }
+    if (len == NO_STRING) {
+        *str = NULL;
+        return 0;
+    }
+    const char *ptr = take(cache, (size_t)len + 1);
+    if (ptr == NULL || ptr[len] != '\0') {
+        return -1;
+    }
+    *str = (char *)ptr;
+    return 0;
+}
+
+/*
+ * Map the cache file of a script if it exists and was built from the same
+ * version of the script.
+ * @param cache         Filled in so cache_next() can run the units
+ * @param script_path   The path the script was opened with
+ * @param script_fd     The open descriptor of the script
+ * @return              0 on a hit, -1 if the script has to be compiled
+ */
+int cache_open(struct script_cache *cache, const char *script_path,
+               int script_fd) {
+    reset(cache);
+    struct cache_header expected;
+    char *resolved = realpath(script_path, NULL);
+    if (resolved == NULL || script_header(script_fd, &expected) < 0) {
+        free(resolved);
+        return -1;
+    }
+    char *path = cache_path(resolved, NULL);
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct cache_header)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(resolved);
+        return -1;
+    }
+    // writable (but private) so the strings can be handed to the executor
+    void *map =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(resolved);
+        return -1;
+    }
+    cache->data = map;
+    cache->len = st.st_size;
+    cache->map_len = st.st_size;
+    const struct cache_header *header = take(cache, sizeof(*header));
+    expected.length = st.st_size;
+    char *cached_path;
+    int hit = memcmp(header, &expected, sizeof(expected)) == 0 &&
+              take_string(cache, &cached_path) == 0 && cached_path != NULL &&
+              strcmp(cached_path, resolved) == 0;
+    free(resolved);
+    if (!hit) {
+        cache_close(cache);
+        return -1;
+    }
+    return 0;
+}
+
+static void put(struct script_cache *cache, const void *data, size_t len) {
+    buf_append(&cache->compiled, data, len);
+}
+
+static void put_u8(struct script_cache *cache, uint8_t value) {
+    put(cache, &value, 1);
+}
+
+static void put_u32(struct script_cache *cache, uint32_t value) {
+    put(cache, &value, sizeof(value));
+}
+
+static void put_i32(struct script_cache *cache, int value) {
+    int32_t v = value;
+    put(cache, &v, sizeof(v));
+}
+
+static void put_string(struct script_cache *cache, const char *str) {
+    if (str == NULL) {
+        put_u32(cache, NO_STRING);
+        return;
+    }
+    size_t len = strlen(str);
+    put_u32(cache, len);
+    put(cache, str, len + 1);
+}
+
+/*
+ * Start compiling a script. Units are collected in memory with cache_add()
+ * and written out by cache_finish().
+ */
+void cache_begin(struct script_cache *cache, int script_fd,
+                 const char *script_path) {
+    reset(cache);
+    struct cache_header header;
+    if (script_header(script_fd, &header) < 0) {
+        memset(&header, 0, sizeof(header));
+    }
+    char *resolved = realpath(script_path, NULL);
+    put(cache, &header, sizeof(header));
+    put_string(cache, resolved ? resolved : script_path);
+    free(resolved);
+}
+
+static void put_redirs(struct script_cache *cache,
+                       const struct pish_node *node) {
+    put_u32(cache, node->nredirs);
+    for (int i = 0; i < node->nredirs; i++) {
+        const struct pish_redir *redir = &node->redirs[i];
+        put_u8(cache, redir->kind);
+        put_i32(cache, redir->fd);
+        put_i32(cache, redir->flags);
+        put_i32(cache, redir->dup_fd);
+        put_string(cache, redir->path);
+    }
+}
+
+static int is_and_or(const struct pish_node *node) {
+    return node != NULL && (node->kind == NODE_AND || node->kind == NODE_OR);
+}
+
+static void put_node(struct script_cache *cache, const struct pish_node *node);
+
+/*
+ * Write the operands of an and-or node whose kind is already written. A
+ * long list like a && b && c is a deep chain of left operands, which is
+ * followed in a loop instead of recursing once per operator. The prefix
+ * order stays the same: the kinds of the operators below from the top
+ * down, the first command, then every right operand from the bottom up.
+ */
+static void put_and_or(struct script_cache *cache,
+                       const struct pish_node *node) {
+    int n = 1;
+    for (const struct pish_node *op = node->left; is_and_or(op);
+         op = op->left) {
+        n++;
+    }
+    const struct pish_node **ops = malloc(n * sizeof(*ops));
+    if (ops == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ops[0] = node;
+    for (int i = 1; i < n; i++) {
+        ops[i] = ops[i - 1]->left;
+        put_u8(cache, ops[i]->kind);
+    }
+    put_node(cache, ops[n - 1]->left);
+    for (int i = n - 1; i >= 0; i--) {
+        put_node(cache, ops[i]->right);
+    }
+    free(ops);
+}
+
+/*
+ * Write a tree in prefix order. A NULL child is written as a 0xff kind.
+ */
+static void put_node(struct script_cache *cache, const struct pish_node *node) {
+    if (node == NULL) {
+        put_u8(cache, 0xff);
+        return;
+    }
+    put_u8(cache, node->kind);
+    switch (node->kind) {
+    case NODE_SEQUENCE:
+    case NODE_PIPELINE:
+        put_u32(cache, node->nchildren);
+        for (int i = 0; i < node->nchildren; i++) {
+            put_node(cache, node->children[i]);
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        put_and_or(cache, node);
+        break;
+    case NODE_SUBSHELL:
+        put_node(cache, node->child);
+        put_redirs(cache, node);
+        put_u8(cache, node->flags & NODE_EXPAND);
+        break;
+    case NODE_BANG:
+    case NODE_BACKGROUND:
+    case NODE_TIME:
+        put_node(cache, node->child);
+        break;
+    case NODE_COMMAND:
+        put_u32(cache, node->nassigns);
+        for (int i = 0; i < node->nassigns; i++) {
+            put_string(cache, node->assigns[i]);
+        }
+        put_u32(cache, node->argc);
+        for (int i = 0; i < node->argc; i++) {
+            put_string(cache, node->argv[i]);
+        }
+        put_redirs(cache, node);
+        put_u8(cache, node->flags & NODE_EXPAND);
+        break;
+    }
+}
+
+/*
+ * Add the next command line of the script being compiled
+ * @param unit      What kind of command line it is
+ * @param root      The parsed tree for UNIT_TREE
+ * @param text      The command line itself for UNIT_TEXT
+ */
+void cache_add(struct script_cache *cache, enum cache_unit unit,
+               const struct pish_node *root, const char *text) {
+    put_u8(cache, unit);
+    if (unit == UNIT_TREE) {
+        put_node(cache, root);
+    } else if (unit == UNIT_TEXT) {
+        put_string(cache, text);
+    }
+}
+
+/*
+ * Finish compiling a script. The cache file is written to a temporary name
+ * and renamed into place, so another pish never maps a partial file.
+ * Afterwards cache_next() runs the units which were just compiled.
+ */
+void cache_finish(struct script_cache *cache, const char *script_path) {
+    put_u8(cache, UNIT_END);
+    uint64_t length = cache->compiled.len;
+    memcpy(cache->compiled.data + offsetof(struct cache_header, length),
+           &length, sizeof(length));
+    char *resolved = realpath(script_path, NULL);
+    char *dir = NULL;
+    char *path = resolved ? cache_path(resolved, &dir) : NULL;
+    char *tmp = NULL;
+    if (path != NULL && asprintf(&tmp, "%s.%d", path, (int)getpid()) >= 0) {
+        // create the cache directory, along with ~/.cache if needed
+        char *slash = strrchr(dir, '/');
+        if (mkdir(dir, 0700) < 0 && errno == ENOENT && slash != NULL) {
+            *slash = '\0';
+            mkdir(dir, 0700);
+            *slash = '/';
+            mkdir(dir, 0700);
+        }
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            ssize_t written =
+                write(fd, cache->compiled.data, cache->compiled.len);
+            close(fd);
+            if (written == (ssize_t)cache->compiled.len) {
+                rename(tmp, path);
+            } else {
+                unlink(tmp);
+            }
+        }
+    }
+    free(tmp);
+    free(path);
+    free(dir);
+    free(resolved);
+    // run straight from the compiled data, past the header and path
+    cache->data = cache->compiled.data;
+    cache->len = cache->compiled.len;
+    cache->pos = sizeof(struct cache_header);
+    char *skipped;
+    take_string(cache, &skipped);
+}
+
+static int take_redirs(struct script_cache *cache, struct pish_arena *arena,
+                       struct pish_node *node) {
+    uint32_t n;
+    if (take_u32(cache, &n) < 0 || n > cache->len) {
+        return -1;
+    }
+    node->nredirs = n;
+    node->redirs = n ? arena_alloc(arena, n * sizeof(struct pish_redir)) : NULL;
+    for (uint32_t i = 0; i < n; i++) {
+        struct pish_redir *redir = &node->redirs[i];
+        uint8_t kind;
+        if (take_u8(cache, &kind) < 0 || take_i32(cache, &redir->fd) < 0 ||
+            take_i32(cache, &redir->flags) < 0 ||
+            take_i32(cache, &redir->dup_fd) < 0 ||
+            take_string(cache, &redir->path) < 0) {
+            return -1;
+        }
+        redir->kind = kind;
+    }
+    return 0;
+}
+
+static int take_node(struct script_cache *cache, struct pish_arena *arena,
+                     struct pish_node **out);
+
+/*
+ * Read whether the parser flagged a node with NODE_EXPAND, the only flag
+ * which is cached
+ */
+static int take_expand_flag(struct script_cache *cache,
+                            struct pish_node *node) {
+    uint8_t flags;
+    if (take_u8(cache, &flags) < 0) {
+        return -1;
+    }
+    node->flags = flags & NODE_EXPAND;
+    return 0;
+}
+
+/*
+ * Read the operands of an and-or node written by put_and_or(). While the
+ * chain of left operands is read, the right pointer of every operator
+ * points back up to its parent, to find the way back up for the right
+ * operands without recursing.
+ */
+static int take_and_or(struct script_cache *cache, struct pish_arena *arena,
+                       struct pish_node *node) {
+    struct pish_node *op = node;
+    op->right = NULL;
+    while (1) {
+        if (cache->pos >= cache->len) {
+            return -1;
+        }
+        uint8_t kind = cache->data[cache->pos];
+        if (kind != NODE_AND && kind != NODE_OR) {
+            break;
+        }
+        cache->pos++;
+        struct pish_node *left = arena_alloc(arena, sizeof(*left));
+        memset(left, 0, sizeof(*left));
+        left->kind = kind;
+        left->right = op;
+        op->left = left;
+        op = left;
+    }
+    if (take_node(cache, arena, &op->left) < 0) {
+        return -1;
+    }
+    while (op != NULL) {
+        struct pish_node *parent = op->right;
+        if (take_node(cache, arena, &op->right) < 0) {
+            return -1;
+        }
+        op = parent;
+    }
+    return 0;
+}
+
+/*
+ * Rebuild a tree written by put_node(), with the nodes and arrays in the
+ * arena and the strings left in the cache data
+ */
+static int take_node(struct script_cache *cache, struct pish_arena *arena,
+                     struct pish_node **out) {
+    uint8_t kind;
+    if (take_u8(cache, &kind) < 0) {
+        return -1;
+    }
+    if (kind == 0xff) {
+        *out = NULL;
+        return 0;
+    }
+    if (kind > NODE_COMMAND) {
+        return -1;
+    }
+    struct pish_node *node = arena_alloc(arena, sizeof(struct pish_node));
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    *out = node;
+    uint32_t n;
+    switch (node->kind) {
+    case NODE_SEQUENCE:
+    case NODE_PIPELINE:
+        if (take_u32(cache, &n) < 0 || n > cache->len) {
+            return -1;
+        }
+        node->nchildren = n;
+        node->children = arena_alloc(arena, n * sizeof(struct pish_node *));
+        for (uint32_t i = 0; i < n; i++) {
+            if (take_node(cache, arena, &node->children[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    case NODE_AND:
+    case NODE_OR:
+        return take_and_or(cache, arena, node);
+    case NODE_SUBSHELL:
+        if (take_node(cache, arena, &node->child) < 0) {
+            return -1;
+        }
+        return take_redirs(cache, arena, node) < 0
+                   ? -1
+                   : take_expand_flag(cache, node);
+    case NODE_BANG:
+    case NODE_BACKGROUND:
+    case NODE_TIME:
+        return take_node(cache, arena, &node->child);
+    case NODE_COMMAND:
+        if (take_u32(cache, &n) < 0 || n > cache->len) {
+            return -1;
+        }
+        node->nassigns = n;
+        node->assigns = n ? arena_alloc(arena, n * sizeof(char *)) : NULL;
+        for (uint32_t i = 0; i < n; i++) {
+            if (take_string(cache, &node->assigns[i]) < 0) {
+                return -1;
+            }
+        }
+        if (take_u32(cache, &n) < 0 || n > cache->len) {
+            return -1;
+        }
+        node->argc = n;
+        node->argv = arena_alloc(arena, (n + 1) * sizeof(char *));
+        for (uint32_t i = 0; i < n; i++) {
+            if (take_string(cache, &node->argv[i]) < 0) {
+                return -1;
+            }
+        }
+        node->argv[n] = NULL;
+        return take_redirs(cache, arena, node) < 0
+                   ? -1
+                   : take_expand_flag(cache, node);
+    }
+    return -1;
+}
+
+/*
+ * Get the next command line of a cached or just compiled script.
+ * @param arena     The nodes of the tree are allocated from this arena
+ * @param root      Set to the tree for UNIT_TREE
+ * @param text      Set to the command line for UNIT_TEXT
+ * @return          The kind of the unit, UNIT_END once all of them have been
+ * returned or if the cache turns out to be corrupt
+ */
+enum cache_unit cache_next(struct script_cache *cache,
+                           struct pish_arena *arena, struct pish_node **root,
+                           const char **text) {
+    uint8_t unit;
+    if (take_u8(cache, &unit) < 0) {
+        return UNIT_END;
+    }
+    if (unit == UNIT_TREE && take_node(cache, arena, root) == 0) {
+        return UNIT_TREE;
+    }
+    if (unit == UNIT_TEXT && take_string(cache, (char **)text) == 0) {
+        return UNIT_TEXT;
+    }
+    if (unit == UNIT_EMPTY || unit == UNIT_END) {
+        return unit;
+    }
+    fprintf(stderr, "pish: corrupt script cache\n");
+    return UNIT_END;
+}
+
+/*
+ * Release the mapping or the compiled data of a cache
+ */
+void cache_close(struct script_cache *cache) {
+    if (cache->map_len > 0) {
+        munmap((void *)cache->data, cache->map_len);
+    }
+    buf_free(&cache->compiled);
+    reset(cache);
+}
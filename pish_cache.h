@@ -0,0 +1,50 @@
+#ifndef __PISH_CACHE_H__
+#define __PISH_CACHE_H__
+
+#include <stddef.h>
+
+#include "pish_arena.h"
+#include "pish_buf.h"
+#include "pish_parse.h"
+
+/*
+ * Compiled script cache. When $PISH_SCRIPT_CACHE is set, the parsed trees of
+ * every command of a script are serialized into
+ * $PISH_CACHE_DIR (default $XDG_CACHE_HOME/pish or ~/.cache/pish), keyed on
+ * the path, mtime and size of the script. Later runs of the same script map
+ * that file and rebuild the trees straight from it, with no tokenizing or
+ * parsing.
+ */
+
+/*
+ * The kinds of units a script is compiled into, one per command line
+ */
+enum cache_unit {
+    UNIT_END,   /* No more commands */
+    UNIT_EMPTY, /* An empty command line */
+    UNIT_TREE,  /* A parsed command line */
+    UNIT_TEXT,  /* A command line with a syntax error, kept as text */
+};
+
+struct script_cache {
+    const char *data; /* The serialized units */
+    size_t len;
+    size_t pos;       /* Where the next unit starts */
+    size_t map_len;   /* Length of the mapping, 0 if data is not mapped */
+    struct pish_buf compiled;
+};
+
+int cache_enabled(void);
+int cache_open(struct script_cache *cache, const char *script_path,
+               int script_fd);
+void cache_begin(struct script_cache *cache, int script_fd,
+                 const char *script_path);
+void cache_add(struct script_cache *cache, enum cache_unit unit,
+               const struct pish_node *root, const char *text);
+void cache_finish(struct script_cache *cache, const char *script_path);
+enum cache_unit cache_next(struct script_cache *cache,
+                           struct pish_arena *arena, struct pish_node **root,
+                           const char **text);
+void cache_close(struct script_cache *cache);
+
+#endif // __PISH_CACHE_H__
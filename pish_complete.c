@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pish_buf.h"
+#include "pish_complete.h"
+#include "pish_user.h"
+#include "pish_vars.h"
+
+/* How much one getdents64() reads, as many entries as fit */
+#define LISTING_READ_SIZE 32768
+
+/*
+ * What was read of a directory. Each name in names is preceded by its type,
+ * d for a directory, ? when getdents64() does not tell or it is a symbolic
+ * link, f for anything else, and followed by a NUL.
+ */
+struct listing {
+    char *path; /* The malloc'd path of the directory */
+    dev_t dev;  /* It was listed when it was this directory with this mtime */
+    ino_t ino;
+    struct timespec mtime;
+    int read; /* Set once it was listed */
+    struct pish_buf names;
+    size_t count;
+};
+
+/* The directories of $PATH in order, and the $PATH they are from */
+static struct listing *path_dirs = NULL;
+static size_t npath_dirs = 0;
+static char *listed_path = NULL;
+/* Every command name, sorted and without duplicates */
+static const char **commands = NULL;
+static size_t ncommands = 0;
+static int commands_stale = 1;
+static const char **builtins = NULL;
+static size_t nbuiltins = 0;
+/* The directory of the last path which was completed */
+static struct listing file_dir = {0};
+/* The matches of the last completion, each NUL-terminated in result_text */
+static struct pish_buf result_text = {0};
+static char **results = NULL;
+static size_t nresults = 0;
+static size_t results_cap = 0;
+
+/*
+ * Add a built-in command to the names which complete commands
+ */
+void complete_add_builtin(const char *name) {
+    builtins = realloc(builtins, (nbuiltins + 1) * sizeof(*builtins));
+    if (builtins == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    builtins[nbuiltins++] = name;
+    commands_stale = 1;
+}
+
+/*
+ * Read all the entries of a directory, a batch of them per getdents64()
+ * @param listing       Where the entries go, its path is the directory
+ * @param executables   1 to only keep the executable files, which is the
+ * only case where the entries are looked at with fstatat()
+ */
+static void read_listing(struct listing *listing, int executables) {
+    buf_set(&listing->names, "", 0);
+    listing->count = 0;
+    listing->read = 0;
+    int fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return;
+    }
+    static char entries[LISTING_READ_SIZE]
+        __attribute__((aligned(__alignof__(struct dirent64))));
+    ssize_t n;
+    while ((n = getdents64(fd, entries, sizeof(entries))) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *entry = (struct dirent64 *)(entries + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            char type = entry->d_type == DT_DIR                           ? 'd'
+                        : entry->d_type == DT_UNKNOWN ||
+                                  entry->d_type == DT_LNK ? '?'
+                                                          : 'f';
+            struct stat file;
+            if (executables &&
+                (type == 'd' || fstatat(fd, name, &file, 0) < 0 ||
+                 !S_ISREG(file.st_mode) || (file.st_mode & 0111) == 0)) {
+                continue;
+            }
+            buf_append(&listing->names, &type, 1);
+            buf_append(&listing->names, name, strlen(name) + 1);
+            listing->count++;
+        }
+    }
+    close(fd);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->read = 1;
+}
+
+/*
+ * Read a directory again if it changed since it was listed
+ * @return          1 if it was read again, 0 if the listing is still right
+ */
+static int refresh_listing(struct listing *listing, int executables) {
+    struct stat st;
+    if (stat(listing->path, &st) < 0) {
+        int had = listing->read;
+        listing->read = 0;
+        listing->count = 0;
+        return had;
+    }
+    if (listing->read && st.st_dev == listing->dev &&
+        st.st_ino == listing->ino &&
+        st.st_mtim.tv_sec == listing->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == listing->mtime.tv_nsec) {
+        return 0;
+    }
+    read_listing(listing, executables);
+    return 1;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * Make the command index match $PATH and its directories. It is only
+ * sorted again when one of them changed.
+ */
+static void refresh_commands(void) {
+    const char *path = var_get("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+    if (listed_path == NULL || strcmp(listed_path, path) != 0) {
+        for (size_t i = 0; i < npath_dirs; i++) {
+            free(path_dirs[i].path);
+            buf_free(&path_dirs[i].names);
+        }
+        free(path_dirs);
+        free(listed_path);
+        listed_path = strdup(path);
+        npath_dirs = 1;
+        for (const char *s = path; *s != '\0'; s++) {
+            npath_dirs += *s == ':';
+        }
+        path_dirs = calloc(npath_dirs, sizeof(*path_dirs));
+        if (listed_path == NULL || path_dirs == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        const char *dir = path;
+        for (size_t i = 0; i < npath_dirs; i++) {
+            const char *end = strchrnul(dir, ':');
+            // an empty $PATH entry means the current directory
+            path_dirs[i].path = end > dir ? strndup(dir, end - dir)
+                                          : strdup(".");
+            if (path_dirs[i].path == NULL) {
+                perror("strdup");
+                exit(EXIT_FAILURE);
+            }
+            dir = *end != '\0' ? end + 1 : end;
+        }
+        commands_stale = 1;
+    }
+    for (size_t i = 0; i < npath_dirs; i++) {
+        commands_stale |= refresh_listing(&path_dirs[i], 1);
+    }
+    if (!commands_stale) {
+        return;
+    }
+    size_t count = nbuiltins;
+    for (size_t i = 0; i < npath_dirs; i++) {
+        count += path_dirs[i].count;
+    }
+    commands = realloc(commands, (count + 1) * sizeof(*commands));
+    if (commands == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(commands, builtins, nbuiltins * sizeof(*commands));
+    ncommands = nbuiltins;
+    for (size_t i = 0; i < npath_dirs; i++) {
+        const char *name = path_dirs[i].names.data;
+        for (size_t j = 0; j < path_dirs[i].count; j++) {
+            commands[ncommands++] = name + 1;
+            name += strlen(name) + 1;
+        }
+    }
+    qsort(commands, ncommands, sizeof(*commands), compare_names);
+    size_t unique = 0;
+    for (size_t i = 0; i < ncommands; i++) {
+        if (unique == 0 || strcmp(commands[unique - 1], commands[i]) != 0) {
+            commands[unique++] = commands[i];
+        }
+    }
+    ncommands = unique;
+    commands_stale = 0;
+}
+
+/*
+ * Add a match, made of what was typed before the name, the name and a / if
+ * it is a directory
+ */
+static void add_result(const char *before, size_t before_len,
+                       const char *name, int directory) {
+    buf_append(&result_text, before, before_len);
+    buf_append(&result_text, name, strlen(name));
+    buf_append(&result_text, "/", directory);
+    buf_append(&result_text, "", 1);
+    nresults++;
+}
+
+/*
+ * Complete a command name from the index, the names with the prefix are
+ * next to each other from the first one a binary search finds
+ */
+static void complete_command(const char *prefix, size_t len) {
+    refresh_commands();
+    size_t low = 0;
+    size_t high = ncommands;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strncmp(commands[middle], prefix, len) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (; low < ncommands && strncmp(commands[low], prefix, len) == 0;
+         low++) {
+        add_result("", 0, commands[low], 0);
+    }
+}
+
+/*
+ * Complete a path from the listing of its directory. Only matches whose type
+ * getdents64() did not tell are looked at with stat().
+ * @param command   1 if the path is a command, which only completes to
+ * directories and executable files
+ */
+static void complete_path(const char *word, size_t len, int command) {
+    const char *slash = memrchr(word, '/', len);
+    size_t dir_len = slash != NULL ? (size_t)(slash - word) + 1 : 0;
+    const char *base = word + dir_len;
+    size_t base_len = len - dir_len;
+    // the directory to read, with ~/ being the home directory
+    struct pish_buf dir = {0};
+    if (dir_len == 0) {
+        buf_set(&dir, ".", 1);
+    } else if (dir_len >= 2 && word[0] == '~' && word[1] == '/') {
+        buf_set(&dir, home_dir(), strlen(home_dir()));
+        buf_append(&dir, word + 1, dir_len - 1);
+    } else {
+        buf_set(&dir, word, dir_len);
+    }
+    if (file_dir.path == NULL || strcmp(file_dir.path, dir.data) != 0) {
+        free(file_dir.path);
+        file_dir.path = strdup(dir.data);
+        file_dir.read = 0;
+        if (file_dir.path == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+    refresh_listing(&file_dir, 0);
+    const char *entry = file_dir.names.data;
+    for (size_t i = 0; file_dir.read && i < file_dir.count;
+         i++, entry += strlen(entry) + 1) {
+        const char *name = entry + 1;
+        // dot files only complete when the prefix starts with a dot
+        if (strncmp(name, base, base_len) != 0 ||
+            (name[0] == '.' && base_len == 0)) {
+            continue;
+        }
+        int directory = entry[0] == 'd';
+        if (entry[0] == '?' || command) {
+            struct stat st;
+            size_t mark = dir.len;
+            buf_append(&dir, "/", 1);
+            buf_append(&dir, name, strlen(name));
+            int found = stat(dir.data, &st) == 0;
+            directory = found && S_ISDIR(st.st_mode);
+            int executable = found && access(dir.data, X_OK) == 0;
+            dir.len = mark;
+            dir.data[mark] = '\0';
+            if (command && !directory && !executable) {
+                continue;
+            }
+        }
+        add_result(word, dir_len, name, directory);
+    }
+    buf_free(&dir);
+}
+
+/*
+ * Complete a word
+ * @param word      The word before the cursor, without its quotes
+ * @param len       Its length
+ * @param command   1 if the word is the name of a command
+ * @param matches   Set to the sorted words it can complete to, a directory
+ * ends with a /. They stay valid until the next call.
+ * @return          The number of matches
+ */
+size_t complete_word(const char *word, size_t len, int command,
+                     char ***matches) {
+    buf_set(&result_text, "", 0);
+    nresults = 0;
+    if (command && memchr(word, '/', len) == NULL) {
+        complete_command(word, len);
+    } else {
+        complete_path(word, len, command);
+    }
+    if (nresults > results_cap) {
+        results_cap = nresults;
+        results = realloc(results, results_cap * sizeof(*results));
+        if (results == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *result = result_text.data;
+    for (size_t i = 0; i < nresults; i++, result += strlen(result) + 1) {
+        results[i] = result;
+    }
+    // the index is sorted already, paths come in the order of the directory
+    if (!command || memchr(word, '/', len) != NULL) {
+        qsort(results, nresults, sizeof(*results), compare_names);
+    }
+    *matches = results;
+    return nresults;
+}
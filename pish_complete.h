@@ -0,0 +1,19 @@
+#ifndef __PISH_COMPLETE_H__
+#define __PISH_COMPLETE_H__
+
+#include <stddef.h>
+
+/*
+ * Completion of the word before the cursor of the line editor. A command
+ * name is completed from the built-ins and an index of every executable in
+ * the directories of $PATH, sorted so the names with a prefix are found by a
+ * binary search. Every other word is completed as a path. Directories are
+ * read with getdents64(), many entries at a time, and what was read of a
+ * directory is kept until its mtime changes, so pressing Tab again costs one
+ * stat() per directory instead of listing it.
+ */
+void complete_add_builtin(const char *name);
+size_t complete_word(const char *word, size_t len, int command,
+                     char ***matches);
+
+#endif // __PISH_COMPLETE_H__
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pish_copy.h"
+
+/* How much copy_all asks for at a time, the kernel may move less */
+#define COPY_CHUNK (1 << 30)
+
+/*
+ * Pick the cheapest way to move bytes from in_fd to out_fd. The choice is
+ * only a first guess, copy_some falls back further if the kernel refuses.
+ */
+enum copy_method copy_method(int in_fd, int out_fd) {
+    struct stat in, out;
+    if (fstat(in_fd, &in) < 0 || fstat(out_fd, &out) < 0) {
+        return COPY_READ_WRITE;
+    }
+    // none of the three write to the end of an O_APPEND file
+    int flags = fcntl(out_fd, F_GETFL);
+    if (S_ISREG(out.st_mode) && (flags < 0 || (flags & O_APPEND))) {
+        return COPY_READ_WRITE;
+    }
+    if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode)) {
+        return COPY_SPLICE;
+    }
+    // files in /proc and /sys have a size of 0 and only work with read()
+    if (!S_ISREG(in.st_mode) || in.st_size == 0) {
+        return COPY_READ_WRITE;
+    }
+    return S_ISREG(out.st_mode) ? COPY_FILE_RANGE : COPY_SENDFILE;
+}
+
+/*
+ * Move up to len bytes from in_fd to out_fd. If the kernel cannot do it
+ * with the current method for these fds, method is changed to a slower one
+ * which it can, so the caller should keep it for the next call.
+ * @param method    From copy_method, may be changed
+ * @return          The number of bytes moved, 0 at EOF or -1 on an error
+ */
+ssize_t copy_some(int in_fd, int out_fd, size_t len,
+                  enum copy_method *method) {
+    for (;;) {
+        ssize_t n = -1;
+        switch (*method) {
+        case COPY_SPLICE:
+            n = splice(in_fd, NULL, out_fd, NULL, len,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        case COPY_FILE_RANGE:
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, len, 0);
+            break;
+        case COPY_SENDFILE:
+            n = sendfile(out_fd, in_fd, NULL, len);
+            break;
+        case COPY_READ_WRITE: {
+            char data[65536];
+            n = read(in_fd, data, len < sizeof(data) ? len : sizeof(data));
+            for (ssize_t done = 0; n > 0 && done < n;) {
+                ssize_t w = write(out_fd, data + done, n - done);
+                if (w < 0 && errno != EINTR) {
+                    return -1;
+                }
+                done += w > 0 ? w : 0;
+            }
+            break;
+        }
+        }
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (*method == COPY_READ_WRITE ||
+            (errno != EINVAL && errno != ENOSYS && errno != EXDEV &&
+             errno != EOPNOTSUPP)) {
+            return -1;
+        }
+        // copy_file_range between file systems is only refused by old
+        // kernels, sendfile still avoids the copy
+        *method = *method == COPY_FILE_RANGE ? COPY_SENDFILE : COPY_READ_WRITE;
+    }
+}
+
+/*
+ * Move everything from in_fd to out_fd until EOF
+ * @return          0 on success, -1 on an error with errno set
+ */
+int copy_all(int in_fd, int out_fd) {
+    enum copy_method method = copy_method(in_fd, out_fd);
+    ssize_t n;
+    while ((n = copy_some(in_fd, out_fd, COPY_CHUNK, &method)) > 0) {
+    }
+    return n < 0 ? -1 : 0;
+}
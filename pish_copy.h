@@ -0,0 +1,24 @@
+#ifndef __PISH_COPY_H__
+#define __PISH_COPY_H__
+
+#include <sys/types.h>
+
+/*
+ * Moving bytes from one fd to another without copying them through the
+ * memory of the shell. splice() needs a pipe on one side, copy_file_range()
+ * two regular files and sendfile() a mappable file to read, the rest falls
+ * back to read() and write().
+ */
+enum copy_method {
+    COPY_SPLICE,
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+enum copy_method copy_method(int in_fd, int out_fd);
+ssize_t copy_some(int in_fd, int out_fd, size_t len,
+                  enum copy_method *method);
+int copy_all(int in_fd, int out_fd);
+
+#endif // __PISH_COPY_H__
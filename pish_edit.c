@@ -0,0 +1,741 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "pish_buf.h"
+#include "pish_complete.h"
+#include "pish_edit.h"
+#include "pish_history.h"
+
+/*
+ * The keys which come as escape sequences, after the bytes of single keys
+ */
+enum edit_key {
+    KEY_NONE = 256, /* A sequence which does nothing */
+    KEY_ESCAPE,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+};
+
+/* How long to wait for the rest of a sequence after an escape, in ms */
+#define EDIT_ESCAPE_TIMEOUT 50
+
+static const char SEARCH_PROMPT[] = "(reverse-i-search)`";
+static const char FAILED_PROMPT[] = "(failed reverse-i-search)`";
+
+/* Where a word being completed starts, and what is escaped in a completion */
+static const char WORD_BREAKS[] = " \t;&|()<>";
+static const char SPECIAL_CHARS[] = " \t;&|()<>\\'\"$`*?[#";
+/* Above this many matches, ask before listing them */
+#define EDIT_LIST_QUERY 100
+
+/*
+ * The state of the editor. What the terminal shows after the prompt is kept
+ * in shown, so render() can tell which part of it changed.
+ */
+struct editor {
+    size_t prompt_width; /* The columns the prompt takes on its last row */
+    size_t columns;      /* The width of the terminal */
+    char input[4096];    /* Bytes read from the terminal, not handled yet */
+    size_t input_start;
+    size_t input_end;
+    struct pish_buf out;     /* Written to the terminal before it is read */
+    struct pish_buf line;    /* The line being edited */
+    size_t cursor;           /* Where the cursor is in line */
+    struct pish_buf shown;   /* What the terminal shows after the prompt */
+    size_t shown_cursor;     /* Where the cursor of the terminal is in it */
+    struct pish_buf display; /* What the terminal should show */
+    long history;            /* The entry Up and Down went to, 0 for none */
+    struct pish_buf typed;   /* The line as it was typed, while they did */
+    struct pish_buf entry;   /* An entry copied out of the history */
+    int searching;           /* ^R was pressed */
+    struct pish_buf query;   /* What is searched for */
+    long match;              /* The entry it was found in, 0 for none */
+    int failed;              /* The query matches nothing older */
+    struct pish_buf word;    /* The word being completed, unescaped */
+};
+
+static struct editor ed;
+
+/*
+ * Check whether the shell can edit its input, ie stdin and stdout are a
+ * terminal which understands the escape sequences of the editor
+ */
+int edit_available(void) {
+    struct termios modes;
+    const char *term = getenv("TERM");
+    return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && term != NULL &&
+           strcmp(term, "dumb") != 0 && tcgetattr(STDIN_FILENO, &modes) == 0;
+}
+
+/*
+ * Bytes which continue a UTF-8 character take no column of their own
+ */
+static int is_continuation(char c) {
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+/*
+ * The columns len bytes of text take on the terminal
+ */
+static size_t text_width(const char *text, size_t len) {
+    size_t width = 0;
+    for (size_t i = 0; i < len; i++) {
+        width += !is_continuation(text[i]);
+    }
+    return width;
+}
+
+/*
+ * The columns the last row of the prompt takes, without its escape
+ * sequences, ie the colors
+ */
+static size_t prompt_width(const char *prompt) {
+    const char *row = strrchr(prompt, '\n');
+    size_t width = 0;
+    for (const char *s = row != NULL ? row + 1 : prompt; *s != '\0'; s++) {
+        if (*s == '\e' && s[1] == '[') {
+            for (s += 2; *s != '\0' && (*s < 0x40 || *s > 0x7e); s++) {
+            }
+            if (*s == '\0') {
+                break;
+            }
+        } else {
+            width += !is_continuation(*s);
+        }
+    }
+    return width;
+}
+
+static void put(const char *text, size_t len) {
+    buf_append(&ed.out, text, len);
+}
+
+static void put_sequence(const char *format, size_t n) {
+    char sequence[32];
+    put(sequence, snprintf(sequence, sizeof(sequence), format, n));
+}
+
+/*
+ * Write what is waiting in out to the terminal
+ */
+static void flush_output(void) {
+    size_t written = 0;
+    while (written < ed.out.len) {
+        ssize_t n = write(STDOUT_FILENO, ed.out.data + written,
+                          ed.out.len - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        written += n;
+    }
+    ed.out.len = 0;
+}
+
+/*
+ * Move the cursor of the terminal between two columns, counted from the
+ * start of the row of the prompt over all the rows the line wraps into
+ */
+static void move_cursor(size_t from, size_t to) {
+    size_t from_row = from / ed.columns;
+    size_t to_row = to / ed.columns;
+    if (from_row == to_row) {
+        if (to < from) {
+            put_sequence("\e[%zuD", from - to);
+        } else if (to > from) {
+            put_sequence("\e[%zuC", to - from);
+        }
+        return;
+    }
+    if (to_row < from_row) {
+        put_sequence("\e[%zuA", from_row - to_row);
+    } else {
+        put_sequence("\e[%zuB", to_row - from_row);
+    }
+    put("\r", 1);
+    if (to % ed.columns > 0) {
+        put_sequence("\e[%zuC", to % ed.columns);
+    }
+}
+
+/*
+ * Make the terminal show text after the prompt, with the cursor at a given
+ * byte of it. Only the text from the first byte which differs from what is
+ * shown is written, so typing at the end of a line writes one character.
+ */
+static void render(const char *text, size_t len, size_t cursor) {
+    size_t same = 0;
+    while (same < len && same < ed.shown.len &&
+           text[same] == ed.shown.data[same]) {
+        same++;
+    }
+    // a character which only partly changed is written again
+    while (same > 0 && ((same < len && is_continuation(text[same])) ||
+                        (same < ed.shown.len &&
+                         is_continuation(ed.shown.data[same])))) {
+        same--;
+    }
+    size_t start = ed.prompt_width + text_width(text, same);
+    size_t end = start;
+    if (same < len || same < ed.shown.len) {
+        move_cursor(ed.prompt_width +
+                        text_width(ed.shown.data, ed.shown_cursor),
+                    start);
+        put(text + same, len - same);
+        end += text_width(text + same, len - same);
+        // the terminal only moves to the next row once it writes to it
+        if (len > same && end % ed.columns == 0) {
+            put("\n", 1);
+        }
+        if (text_width(ed.shown.data + same, ed.shown.len - same) >
+            end - start) {
+            put("\e[J", 3);
+        }
+    } else {
+        end = ed.prompt_width + text_width(ed.shown.data, ed.shown_cursor);
+    }
+    move_cursor(end, ed.prompt_width + text_width(text, cursor));
+    buf_set(&ed.shown, text, len);
+    ed.shown_cursor = cursor;
+}
+
+static void show_line(void) {
+    render(ed.line.data, ed.line.len, ed.cursor);
+}
+
+/*
+ * Show the search, ie (reverse-i-search)`query': match, with the cursor on
+ * where the query is in the match
+ */
+static void show_search(void) {
+    const char *prefix = ed.failed ? FAILED_PROMPT : SEARCH_PROMPT;
+    buf_set(&ed.display, prefix, strlen(prefix));
+    buf_append(&ed.display, ed.query.data, ed.query.len);
+    buf_append(&ed.display, "': ", 3);
+    size_t cursor = ed.display.len;
+    if (ed.match && history_copy(ed.match, &ed.display)) {
+        const char *entry = ed.display.data + cursor;
+        const char *found = memmem(entry, ed.display.len - cursor,
+                                   ed.query.data, ed.query.len);
+        cursor += found != NULL ? (size_t)(found - entry) : 0;
+    }
+    render(ed.display.data, ed.display.len, cursor);
+}
+
+/*
+ * Read the next byte from the terminal
+ * @param timeout   How long to wait for it in ms, -1 to wait until it comes
+ * @return          The byte, or -1 if none came or the input ended
+ */
+static int next_byte(int timeout) {
+    if (ed.input_start == ed.input_end) {
+        // everything the last keys changed is shown before waiting
+        flush_output();
+        struct pollfd poll_fd = {STDIN_FILENO, POLLIN, 0};
+        if (timeout >= 0 && poll(&poll_fd, 1, timeout) <= 0) {
+            return -1;
+        }
+        // the history waiting to be written is written when it is due, even
+        // if nothing is typed until then
+        int due;
+        while (timeout < 0 && (due = history_flush_timeout()) >= 0 &&
+               poll(&poll_fd, 1, due) == 0) {
+        }
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, ed.input, sizeof(ed.input))) < 0 &&
+               errno == EINTR) {
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        ed.input_start = 0;
+        ed.input_end = n;
+    }
+    return (unsigned char)ed.input[ed.input_start++];
+}
+
+/*
+ * Read a key, a byte or one of enum edit_key for an escape sequence
+ * @return          The key, or -1 if the input ended
+ */
+static int read_key(void) {
+    int c = next_byte(-1);
+    if (c != '\e') {
+        return c;
+    }
+    int kind = next_byte(EDIT_ESCAPE_TIMEOUT);
+    if (kind != '[' && kind != 'O') {
+        return kind < 0 ? KEY_ESCAPE : KEY_NONE;
+    }
+    // the parameters of the sequence, ie 3 in \e[3~, then what it is
+    long parameter = 0;
+    int final;
+    while ((final = next_byte(EDIT_ESCAPE_TIMEOUT)) >= 0 &&
+           (final < 0x40 || final > 0x7e)) {
+        if (final >= '0' && final <= '9' && parameter < 1000) {
+            parameter = parameter * 10 + final - '0';
+        }
+    }
+    switch (final) {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    case 'H':
+        return KEY_HOME;
+    case 'F':
+        return KEY_END;
+    case '~':
+        return parameter == 1 || parameter == 7   ? KEY_HOME
+               : parameter == 4 || parameter == 8 ? KEY_END
+               : parameter == 3                   ? KEY_DELETE
+                                                  : KEY_NONE;
+    }
+    return KEY_NONE;
+}
+
+/*
+ * Replace bytes of the line, ie to insert or delete text
+ * @param start     The first byte replaced
+ * @param end       The byte after the last one replaced
+ * @param text      What replaces them
+ * @param len       The length of text
+ */
+static void splice(size_t start, size_t end, const char *text, size_t len) {
+    buf_reserve(&ed.line, len);
+    memmove(ed.line.data + start + len, ed.line.data + end,
+            ed.line.len - end + 1);
+    memcpy(ed.line.data + start, text, len);
+    ed.line.len += len - (end - start);
+    ed.cursor = start + len;
+}
+
+/*
+ * The start of the character before a byte of the line
+ */
+static size_t previous_char(size_t i) {
+    while (i > 0 && is_continuation(ed.line.data[--i])) {
+    }
+    return i;
+}
+
+/*
+ * The start of the character after the one at a byte of the line
+ */
+static size_t next_char(size_t i) {
+    while (i < ed.line.len && is_continuation(ed.line.data[++i])) {
+    }
+    return i;
+}
+
+/*
+ * Go to an older entry of the history with Up, or back towards the line
+ * being typed with Down
+ * @param older     1 for Up, 0 for Down
+ */
+static void step_history(int older) {
+    long next;
+    if (older) {
+        next = ed.history > 0 ? ed.history - 1 : history_last();
+    } else if (ed.history == 0) {
+        return;
+    } else {
+        next = ed.history < history_last() ? ed.history + 1 : 0;
+    }
+    buf_set(&ed.entry, "", 0);
+    if (next > 0 && !history_copy(next, &ed.entry)) {
+        return;
+    }
+    if (ed.history == 0) {
+        buf_set(&ed.typed, ed.line.data, ed.line.len);
+    }
+    ed.history = next;
+    if (next > 0) {
+        buf_set(&ed.line, ed.entry.data, ed.entry.len);
+    } else {
+        buf_set(&ed.line, ed.typed.data, ed.typed.len);
+    }
+    ed.cursor = ed.line.len;
+}
+
+/*
+ * Search the query in the entries older than a given one
+ */
+static void search_before(long before) {
+    long found = ed.query.len > 0
+                     ? history_search(ed.query.data, ed.query.len, before)
+                     : 0;
+    ed.failed = ed.query.len > 0 && found == 0;
+    if (found > 0 || ed.query.len == 0) {
+        ed.match = found;
+    }
+}
+
+/*
+ * Leave the search with the entry it found as the line, which Up and Down
+ * then go on from
+ */
+static void end_search(void) {
+    ed.searching = 0;
+    buf_set(&ed.entry, "", 0);
+    if (!ed.match || !history_copy(ed.match, &ed.entry)) {
+        return;
+    }
+    if (ed.history == 0) {
+        buf_set(&ed.typed, ed.line.data, ed.line.len);
+    }
+    ed.history = ed.match;
+    buf_set(&ed.line, ed.entry.data, ed.entry.len);
+    const char *found =
+        memmem(ed.line.data, ed.line.len, ed.query.data, ed.query.len);
+    ed.cursor = found != NULL ? (size_t)(found - ed.line.data) : ed.line.len;
+}
+
+/*
+ * Handle a key while searching
+ * @return          1 if the search used the key, 0 if it ended the search
+ * and the key is for the line
+ */
+static int search_key(int key) {
+    long after_all = history_last() + 1;
+    if (key == CTRL('R')) {
+        search_before(ed.match > 0 ? ed.match : after_all);
+    } else if (key == CTRL('G') || key == CTRL('C')) {
+        // back to the line as it was before the search
+        ed.searching = 0;
+        show_line();
+        return 1;
+    } else if (key == 127 || key == CTRL('H')) {
+        while (ed.query.len > 0 &&
+               is_continuation(ed.query.data[--ed.query.len])) {
+        }
+        ed.query.data[ed.query.len] = '\0';
+        search_before(after_all);
+    } else if (key >= ' ' && key < 256 && key != 127) {
+        char c = key;
+        buf_append(&ed.query, &c, 1);
+        // the current match is kept while it still matches
+        search_before(ed.match > 0 ? ed.match + 1 : after_all);
+    } else {
+        end_search();
+        if (key == KEY_ESCAPE) {
+            show_line();
+            return 1;
+        }
+        return 0;
+    }
+    if (ed.input_start == ed.input_end) {
+        show_search();
+    }
+    return 1;
+}
+
+/*
+ * Insert a completion at the cursor, escaped unless it is inside quotes
+ * @param quote     The quote the word is in, or 0
+ */
+static void insert_completion(const char *text, size_t len, char quote) {
+    for (size_t i = 0; i < len; i++) {
+        if (quote == 0 && strchr(SPECIAL_CHARS, text[i]) != NULL) {
+            splice(ed.cursor, ed.cursor, "\\", 1);
+        }
+        splice(ed.cursor, ed.cursor, text + i, 1);
+    }
+}
+
+/*
+ * List the matches of a completion in columns under the line, by the last
+ * part of their path, and draw the prompt and the line again below them
+ */
+static void list_matches(const char *prompt, char **matches, size_t n) {
+    render(ed.line.data, ed.line.len, ed.line.len);
+    put("\n", 1);
+    if (n > EDIT_LIST_QUERY) {
+        put_sequence("Display all %zu", n);
+        put(" possibilities? (y or n)", 24);
+        flush_output();
+        int key;
+        while ((key = read_key()) != 'y' && key != 'n' && key != -1 &&
+               key != CTRL('C')) {
+        }
+        put("\n", 1);
+        if (key != 'y') {
+            n = 0;
+        }
+    }
+    size_t width = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(matches[i]);
+        const char *slash = len > 1 ? memrchr(matches[i], '/', len - 1) : NULL;
+        if (slash != NULL) {
+            matches[i] = (char *)slash + 1;
+        }
+        size_t w = text_width(matches[i], strlen(matches[i]));
+        width = w > width ? w : width;
+    }
+    width += 2;
+    size_t columns = ed.columns / width > 0 ? ed.columns / width : 1;
+    size_t rows = (n + columns - 1) / columns;
+    // down the columns, as ls does
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t i = row; i < n; i += rows) {
+            size_t len = strlen(matches[i]);
+            put(matches[i], len);
+            if (i + rows < n) {
+                for (size_t w = text_width(matches[i], len); w < width; w++) {
+                    put(" ", 1);
+                }
+            }
+        }
+        put("\n", 1);
+    }
+    put(prompt, strlen(prompt));
+    buf_set(&ed.shown, "", 0);
+    ed.shown_cursor = 0;
+}
+
+/*
+ * Complete the word before the cursor with Tab. It is a command name when it
+ * starts the line or follows ; & | or (, and a path otherwise. Several matches
+ * complete to what they have in common, and are listed by a second Tab.
+ * @param prompt    The prompt, to draw it again after a listing
+ * @param again     1 if the key before was a Tab too
+ */
+static void complete_line(const char *prompt, int again) {
+    size_t start = 0;
+    char quote = 0;
+    buf_set(&ed.word, "", 0);
+    for (size_t i = 0; i < ed.cursor; i++) {
+        char c = ed.line.data[i];
+        if (quote != 0) {
+            if (c == quote) {
+                quote = 0;
+            } else {
+                buf_append(&ed.word, &c, 1);
+            }
+        } else if (c == '\\' && i + 1 < ed.cursor) {
+            buf_append(&ed.word, &ed.line.data[++i], 1);
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (strchr(WORD_BREAKS, c) != NULL) {
+            start = i + 1;
+            buf_set(&ed.word, "", 0);
+        } else {
+            buf_append(&ed.word, &c, 1);
+        }
+    }
+    size_t before = start;
+    while (before > 0 && (ed.line.data[before - 1] == ' ' ||
+                          ed.line.data[before - 1] == '\t')) {
+        before--;
+    }
+    int command =
+        before == 0 || strchr(";&|(", ed.line.data[before - 1]) != NULL;
+    char **matches;
+    size_t n = complete_word(ed.word.data, ed.word.len, command, &matches);
+    if (n == 0) {
+        put("\a", 1);
+        return;
+    }
+    size_t common = strlen(matches[0]);
+    for (size_t i = 1; i < n; i++) {
+        size_t same = 0;
+        while (same < common && matches[i][same] == matches[0][same]) {
+            same++;
+        }
+        common = same;
+    }
+    // a character is completed whole or not at all
+    while (common > ed.word.len && is_continuation(matches[0][common])) {
+        common--;
+    }
+    if (common > ed.word.len) {
+        insert_completion(matches[0] + ed.word.len, common - ed.word.len,
+                          quote);
+    }
+    if (n == 1) {
+        // the word is complete, but a directory can go on
+        if (matches[0][common - 1] != '/') {
+            if (quote != 0) {
+                splice(ed.cursor, ed.cursor, &quote, 1);
+            }
+            splice(ed.cursor, ed.cursor, " ", 1);
+        }
+    } else if (common == ed.word.len) {
+        if (again) {
+            list_matches(prompt, matches, n);
+        } else {
+            put("\a", 1);
+        }
+    }
+}
+
+/*
+ * Read a line from the terminal, editing it as the keys come in. The prompt
+ * must already be printed.
+ * @param prompt    The prompt, to draw it again ie after ^L
+ * @param line      Set to the line, which is NUL-terminated and stays valid
+ * until the next call
+ * @return          The length of the line, or -1 if the input ended
+ */
+ssize_t edit_line(const char *prompt, char **line) {
+    struct termios cooked;
+    fflush(stdout);
+    if (tcgetattr(STDIN_FILENO, &cooked) < 0) {
+        return -1;
+    }
+    struct termios raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    struct winsize size;
+    ed.columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col
+                     ? size.ws_col
+                     : 80;
+    ed.prompt_width = prompt_width(prompt) % ed.columns;
+    buf_set(&ed.line, "", 0);
+    buf_set(&ed.shown, "", 0);
+    ed.cursor = 0;
+    ed.shown_cursor = 0;
+    ed.history = 0;
+    ed.searching = 0;
+    // -2 while the line is not finished
+    ssize_t result = -2;
+    int key = KEY_NONE;
+    while (result == -2) {
+        int last_key = key;
+        key = read_key();
+        if (ed.searching && search_key(key)) {
+            continue;
+        }
+        switch (key) {
+        case -1:
+            result = -1;
+            break;
+        case '\r':
+        case '\n':
+            ed.cursor = ed.line.len;
+            show_line();
+            put("\n", 1);
+            result = ed.line.len;
+            break;
+        case CTRL('C'):
+            ed.cursor = ed.line.len;
+            show_line();
+            put("^C\n", 3);
+            buf_set(&ed.line, "", 0);
+            result = 0;
+            break;
+        case CTRL('D'):
+            if (ed.line.len == 0) {
+                result = -1;
+                break;
+            }
+            // fall through
+        case KEY_DELETE:
+            if (ed.cursor < ed.line.len) {
+                splice(ed.cursor, next_char(ed.cursor), "", 0);
+            }
+            break;
+        case 127:
+        case CTRL('H'):
+            if (ed.cursor > 0) {
+                splice(previous_char(ed.cursor), ed.cursor, "", 0);
+            }
+            break;
+        case KEY_LEFT:
+        case CTRL('B'):
+            ed.cursor = previous_char(ed.cursor);
+            break;
+        case KEY_RIGHT:
+        case CTRL('F'):
+            ed.cursor = next_char(ed.cursor);
+            break;
+        case KEY_HOME:
+        case CTRL('A'):
+            ed.cursor = 0;
+            break;
+        case KEY_END:
+        case CTRL('E'):
+            ed.cursor = ed.line.len;
+            break;
+        case CTRL('K'):
+            ed.line.len = ed.cursor;
+            ed.line.data[ed.cursor] = '\0';
+            break;
+        case CTRL('U'):
+            splice(0, ed.cursor, "", 0);
+            break;
+        case CTRL('W'): {
+            size_t start = ed.cursor;
+            while (start > 0 && ed.line.data[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && ed.line.data[start - 1] != ' ') {
+                start--;
+            }
+            splice(start, ed.cursor, "", 0);
+            break;
+        }
+        case KEY_UP:
+        case CTRL('P'):
+            step_history(1);
+            break;
+        case KEY_DOWN:
+        case CTRL('N'):
+            step_history(0);
+            break;
+        case CTRL('R'):
+            ed.searching = 1;
+            ed.failed = 0;
+            ed.match = 0;
+            buf_set(&ed.query, "", 0);
+            show_search();
+            continue;
+        case '\t':
+            complete_line(prompt, last_key == '\t');
+            break;
+        case CTRL('L'):
+            put("\e[H\e[2J", 7);
+            put(prompt, strlen(prompt));
+            buf_set(&ed.shown, "", 0);
+            ed.shown_cursor = 0;
+            break;
+        default:
+            if (key >= ' ' && key < 256 && key != 127) {
+                char c = key;
+                splice(ed.cursor, ed.cursor, &c, 1);
+            }
+            break;
+        }
+        // keys which came in at once, ie a paste, are drawn at once
+        if (result == -2 && ed.input_start == ed.input_end) {
+            show_line();
+        }
+    }
+    flush_output();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    *line = ed.line.data;
+    return result;
+}
@@ -0,0 +1,27 @@
+#ifndef __PISH_EDIT_H__
+#define __PISH_EDIT_H__
+
+#include <sys/types.h>
+
+/*
+ * The line editor of the interactive shell. The terminal is in raw mode only
+ * while a line is read, and is given back as it was before the line runs.
+ *   Left Right ^B ^F   Move by a character
+ *   Home End ^A ^E     Move to the start or the end of the line
+ *   Backspace Del ^D   Delete before or under the cursor, ^D on an empty
+ *                      line ends the input
+ *   ^K ^U ^W           Delete to the end, to the start, the word before
+ *   Up Down ^P ^N      Go through the history
+ *   ^R                 Search the history backwards, again for an older
+ *                      match, ^G to go back to the line
+ *   Tab                Complete a command name or a path, a second Tab
+ *                      lists the matches when there are several
+ *   ^L                 Clear the screen
+ *   ^C                 Drop the line
+ * Every change is drawn by comparing what the terminal shows with what it
+ * should show, and only writing from where the two differ.
+ */
+int edit_available(void);
+ssize_t edit_line(const char *prompt, char **line);
+
+#endif // __PISH_EDIT_H__
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pish_buf.h"
+#include "pish_expand.h"
+#include "pish_jobs.h"
+#include "pish_profile.h"
+#include "pish_vars.h"
+
+static struct expand_shell shell;
+/* For $$, which stays the pid of the shell in its forked copies */
+static pid_t shell_pid;
+/* The status of the last $(...) of a command, -1 if it had none */
+static int last_substitution = -1;
+/*
+ * The field being built, and the output of the last $(...). Both are kept
+ * from one command to the next, so expanding a word allocates nothing but
+ * the result in the arena.
+ */
+static struct pish_buf field = {0};
+static struct pish_buf output = {0};
+
+/*
+ * The fields a command expands to, see expand_word()
+ */
+struct fields {
+    struct pish_arena *arena;
+    char **argv; /* NULL-terminated, in the arena */
+    int argc;
+    int capacity;
+    int split;   /* Unquoted expansions are split, 0 for a single word */
+    int started; /* There is a field, even if it is empty like "" */
+};
+
+static const char *const SEPARATORS = " \t\n";
+
+/*
+ * Set what the expansion needs from the shell
+ */
+void expand_init(const struct expand_shell *hooks) {
+    shell = *hooks;
+    shell_pid = getpid();
+}
+
+/*
+ * Add the field being built to the result, if there is one
+ */
+static void end_field(struct fields *f) {
+    if (!f->started) {
+        return;
+    }
+    if (f->argc + 1 >= f->capacity) {
+        int grown = f->capacity ? f->capacity * 2 : 8;
+        f->argv = arena_grow(f->arena, f->argv, f->capacity * sizeof(char *),
+                             grown * sizeof(char *));
+        f->capacity = grown;
+    }
+    f->argv[f->argc++] = arena_strndup(f->arena, field.data, field.len);
+    f->argv[f->argc] = NULL;
+    buf_set(&field, "", 0);
+    f->started = 0;
+}
+
+/*
+ * Add text to the field being built
+ * @param split     1 if the text is the result of an unquoted expansion,
+ * which starts a new field at every run of spaces, tabs and newlines
+ */
+static void add_text(struct fields *f, const char *text, size_t len,
+                     int split) {
+    if (!split || !f->split) {
+        buf_append(&field, text, len);
+        f->started = 1;
+        return;
+    }
+    const char *end = text + len;
+    while (text < end) {
+        size_t run = strcspn(text, SEPARATORS);
+        if (text + run > end) {
+            run = end - text;
+        }
+        if (run > 0) {
+            buf_append(&field, text, run);
+            f->started = 1;
+            text += run;
+        } else {
+            end_field(f);
+            text++;
+        }
+    }
+}
+
+/*
+ * Run the command of a $(...) and read all it writes to stdout into output,
+ * without the trailing newlines
+ * @param chain     The command line, from the arena
+ * @return          0 if it ran, -1 if it could not be started
+ */
+static int substitute(const char *chain) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    // what the shell buffered must not end up in the pipe too
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        shell.substitute(chain);
+    }
+    close(fds[1]);
+    buf_set(&output, "", 0);
+    while (1) {
+        buf_reserve(&output, 4096);
+        ssize_t n = read(fds[0], output.data + output.len,
+                         output.cap - output.len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        output.len += n;
+    }
+    close(fds[0]);
+    while (output.len > 0 && output.data[output.len - 1] == '\n') {
+        output.len--;
+    }
+    output.data[output.len] = '\0';
+    int status;
+    if (wait_process(pid, &status, 0) < 0) {
+        perror("waitpid");
+        last_substitution = 1;
+    } else {
+        last_substitution = exit_status(status);
+    }
+    return 0;
+}
+
+/*
+ * Add the statuses of the last pipeline, separated by spaces
+ * @param index     The stage, or -1 for all of them
+ */
+static void add_pipe_status(struct fields *f, long index, int split) {
+    char number[16];
+    for (int i = 0; i < *shell.npipe_status; i++) {
+        if (index >= 0 && i != index) {
+            continue;
+        }
+        int len = snprintf(number, sizeof(number), index < 0 && i > 0 ? " %d"
+                                                                       : "%d",
+                           (*shell.pipe_status)[i]);
+        add_text(f, number, len, split);
+    }
+}
+
+/*
+ * Expand what is inside ${...}
+ * @return          0, or -1 if it is not something which can be expanded
+ */
+static int expand_braces(struct fields *f, const char *name, size_t len,
+                         int split) {
+    char number[16];
+    size_t name_len = var_name_length(name);
+    if (len == 1 && (*name == '?' || *name == '$')) {
+        int value = *name == '?' ? *shell.status : (int)shell_pid;
+        add_text(f, number, snprintf(number, sizeof(number), "%d", value),
+                 split);
+        return 0;
+    }
+    if (name_len == len) {
+        const char *value = var_value(name, len);
+        if (value != NULL) {
+            add_text(f, value, strlen(value), split);
+        }
+        return 0;
+    }
+    if (name_len == strlen("PIPESTATUS") &&
+        strncmp(name, "PIPESTATUS", name_len) == 0 && name[name_len] == '[' &&
+        name[len - 1] == ']') {
+        const char *index = name + name_len + 1;
+        if (len - name_len == 3 && (*index == '@' || *index == '*')) {
+            add_pipe_status(f, -1, split);
+            return 0;
+        }
+        char *end;
+        long i = strtol(index, &end, 10);
+        if (end == name + len - 1 && end != index && i >= 0) {
+            add_pipe_status(f, i, split);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Expand the $ at s
+ * @param quoted    1 inside "", where the result is not split
+ * @return          Where the word goes on after it, or NULL after an error
+ * was printed
+ */
+static const char *expand_dollar(struct fields *f, const char *s,
+                                 int quoted) {
+    char number[16];
+    size_t len;
+    if (s[1] == '(') {
+        char missing;
+        const char *end = word_part_end(s, &missing);
+        const char *chain = arena_strndup(f->arena, s + 2, end - s - 3);
+        if (substitute(chain) < 0) {
+            return NULL;
+        }
+        add_text(f, output.data, output.len, !quoted);
+        return end;
+    }
+    if (s[1] == '{') {
+        const char *end = strchr(s, '}');
+        if (expand_braces(f, s + 2, end - s - 2, !quoted) < 0) {
+            fprintf(stderr, "pish: %.*s: bad substitution\n",
+                    (int)(end - s + 1), s);
+            return NULL;
+        }
+        f->started |= quoted;
+        return end + 1;
+    }
+    if (s[1] == '?' || s[1] == '$') {
+        int value = s[1] == '?' ? *shell.status : (int)shell_pid;
+        add_text(f, number, snprintf(number, sizeof(number), "%d", value),
+                 !quoted);
+        return s + 2;
+    }
+    if (s[1] >= '0' && s[1] <= '9') {
+        // the shell has no positional parameters, they are all unset
+        f->started |= quoted;
+        return s + 2;
+    }
+    if ((len = var_name_length(s + 1)) > 0) {
+        if (len == strlen("PIPESTATUS") &&
+            strncmp(s + 1, "PIPESTATUS", len) == 0) {
+            add_pipe_status(f, 0, !quoted);
+        } else {
+            const char *value = var_value(s + 1, len);
+            if (value != NULL) {
+                add_text(f, value, strlen(value), !quoted);
+            }
+        }
+        // "$UNSET" is still an empty field
+        f->started |= quoted;
+        return s + 1 + len;
+    }
+    // a $ which starts nothing is kept
+    add_text(f, "$", 1, 0);
+    return s + 1;
+}
+
+/*
+ * Expand a word into the fields being built, the last one is left open
+ * @param word      The word as it was written, its quotes are balanced
+ * @return          0, or -1 after an error was printed
+ */
+static int expand_word(struct fields *f, const char *s) {
+    int quoted = 0;
+    while (*s != '\0') {
+        if (*s == '\'' && !quoted) {
+            const char *end = strchr(s + 1, '\'');
+            add_text(f, s + 1, end - s - 1, 0);
+            s = end + 1;
+        } else if (*s == '"') {
+            quoted = !quoted;
+            f->started = 1;
+            s++;
+        } else if (*s == '\\') {
+            // inside "" a \ only quotes the characters which are special
+            if (s[1] == '\0' ||
+                (quoted && strchr("$`\"\\\n", s[1]) == NULL)) {
+                add_text(f, s, 1, 0);
+                s++;
+            } else {
+                add_text(f, s + 1, 1, 0);
+                s += 2;
+            }
+        } else if (*s == '$') {
+            if ((s = expand_dollar(f, s, quoted)) == NULL) {
+                return -1;
+            }
+        } else {
+            size_t len = strcspn(s, quoted ? "\"\\$" : "'\"\\$");
+            add_text(f, s, len, 0);
+            s += len;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Expand a word which stays a single word, ie an assignment
+ * @return          The expanded word in the arena, or NULL after an error
+ */
+static char *expand_single(struct pish_arena *arena, const char *word) {
+    struct fields f = {arena, NULL, 0, 0, 0, 1};
+    if (expand_word(&f, word) < 0) {
+        return NULL;
+    }
+    end_field(&f);
+    return f.argv[0];
+}
+
+/*
+ * Expand a here-document, in which $ is expanded like inside "" but quotes
+ * are kept and a \ only quotes $, ` and \, or removes a line break
+ * @return          The document in the arena, or NULL after an error
+ */
+static char *expand_document(struct pish_arena *arena, const char *s) {
+    struct fields f = {arena, NULL, 0, 0, 0, 1};
+    while (*s != '\0') {
+        if (*s == '\\' && s[1] == '\n') {
+            s += 2;
+        } else if (*s == '\\' && s[1] != '\0' && strchr("$`\\", s[1])) {
+            add_text(&f, s + 1, 1, 0);
+            s += 2;
+        } else if (*s == '$') {
+            // unlike in a word, nothing checked that a ${ or $( is closed
+            char missing;
+            if ((s[1] == '{' || s[1] == '(') &&
+                word_part_end(s, &missing) == NULL) {
+                fprintf(stderr,
+                        "pish: syntax error: unexpected end of here-document "
+                        "while looking for matching `%c'\n",
+                        missing);
+                return NULL;
+            }
+            if ((s = expand_dollar(&f, s, 1)) == NULL) {
+                return NULL;
+            }
+        } else {
+            size_t len = *s == '\\' ? 1 : strcspn(s, "\\$");
+            add_text(&f, s, len, 0);
+            s += len;
+        }
+    }
+    end_field(&f);
+    return f.argv[0];
+}
+
+/*
+ * Check whether a word expands into something else than it is, ie whether
+ * the name of a command is only known once it runs
+ */
+int word_expands(const char *word) {
+    for (; *word != '\0'; word++) {
+        if (*word == '$' || *word == '\'' || *word == '"' || *word == '\\') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Expand the words of a command or subshell, for as long as it runs
+ * @param arena     Where the copy and its words are allocated
+ * @param node      The node as it was parsed
+ * @return          A copy of the node with its words expanded, or NULL
+ * after an error was printed. substitution_status() tells whether it ran
+ * any $(...).
+ */
+struct pish_node *expand_node(struct pish_arena *arena,
+                              const struct pish_node *node) {
+    struct pish_node *copy = arena_alloc(arena, sizeof(*copy));
+    *copy = *node;
+    copy->flags &= ~NODE_EXPAND;
+    last_substitution = -1;
+    buf_set(&field, "", 0);
+    if (node->nassigns > 0) {
+        copy->assigns = arena_alloc(arena, node->nassigns * sizeof(char *));
+        for (int i = 0; i < node->nassigns; i++) {
+            if ((copy->assigns[i] = expand_single(arena, node->assigns[i])) ==
+                NULL) {
+                return NULL;
+            }
+        }
+    }
+    if (node->kind == NODE_COMMAND) {
+        struct fields f = {arena, NULL, 0, 0, 1, 0};
+        for (int i = 0; i < node->argc; i++) {
+            if (expand_word(&f, node->argv[i]) < 0) {
+                return NULL;
+            }
+            end_field(&f);
+        }
+        if (f.argv == NULL) {
+            f.argv = arena_alloc(arena, sizeof(char *));
+            f.argv[0] = NULL;
+        }
+        copy->argv = f.argv;
+        copy->argc = f.argc;
+    }
+    if (node->nredirs > 0) {
+        copy->redirs =
+            arena_alloc(arena, node->nredirs * sizeof(struct pish_redir));
+        for (int i = 0; i < node->nredirs; i++) {
+            struct pish_redir *redir = &copy->redirs[i];
+            *redir = node->redirs[i];
+            if (redir->kind == REDIR_FILE) {
+                redir->path = expand_single(arena, redir->path);
+            } else if (redir->kind == REDIR_DOC && redir->flags != 0) {
+                redir->path = redir->flags == DOC_EXPAND
+                                  ? expand_document(arena, redir->path)
+                                  : expand_single(arena, redir->path);
+                // a here-string ends with a new line
+                if (redir->path != NULL && redir->flags == DOC_WORD) {
+                    size_t len = strlen(redir->path);
+                    char *doc = arena_alloc(arena, len + 2);
+                    memcpy(doc, redir->path, len);
+                    memcpy(doc + len, "\n", 2);
+                    redir->path = doc;
+                }
+                redir->flags = 0;
+            }
+            if (redir->path == NULL && redir->kind != REDIR_DUP &&
+                redir->kind != REDIR_CLOSE) {
+                return NULL;
+            }
+        }
+    }
+    return copy;
+}
+
+/*
+ * @return          The status of the last $(...) the last expand_node() ran,
+ * or -1 if it ran none
+ */
+int substitution_status(void) {
+    return last_substitution;
+}
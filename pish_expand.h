@@ -0,0 +1,38 @@
+#ifndef __PISH_EXPAND_H__
+#define __PISH_EXPAND_H__
+
+#include "pish_arena.h"
+#include "pish_parse.h"
+
+/*
+ * Expansion of the words of a command right before it runs. The parser
+ * keeps the words as they were written and flags the commands which have
+ * any to expand with NODE_EXPAND, so a tree from the script cache is
+ * expanded anew each time it runs and the others cost nothing.
+ *   $NAME ${NAME}      The value of a variable, nothing if it is not set
+ *   $? $$              The status of the last command, the pid of the shell
+ *   ${PIPESTATUS[n]}   The status of stage n of the last pipeline, [@] for
+ *                      all of them and $PIPESTATUS for the first one
+ *   $(command)         The output of the command without its trailing
+ *                      newlines, it runs in a forked copy of the shell
+ *   '...' "..." \c     Quotes, which are removed. Inside "" only $ and \
+ *                      followed by $ ` " \ or a newline are special.
+ * A here-document is expanded like the inside of "", only its " are kept.
+ * The results of $ and $(...) outside of quotes are split into fields at
+ * spaces, tabs and newlines, except in assignments and redirections.
+ */
+struct expand_shell {
+    /* Run a command line in the forked child of a $(...), never returns */
+    void (*substitute)(const char *chain);
+    const int *status;       /* For $? */
+    int *const *pipe_status; /* For PIPESTATUS, with npipe_status entries */
+    const int *npipe_status;
+};
+
+void expand_init(const struct expand_shell *hooks);
+int word_expands(const char *word);
+struct pish_node *expand_node(struct pish_arena *arena,
+                              const struct pish_node *node);
+int substitution_status(void);
+
+#endif // __PISH_EXPAND_H__
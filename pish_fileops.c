@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pish_copy.h"
+#include "pish_fileops.h"
+
+/*
+ * Check the arguments of a file utility against the options it has built
+ * in. Options can be mixed with the operands like with the GNU programs.
+ * @param options   The letters of the options which are built in
+ * @param operands  How many operands are needed at least
+ * @return          1 if every option is one of options, 0 otherwise
+ */
+static int plain_options(int argc, char **argv, const char *options,
+                         int operands) {
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            count++;
+            continue;
+        }
+        // --, --help and the like are left to the program
+        if (argv[i][1] == '-' ||
+            strspn(argv[i] + 1, options) != strlen(argv[i] + 1)) {
+            return 0;
+        }
+    }
+    return count >= operands;
+}
+
+/*
+ * Check whether an option letter was given
+ */
+static int has_option(int argc, char **argv, char option) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && strchr(argv[i] + 1, option) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_operand(const char *arg) {
+    return arg[0] != '-' || arg[1] == '\0';
+}
+
+/*
+ * Check whether the built-in version of a file utility can run a command
+ * @param argc      The number of arguments, including the name
+ * @param argv      The command, argv[0] is one of the file utilities
+ * @return          1 if it can, 0 if the program itself has to run
+ */
+int fileop_accepts(int argc, char **argv) {
+    const char *name = argv[0];
+    if (strcmp(name, "cat") == 0) {
+        return plain_options(argc, argv, "", 0);
+    } else if (strcmp(name, "cp") == 0) {
+        return plain_options(argc, argv, "", 2);
+    } else if (strcmp(name, "mkdir") == 0) {
+        return plain_options(argc, argv, "p", 1);
+    } else if (strcmp(name, "rm") == 0) {
+        // rm asks before it removes a write-protected file when stdin is a
+        // terminal, the built-in never asks
+        int force = has_option(argc, argv, 'f');
+        return plain_options(argc, argv, "f", force ? 0 : 1) &&
+               (force || !isatty(STDIN_FILENO));
+    } else if (strcmp(name, "touch") == 0) {
+        return plain_options(argc, argv, "", 1);
+    }
+    return 0;
+}
+
+/*
+ * cat [file ...], where - or no file at all is stdin
+ */
+int builtin_cat(int argc, char **argv) {
+    int status = 0;
+    int operands = 0;
+    // what the shell printed so far goes first, cat writes to the fd
+    fflush(stdout);
+    for (int i = 1; i <= argc; i++) {
+        const char *path;
+        if (i < argc) {
+            path = argv[i];
+        } else if (operands == 0) {
+            path = "-";
+        } else {
+            break;
+        }
+        operands++;
+        int opened = strcmp(path, "-") != 0;
+        int fd = opened ? open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY)
+                        : STDIN_FILENO;
+        if (fd < 0 || copy_all(fd, STDOUT_FILENO) < 0) {
+            int error = errno;
+            if (opened && fd >= 0) {
+                close(fd);
+            }
+            if (error == EPIPE) {
+                // the reader is gone, like the program would die of SIGPIPE
+                return 128 + SIGPIPE;
+            }
+            fprintf(stderr, "cat: %s: %s\n", path, strerror(error));
+            status = 1;
+        } else if (opened) {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+/*
+ * Copy one regular file to a path, which keeps its mode if it exists and
+ * gets the mode of the source otherwise
+ * @return          0 on success, 1 after an error was printed
+ */
+static int copy_file(const char *source, const char *dest) {
+    int in = open(source, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    struct stat in_stat, out_stat;
+    if (in < 0 || fstat(in, &in_stat) < 0) {
+        fprintf(stderr, "cp: cannot stat '%s': %s\n", source,
+                strerror(errno));
+        if (in >= 0) {
+            close(in);
+        }
+        return 1;
+    }
+    if (S_ISDIR(in_stat.st_mode)) {
+        fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n",
+                source);
+        close(in);
+        return 1;
+    }
+    if (stat(dest, &out_stat) == 0 && out_stat.st_dev == in_stat.st_dev &&
+        out_stat.st_ino == in_stat.st_ino) {
+        fprintf(stderr, "cp: '%s' and '%s' are the same file\n", source,
+                dest);
+        close(in);
+        return 1;
+    }
+    // like cp without -p, the setuid, setgid and sticky bits are not copied
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOCTTY,
+                   in_stat.st_mode & 0777);
+    if (out < 0) {
+        fprintf(stderr, "cp: cannot create regular file '%s': %s\n", dest,
+                strerror(errno));
+        close(in);
+        return 1;
+    }
+    int status = 0;
+    if (copy_all(in, out) < 0) {
+        fprintf(stderr, "cp: error copying '%s' to '%s': %s\n", source, dest,
+                strerror(errno));
+        status = 1;
+    }
+    close(in);
+    if (close(out) < 0 && status == 0) {
+        fprintf(stderr, "cp: failed to close '%s': %s\n", dest,
+                strerror(errno));
+        status = 1;
+    }
+    return status;
+}
+
+/*
+ * cp source dest, or cp source ... dir
+ */
+int builtin_cp(int argc, char **argv) {
+    const char *target = NULL;
+    int sources = -1;
+    for (int i = 1; i < argc; i++) {
+        if (is_operand(argv[i])) {
+            target = argv[i];
+            sources++;
+        }
+    }
+    struct stat st;
+    int found = stat(target, &st) == 0;
+    int to_dir = found && S_ISDIR(st.st_mode);
+    if (sources > 1 && !to_dir) {
+        if (found) {
+            fprintf(stderr, "cp: target '%s' is not a directory\n", target);
+        } else {
+            fprintf(stderr, "cp: target '%s': %s\n", target, strerror(errno));
+        }
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; i < argc && sources > 0; i++) {
+        if (!is_operand(argv[i])) {
+            continue;
+        }
+        sources--;
+        if (!to_dir) {
+            status |= copy_file(argv[i], target);
+            continue;
+        }
+        char *dest;
+        if (asprintf(&dest, "%s/%s", target, basename(argv[i])) < 0) {
+            perror("asprintf");
+            exit(EXIT_FAILURE);
+        }
+        status |= copy_file(argv[i], dest);
+        free(dest);
+    }
+    return status;
+}
+
+static int mkdir_error(const char *path) {
+    fprintf(stderr, "mkdir: cannot create directory '%s': %s\n", path,
+            strerror(errno));
+    return 1;
+}
+
+/*
+ * Create a directory, with -p also every missing directory above it
+ * @return          0 on success, 1 after an error was printed
+ */
+static int make_dir(const char *path, int parents) {
+    if (parents) {
+        char *partial = strdup(path);
+        if (partial == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        // a leading / is the root, not a directory to create
+        char *slash = partial + (partial[0] == '/');
+        for (; (slash = strchr(slash, '/')) != NULL; slash++) {
+            *slash = '\0';
+            if (mkdir(partial, 0777) < 0 && errno != EEXIST) {
+                int status = mkdir_error(partial);
+                free(partial);
+                return status;
+            }
+            *slash = '/';
+        }
+        free(partial);
+    }
+    if (mkdir(path, 0777) == 0) {
+        return 0;
+    }
+    int error = errno;
+    struct stat st;
+    if (parents && error == EEXIST && stat(path, &st) == 0 &&
+        S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+    errno = error;
+    return mkdir_error(path);
+}
+
+/*
+ * mkdir [-p] dir ...
+ */
+int builtin_mkdir(int argc, char **argv) {
+    int parents = has_option(argc, argv, 'p');
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (is_operand(argv[i])) {
+            status |= make_dir(argv[i], parents);
+        }
+    }
+    return status;
+}
+
+/*
+ * rm [-f] file ..., which never removes directories
+ */
+int builtin_rm(int argc, char **argv) {
+    int force = has_option(argc, argv, 'f');
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!is_operand(argv[i]) || unlink(argv[i]) == 0 ||
+            (force && errno == ENOENT)) {
+            continue;
+        }
+        fprintf(stderr, "rm: cannot remove '%s': %s\n", argv[i],
+                strerror(errno));
+        status = 1;
+    }
+    return status;
+}
+
+/*
+ * touch file ..., which creates the files which do not exist and sets the
+ * times of the others to now
+ */
+int builtin_touch(int argc, char **argv) {
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!is_operand(argv[i])) {
+            continue;
+        }
+        int fd = open(argv[i],
+                      O_WRONLY | O_CREAT | O_NONBLOCK | O_NOCTTY | O_CLOEXEC,
+                      0666);
+        if (fd >= 0) {
+            int updated = futimens(fd, NULL) == 0;
+            close(fd);
+            if (updated) {
+                continue;
+            }
+        } else {
+            // ie a directory or a file which is not writable but owned
+            int error = errno;
+            if (utimensat(AT_FDCWD, argv[i], NULL, 0) == 0) {
+                continue;
+            }
+            errno = error;
+        }
+        fprintf(stderr, "touch: cannot touch '%s': %s\n", argv[i],
+                strerror(errno));
+        status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,18 @@
+#ifndef __PISH_FILEOPS_H__
+#define __PISH_FILEOPS_H__
+
+/*
+ * Built-in versions of the file utilities scripts run line after line:
+ * cat, cp, mkdir, rm and touch. Only the common forms are built in, see
+ * fileop_accepts(), any other option runs the real program instead. Their
+ * messages are the ones of the coreutils programs. set +o fileops turns
+ * them off.
+ */
+int fileop_accepts(int argc, char **argv);
+int builtin_cat(int argc, char **argv);
+int builtin_cp(int argc, char **argv);
+int builtin_mkdir(int argc, char **argv);
+int builtin_rm(int argc, char **argv);
+int builtin_touch(int argc, char **argv);
+
+#endif // __PISH_FILEOPS_H__
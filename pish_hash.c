@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pish_hash.h"
+#include "pish_vars.h"
+
+/*
+ * One resolved command. The table uses open addressing with linear probing,
+ * a slot is empty when name is NULL.
+ */
+struct hash_entry {
+    char *name;        /* The command name as typed, ie ls */
+    char *path;        /* The resolved absolute path, ie /usr/bin/ls */
+    unsigned int hits; /* How many times the entry was used */
+};
+
+static struct hash_entry *table = NULL;
+static size_t table_size = 0; /* Always a power of two */
+static size_t table_count = 0;
+/* The value of $PATH the entries were resolved with */
+static char *hashed_path = NULL;
+/* Holds results which are not cached, see resolve() */
+static char *uncached = NULL;
+
+/*
+ * FNV-1a hash of a command name
+ */
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Find the slot of a name, or the empty slot where it would be inserted
+ */
+static size_t find_slot(const char *name) {
+    size_t mask = table_size - 1;
+    size_t i = hash_name(name) & mask;
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void grow_table(void) {
+    struct hash_entry *old = table;
+    size_t old_size = table_size;
+    table_size = table_size ? table_size * 2 : 64;
+    table = calloc(table_size, sizeof(struct hash_entry));
+    if (table == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].name != NULL) {
+            table[find_slot(old[i].name)] = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+ * Drop every entry of the table
+ */
+void hash_clear(void) {
+    for (size_t i = 0; i < table_size; i++) {
+        free(table[i].name);
+        free(table[i].path);
+        table[i].name = NULL;
+        table[i].path = NULL;
+    }
+    table_count = 0;
+}
+
+/*
+ * Remove a single command from the table, ie because its cached path no
+ * longer exists. Later entries of the probe sequence are shifted back so
+ * lookups never stop at the hole.
+ * @param name      The command name to remove
+ */
+void hash_forget(const char *name) {
+    if (table_count == 0) {
+        return;
+    }
+    size_t mask = table_size - 1;
+    size_t i = find_slot(name);
+    if (table[i].name == NULL) {
+        return;
+    }
+    free(table[i].name);
+    free(table[i].path);
+    table[i].name = NULL;
+    table_count--;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (table[j].name == NULL) {
+            break;
+        }
+        size_t home = hash_name(table[j].name) & mask;
+        // move the entry into the hole unless its home slot lies cyclically
+        // in (i, j]
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            table[j].name = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Make sure the entries were resolved with the current $PATH, otherwise drop
+ * them all
+ */
+static void check_path(void) {
+    const char *path = var_get("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+    if (hashed_path != NULL && strcmp(hashed_path, path) == 0) {
+        return;
+    }
+    hash_clear();
+    free(hashed_path);
+    hashed_path = strdup(path);
+    if (hashed_path == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Search $PATH for an executable regular file, in the same order execvp()
+ * would.
+ * @param name      The command name, it contains no '/'
+ * @param relative  Set to 1 if it was found through a relative $PATH entry
+ * such as "." whose result depends on the working directory
+ * @return          A malloc'd path, or NULL if it was not found
+ */
+static char *resolve(const char *name, int *relative) {
+    size_t name_len = strlen(name);
+    const char *dir = hashed_path;
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (candidate == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        // an empty $PATH entry means the current directory
+        if (dir_len == 0) {
+            memcpy(candidate, "./", 2);
+            memcpy(candidate + 2, name, name_len + 1);
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0) {
+            *relative = candidate[0] != '/';
+            return candidate;
+        }
+        free(candidate);
+        if (*end == '\0') {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/*
+ * Resolve a command name to the path it should be executed from, using the
+ * table when possible.
+ * @param name      The command name, ie argv[0]
+ * @return          The path to execute, name itself if it contains a '/', or
+ * NULL (with errno set to ENOENT) if it is not in $PATH. The string stays
+ * valid until the next call.
+ */
+const char *hash_lookup(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    check_path();
+    if (table_size > 0) {
+        size_t i = find_slot(name);
+        if (table[i].name != NULL) {
+            table[i].hits++;
+            return table[i].path;
+        }
+    }
+    int relative;
+    char *path = resolve(name, &relative);
+    if (path == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    // results from relative $PATH entries change with cd so are not cached
+    if (relative) {
+        free(uncached);
+        uncached = path;
+        return path;
+    }
+    if ((table_count + 1) * 2 > table_size) {
+        grow_table();
+    }
+    size_t i = find_slot(name);
+    table[i].name = strdup(name);
+    if (table[i].name == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    table[i].path = path;
+    table[i].hits = 1;
+    table_count++;
+    return path;
+}
+
+/*
+ * Print the table the way the hash built-in shows it, the number of hits and
+ * the path of every command.
+ */
+void hash_print(void) {
+    check_path();
+    if (table_count == 0) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < table_size; i++) {
+        if (table[i].name != NULL) {
+            printf("%4u\t%s\n", table[i].hits, table[i].path);
+        }
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef __PISH_HASH_H__
+#define __PISH_HASH_H__
+
+/*
+ * Cache of command names resolved through $PATH, like the hash table of
+ * other shells. The whole table is dropped whenever $PATH changes.
+ */
+const char *hash_lookup(const char *name);
+void hash_forget(const char *name);
+void hash_clear(void);
+void hash_print(void);
+
+#endif // __PISH_HASH_H__
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pish_heredoc.h"
+
+/*
+ * Write all of a document to an fd
+ * @return          0, or -1 if it could not be written
+ */
+static int write_all(int fd, const char *doc, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, doc, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("write");
+            return -1;
+        }
+        doc += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Open an fd which reads a document from its start, see pish_heredoc.h
+ * @param doc       The content of the document
+ * @param len       Its length
+ * @return          The fd, which is close on exec, or -1 after an error was
+ * printed
+ */
+int heredoc_open(const char *doc, size_t len) {
+    if (len <= PIPE_BUF) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        // the pipe is empty, so this never waits for a reader
+        int result = write_all(fds[1], doc, len);
+        close(fds[1]);
+        if (result < 0) {
+            close(fds[0]);
+            return -1;
+        }
+        return fds[0];
+    }
+    int fd = memfd_create("pish-heredoc", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (write_all(fd, doc, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    // the command reads it from the start
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        perror("lseek");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
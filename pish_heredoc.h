@@ -0,0 +1,14 @@
+#ifndef __PISH_HEREDOC_H__
+#define __PISH_HEREDOC_H__
+
+#include <stddef.h>
+
+/*
+ * The documents of << and <<< are handed to a command as an fd to read
+ * them from, without a file on disk. A document of up to PIPE_BUF bytes is
+ * written into a pipe, which takes that much at once without a reader, a
+ * larger one into a memfd_create() file, which only lives in memory.
+ */
+int heredoc_open(const char *doc, size_t len);
+
+#endif // __PISH_HEREDOC_H__
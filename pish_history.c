@@ -1,50 +1,858 @@
-#include <pwd.h>
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pish_history.h"
+#include "pish_user.h"
 
 static char pish_history_path[1024] = {'\0'};
 
 /*
- * Set history file path to ~/.pish_history.
+ * Entries are not written to the history file one by one. They are batched
+ * in pending and written with a single write() to a descriptor which stays
+ * open, once HISTORY_FLUSH_SIZE bytes are waiting, and when the shell exits.
+ * They are also written once the oldest waiting entry is
+ * HISTORY_FLUSH_INTERVAL ms old: the shell checks before its prompt, and
+ * while it waits for input it wakes up when they are due, see
+ * history_flush_timeout().
+ */
+#define HISTORY_FLUSH_SIZE 4096
+#define HISTORY_FLUSH_INTERVAL 1000
+
+static int history_fd = -1;
+static char *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+static long pending_since = 0; /* When the oldest waiting entry came, in ms */
+/* The process which owns pending, forked children never write it */
+static pid_t history_owner = 0;
+
+/*
+ * The history file is mapped into memory rather than read. Its lines are
+ * indexed from the end, file_tail[0] being the last line of the file, and
+ * only as far back as something asks for: startup indexes the last
+ * HISTORY_TAIL_ENTRIES lines and older ones are indexed when history or a
+ * search reaches them. So startup does not depend on the size of the file.
+ * Entries are read straight from the mapping, see GUARDED READS below.
+ */
+#define HISTORY_TAIL_ENTRIES 1000
+
+/*
+ * Commands added during this session are kept in a ring of at most ring_max
+ * entries. The text of every entry lives in one arena, ring[i] only records
+ * where. When the ring is full the oldest entry is dropped, and its arena
+ * space comes back the next time the arena is compacted.
+ *
+ * At most ring_max entries are visible in total, the newest ones of the file
+ * followed by the ring. The default size can be changed with $HISTSIZE.
+ */
+#define HISTORY_DEFAULT_SIZE 500000
+
+struct history_entry {
+    size_t offset; /* Start of the entry in arena or in the mapped file */
+    size_t len;    /* Length without the new line */
+};
+
+static int history_loaded = 0;
+static size_t ring_max = 0;
+
+static char *file_map = NULL;
+static size_t file_map_len = 0;
+static struct history_entry *file_tail = NULL;
+static size_t file_tail_cap = 0;
+static size_t file_tail_count = 0; /* Number of lines indexed so far */
+static size_t file_scan_end = 0;   /* End of the newest line not indexed yet */
+static int file_indexed = 1;       /* Set once every line is indexed */
+static long file_lines = -1;       /* Lines in the file, -1 until counted */
+
+static char *arena = NULL;
+static size_t arena_len = 0;
+static size_t arena_cap = 0;
+static struct history_entry *ring = NULL;
+static size_t ring_cap = 0;
+static size_t ring_head = 0;  /* Index of the oldest entry */
+static size_t ring_count = 0; /* Number of entries in the ring */
+static long session_added = 0; /* Entries added this session, even dropped */
+
+/*
+ * The search of the line editor, see history_search(), goes through an index
+ * of the trigrams of every entry. Each of HISTORY_TRIGRAM_BUCKETS buckets
+ * lists the history numbers of the entries which contain a trigram hashed to
+ * it, in ascending order. A search only checks the entries of the rarest
+ * trigram of what it looks for, instead of all of them. The index is built
+ * by the first search and catches up with the entries added since at every
+ * later one. Buckets are shared by trigrams, so a candidate is always
+ * checked against the entry itself.
+ */
+#define HISTORY_TRIGRAM_BUCKETS 65536
+
+struct trigram_bucket {
+    uint32_t *numbers;
+    uint32_t count;
+    uint32_t cap;
+};
+
+static struct trigram_bucket *trigrams = NULL;
+static long trigrams_indexed = 0; /* Entries 1 to this one are indexed */
+
+/*
+ * GUARDED READS. Another shell can truncate the history file, ie with
+ * history -c, and reading a page of the mapping past the new end of the file
+ * raises SIGBUS. So every read of the mapping is done with file_guarded set,
+ * right after a sigsetjmp() on file_fault. The handler then jumps back there
+ * instead of killing the shell, and the read gives up with file_shrank().
+ * The mask is not saved by sigsetjmp(), which would cost a system call per
+ * read, the handler is installed with SA_NODEFER instead.
+ */
+static sigjmp_buf file_fault;
+static volatile sig_atomic_t file_guarded = 0;
+
+/*
+ * Set history file path to $HISTFILE, or to ~/.pish_history by default.
+ * $HOME is used for ~ before the passwd entry, see home_dir().
  */
 static void set_history_path() {
-    const char *home = getpwuid(getuid())->pw_dir;
-    strncpy(pish_history_path, home, 1024);
-    strcat(pish_history_path, "/.pish_history");
+    const char *file = getenv("HISTFILE");
+    if (file != NULL && *file != '\0') {
+        snprintf(pish_history_path, sizeof(pish_history_path), "%s", file);
+        return;
+    }
+    const char *home = home_dir();
+    snprintf(pish_history_path, sizeof(pish_history_path), "%s/.pish_history",
+             home);
 }
 
 /*
- * Append the command represented by the given struct pish_arg to the history
- * file at pish_history_path. Separate argv values using a single space.
+ * Write all the pending entries to the history file. Only uses
+ * async-signal-safe calls so it can also run from a signal handler.
  */
-void add_history(const struct pish_arg *arg) {
+void flush_history() {
+    if (pending_len == 0 || history_fd < 0 || getpid() != history_owner) {
+        return;
+    }
+    size_t written = 0;
+    while (written < pending_len) {
+        ssize_t n = write(history_fd, pending + written, pending_len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += n;
+    }
+    pending_len = 0;
+}
+
+/*
+ * The time in ms on CLOCK_MONOTONIC
+ */
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * How long the shell can wait before the pending entries are due to be
+ * written. They are written right away if they already are.
+ * @return          The time left in ms, or -1 if nothing is pending
+ */
+int history_flush_timeout() {
+    if (pending_len == 0 || history_fd < 0 || getpid() != history_owner) {
+        return -1;
+    }
+    long left = pending_since + HISTORY_FLUSH_INTERVAL - now_ms();
+    if (left > 0) {
+        return left;
+    }
+    flush_history();
+    return -1;
+}
+
+/*
+ * Flush the pending entries before a SIGHUP or SIGTERM kills the shell, ie
+ * when its terminal is closed
+ */
+static void flush_and_reraise(int sig) {
+    flush_history();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Open the history file the first time an entry is added. The descriptor is
+ * kept open in append mode for the rest of the session.
+ */
+static int open_history() {
+    if (history_fd >= 0) {
+        return 0;
+    }
     if (!(*pish_history_path)) {
         set_history_path();
     }
-    FILE *history = fopen(pish_history_path,"a");
-    if(history==NULL){
+    history_fd =
+        open(pish_history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (history_fd < 0) {
         perror(pish_history_path);
+        return -1;
+    }
+    history_owner = getpid();
+    atexit(flush_history);
+    signal(SIGHUP, flush_and_reraise);
+    signal(SIGTERM, flush_and_reraise);
+    return 0;
+}
+
+/*
+ * Make room for len more bytes in pending
+ */
+static void reserve_pending(size_t len) {
+    if (pending_len + len <= pending_cap) {
         return;
     }
-    char buffer[256];
-    buffer[0]='\0';
-    int i = 0;
-    if(arg->argv[i]!=0){
-        strcat(buffer,arg->argv[i]);
-        i++;
+    size_t cap = pending_cap ? pending_cap : HISTORY_FLUSH_SIZE;
+    while (cap < pending_len + len) {
+        cap *= 2;
     }
-    while(arg->argv[i]!=0){
-        strcat(buffer," ");
-        strcat(buffer,arg->argv[i]);
-        i++;
+    char *grown = realloc(pending, cap);
+    if (grown == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    pending = grown;
+    pending_cap = cap;
+}
+
+/*
+ * The entry with the given position in the ring, 0 being the oldest
+ */
+static struct history_entry *ring_at(size_t i) {
+    return &ring[(ring_head + i) % ring_cap];
+}
+
+/*
+ * Make room for len more bytes at the end of the arena. The live entries are
+ * moved to the front first, and the arena only grows if that was not enough.
+ */
+static void reserve_arena(size_t len) {
+    if (arena_len + len <= arena_cap) {
+        return;
+    }
+    size_t live = 0;
+    for (size_t i = 0; i < ring_count; i++) {
+        live += ring_at(i)->len + 1;
+    }
+    size_t cap = arena_cap ? arena_cap : 65536;
+    while (cap < 2 * (live + len)) {
+        cap *= 2;
+    }
+    char *compacted = malloc(cap);
+    if (compacted == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < ring_count; i++) {
+        struct history_entry *entry = ring_at(i);
+        memcpy(compacted + used, arena + entry->offset, entry->len + 1);
+        entry->offset = used;
+        used += entry->len + 1;
+    }
+    free(arena);
+    arena = compacted;
+    arena_len = used;
+    arena_cap = cap;
+}
+
+/*
+ * Record an entry whose text was just appended at the end of the arena.
+ * The ring grows by doubling until it reaches ring_max, after that the
+ * oldest entry is replaced.
+ */
+static void push_entry(size_t offset, size_t len) {
+    if (ring_count == ring_max) {
+        ring_head = (ring_head + 1) % ring_cap;
+        ring_count--;
+    } else if (ring_count == ring_cap) {
+        // the ring only wraps once it is at ring_max, so ring_head is 0 here
+        ring_cap = ring_cap ? ring_cap * 2 : 1024;
+        if (ring_cap > ring_max) {
+            ring_cap = ring_max;
+        }
+        ring = realloc(ring, ring_cap * sizeof(struct history_entry));
+        if (ring == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct history_entry *entry = &ring[(ring_head + ring_count) % ring_cap];
+    entry->offset = offset;
+    entry->len = len;
+    ring_count++;
+    session_added++;
+}
+
+/*
+ * Append an entry to the in-memory history
+ */
+static void remember(const char *line, size_t len) {
+    reserve_arena(len + 1);
+    memcpy(arena + arena_len, line, len);
+    arena[arena_len + len] = '\n';
+    push_entry(arena_len, len);
+    arena_len += len + 1;
+}
+
+/*
+ * Forget the trigram index, ie when the history numbers change
+ */
+static void reset_trigrams(void) {
+    for (size_t i = 0; trigrams != NULL && i < HISTORY_TRIGRAM_BUCKETS; i++) {
+        trigrams[i].count = 0;
+    }
+    trigrams_indexed = 0;
+}
+
+static void unmap_file(void) {
+    if (file_map != NULL) {
+        munmap(file_map, file_map_len);
+        file_map = NULL;
+    }
+}
+
+/*
+ * A SIGBUS in a guarded read means the file shrank under the mapping, any
+ * other one still kills the shell
+ */
+static void file_fault_handler(int sig) {
+    if (file_guarded) {
+        file_guarded = 0;
+        siglongjmp(file_fault, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Forget the file after a guarded read faulted. None of its lines can be
+ * read anymore, so the history is only the ring from then on.
+ */
+static void file_shrank(void) {
+    file_guarded = 0;
+    unmap_file();
+    file_tail_count = 0;
+    file_indexed = 1;
+    if (file_lines != 0) {
+        // the older entries are gone, so every number changed
+        reset_trigrams();
+    }
+    file_lines = 0;
+}
+
+/*
+ * Copy an entry found with history_recent(), which can be in the mapping
+ * @return          1 if it was copied, 0 if the file was truncated under it
+ */
+static int copy_entry(char *to, const char *entry, size_t len) {
+    if (sigsetjmp(file_fault, 0) != 0) {
+        file_shrank();
+        return 0;
+    }
+    file_guarded = 1;
+    memcpy(to, entry, len);
+    file_guarded = 0;
+    return 1;
+}
+
+/*
+ * Check whether an entry found with history_recent() contains some text
+ * @param prefix    1 if the entry has to start with it
+ * @return          1 if it does, 0 if not or if the file was truncated
+ */
+static int entry_has(const char *entry, size_t len, const char *text,
+                     size_t text_len, int prefix) {
+    if (sigsetjmp(file_fault, 0) != 0) {
+        file_shrank();
+        return 0;
+    }
+    file_guarded = 1;
+    int found = prefix ? len >= text_len && memcmp(entry, text, text_len) == 0
+                       : memmem(entry, len, text, text_len) != NULL;
+    file_guarded = 0;
+    return found;
+}
+
+/*
+ * Index older lines of the mapped file, walking backwards from where the
+ * last call stopped, until at least count lines are indexed or the start of
+ * the file is reached
+ */
+static void index_file(size_t count) {
+    if (file_indexed || file_tail_count >= count) {
+        return;
+    }
+    if (sigsetjmp(file_fault, 0) != 0) {
+        file_shrank();
+        return;
+    }
+    file_guarded = 1;
+    while (!file_indexed && file_tail_count < count) {
+        if (file_tail_count == file_tail_cap) {
+            file_tail_cap = file_tail_cap ? file_tail_cap * 2 : 1024;
+            file_tail =
+                realloc(file_tail, file_tail_cap * sizeof(struct history_entry));
+            if (file_tail == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        // the line starts right after the previous new line of the file
+        const char *nl = memrchr(file_map, '\n', file_scan_end);
+        size_t start = nl ? (size_t)(nl - file_map) + 1 : 0;
+        file_tail[file_tail_count].offset = start;
+        file_tail[file_tail_count].len = file_scan_end - start;
+        file_tail_count++;
+        if (start == 0) {
+            file_indexed = 1;
+        } else {
+            file_scan_end = start - 1;
+        }
+    }
+    file_guarded = 0;
+}
+
+/*
+ * The number of lines in the history file. The lines which are not indexed
+ * yet are only counted, which needs no memory.
+ */
+static long count_file_lines() {
+    if (file_lines >= 0) {
+        return file_lines;
+    }
+    file_lines = file_tail_count;
+    if (file_indexed) {
+        return file_lines;
+    }
+    if (sigsetjmp(file_fault, 0) != 0) {
+        file_shrank();
+        return file_lines;
+    }
+    file_guarded = 1;
+    // the part which is left holds one more line than new lines
+    file_lines++;
+    const char *s = file_map;
+    const char *end = file_map + file_scan_end;
+    while ((s = memchr(s, '\n', end - s)) != NULL) {
+        file_lines++;
+        s++;
+    }
+    file_guarded = 0;
+    return file_lines;
+}
+
+/*
+ * Map the history file into memory and index its last lines. This is done
+ * once, after that every lookup is served from the mapping and the ring.
+ */
+void load_history() {
+    if (history_loaded) {
+        return;
+    }
+    history_loaded = 1;
+    if (!(*pish_history_path)) {
+        set_history_path();
+    }
+    const char *size = getenv("HISTSIZE");
+    ring_max = HISTORY_DEFAULT_SIZE;
+    if (size != NULL && atol(size) > 0) {
+        ring_max = atol(size);
+    }
+    int fd = open(pish_history_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            struct sigaction fault = {0};
+            fault.sa_handler = file_fault_handler;
+            fault.sa_flags = SA_NODEFER;
+            sigaction(SIGBUS, &fault, NULL);
+            file_map = map;
+            file_map_len = st.st_size;
+            file_scan_end = file_map_len;
+            file_indexed = 0;
+            // the new line of the last line does not start another line
+            char last;
+            if (copy_entry(&last, file_map + file_map_len - 1, 1) &&
+                last == '\n') {
+                file_scan_end--;
+            }
+            index_file(HISTORY_TAIL_ENTRIES);
+        }
+    }
+    close(fd);
+}
+
+/*
+ * Look up an entry by how recent it is. Its text can be in the mapping, so
+ * it is only read with copy_entry() or entry_has().
+ * @param back      0 for the most recent entry, 1 for the one before, ...
+ * @param len       The length of the entry is stored here
+ * @return          The text of the entry (not NUL-terminated), or NULL if
+ * there is no such entry
+ */
+static const char *history_recent(size_t back, size_t *len) {
+    load_history();
+    if (back >= ring_max) {
+        return NULL;
+    }
+    if (back < ring_count) {
+        struct history_entry *entry = ring_at(ring_count - 1 - back);
+        *len = entry->len;
+        return arena + entry->offset;
+    }
+    back -= ring_count;
+    index_file(back + 1);
+    if (back >= file_tail_count) {
+        return NULL;
+    }
+    *len = file_tail[back].len;
+    return file_map + file_tail[back].offset;
+}
+
+/*
+ * The history number of the most recent entry, 0 if the history is empty.
+ * This counts the lines of the history file the first time.
+ */
+long history_last() {
+    load_history();
+    return count_file_lines() + session_added;
+}
+
+/*
+ * Look up an entry by its history number, see history_recent()
+ * @param number    The number history shows for the entry
+ * @param len       The length of the entry is stored here
+ * @return          The text of the entry (not NUL-terminated), or NULL if
+ * there is no such entry
+ */
+static const char *history_get(long number, size_t *len) {
+    long last = history_last();
+    if (number < 1 || number > last) {
+        return NULL;
+    }
+    return history_recent(last - number, len);
+}
+
+/*
+ * Append the text of an entry to a buffer
+ * @param number    The number history shows for the entry
+ * @param out       Where it goes
+ * @return          1 if it was appended, 0 if there is no such entry
+ */
+int history_copy(long number, struct pish_buf *out) {
+    size_t len;
+    const char *entry = history_get(number, &len);
+    if (entry == NULL) {
+        return 0;
+    }
+    buf_reserve(out, len);
+    if (!copy_entry(out->data + out->len, entry, len)) {
+        return 0;
+    }
+    out->len += len;
+    out->data[out->len] = '\0';
+    return 1;
+}
+
+/*
+ * Index every line of the file which history shows, before going through
+ * all the entries, so looking them up does not read the mapping anymore
+ */
+static void index_visible(void) {
+    long last = history_last();
+    size_t visible = (size_t)last < ring_max ? (size_t)last : ring_max;
+    if (visible > ring_count) {
+        index_file(visible - ring_count);
+    }
+}
+
+/*
+ * Find the most recent entry which starts with a prefix. Older lines of the
+ * file are indexed as the search reaches them.
+ * @return          How far back the entry is (see history_recent()), or -1 if
+ * there is none
+ */
+static long find_prefix(const char *prefix, size_t len) {
+    const char *entry;
+    size_t entry_len;
+    for (size_t back = 0; (entry = history_recent(back, &entry_len)); back++) {
+        if (entry_has(entry, entry_len, prefix, len, 1)) {
+            return back;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The bucket of the trigram at s
+ */
+static struct trigram_bucket *trigram_at(const char *s) {
+    const unsigned char *c = (const unsigned char *)s;
+    uint32_t hash = (c[0] * 0x9e3779b1u) ^ (c[1] * 0x85ebca77u) ^
+                    (c[2] * 0xc2b2ae3du);
+    return &trigrams[(hash >> 16) % HISTORY_TRIGRAM_BUCKETS];
+}
+
+/*
+ * Add the entries which are not indexed yet to the trigram index
+ */
+static void index_trigrams() {
+    if (trigrams == NULL) {
+        trigrams = calloc(HISTORY_TRIGRAM_BUCKETS, sizeof(*trigrams));
+        if (trigrams == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    index_visible();
+    long last = history_last();
+    // the entries are hashed straight from the mapping
+    if (sigsetjmp(file_fault, 0) != 0) {
+        // every number changed, the index starts over with the ring
+        file_shrank();
+        index_trigrams();
+        return;
+    }
+    file_guarded = 1;
+    for (long number = trigrams_indexed + 1; number <= last; number++) {
+        size_t len;
+        const char *entry = history_get(number, &len);
+        for (size_t i = 0; entry != NULL && i + 3 <= len; i++) {
+            struct trigram_bucket *bucket = trigram_at(entry + i);
+            // an entry is listed once, however often it has the trigram
+            if (bucket->count > 0 &&
+                bucket->numbers[bucket->count - 1] == (uint32_t)number) {
+                continue;
+            }
+            if (bucket->count == bucket->cap) {
+                bucket->cap = bucket->cap ? bucket->cap * 2 : 8;
+                bucket->numbers = realloc(bucket->numbers,
+                                          bucket->cap * sizeof(uint32_t));
+                if (bucket->numbers == NULL) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            bucket->numbers[bucket->count++] = number;
+        }
+    }
+    file_guarded = 0;
+    trigrams_indexed = last;
+}
+
+/*
+ * Check whether an entry contains what is searched for
+ */
+static int entry_contains(long number, const char *text, size_t len) {
+    size_t entry_len;
+    const char *entry = history_get(number, &entry_len);
+    return entry != NULL && entry_has(entry, entry_len, text, len, 0);
+}
+
+/*
+ * Find the most recent entry older than a given one which contains text,
+ * for the reverse search of the line editor. Text of at least 3 bytes is
+ * found through the trigram index, shorter text by checking every entry.
+ * @param text      What to search for, it is not NUL-terminated
+ * @param len       Its length
+ * @param before    Only entries with a lower history number are searched,
+ * history_last() + 1 to search all of them
+ * @return          The history number of the entry, or 0 if there is none
+ */
+long history_search(const char *text, size_t len, long before) {
+    load_history();
+    if (len < 3) {
+        for (long number = before - 1; number >= 1; number--) {
+            if (entry_contains(number, text, len)) {
+                return number;
+            }
+        }
+        return 0;
+    }
+    index_trigrams();
+    struct trigram_bucket *rarest = trigram_at(text);
+    for (size_t i = 1; i + 3 <= len; i++) {
+        struct trigram_bucket *bucket = trigram_at(text + i);
+        if (bucket->count < rarest->count) {
+            rarest = bucket;
+        }
+    }
+    // the first listed entry which is not older than before
+    uint32_t low = 0;
+    uint32_t high = rarest->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (rarest->numbers[middle] < before) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    while (low-- > 0) {
+        if (entry_contains(rarest->numbers[low], text, len)) {
+            return rarest->numbers[low];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Characters which end the word of a history event, ie !ls| stops at |
+ */
+static int ends_event(char c) {
+    return c == '\0' || strchr(" \t;&|()<>", c) != NULL;
+}
+
+/*
+ * Expand the history events of an interactive command line:
+ *   !!         the previous command
+ *   !n         the command with history number n
+ *   !-n        the n-th previous command
+ *   !prefix    the most recent command starting with prefix
+ * A '!' is only an event at the start of a word and when it is not followed
+ * by a space, so "! cmd" still negates cmd. A !prefix which matches nothing
+ * is left as it is.
+ *
+ * @param line      The command line to expand
+ * @param error     Set to 1 if an event was not found (which has already been
+ * printed), 0 otherwise
+ * @return          A malloc'd expanded line, or NULL if nothing was expanded
+ */
+char *expand_history(const char *line, int *error) {
+    *error = 0;
+    if (strchr(line, '!') == NULL) {
+        return NULL;
+    }
+    load_history();
+    size_t cap = strlen(line) + 1;
+    size_t out_len = 0;
+    char *out = NULL;
+    const char *copied = line; // everything before this is already in out
+    for (const char *s = line; *s != '\0'; s++) {
+        if (*s != '!' || (s > line && !ends_event(s[-1])) || ends_event(s[1]) ||
+            s[1] == '=') {
+            continue;
+        }
+        const char *entry;
+        size_t len;
+        const char *end = s + 1;
+        if (s[1] == '!') {
+            entry = history_recent(0, &len);
+            end = s + 2;
+        } else if (s[1] == '-' && isdigit((unsigned char)s[2])) {
+            long back = strtol(s + 2, (char **)&end, 10);
+            entry = back > 0 ? history_recent(back - 1, &len) : NULL;
+        } else if (isdigit((unsigned char)s[1])) {
+            entry = history_get(strtol(s + 1, (char **)&end, 10), &len);
+        } else {
+            while (!ends_event(*end)) {
+                end++;
+            }
+            long back = find_prefix(s + 1, end - s - 1);
+            if (back < 0) {
+                s = end - 1;
+                continue;
+            }
+            entry = history_recent(back, &len);
+        }
+        // the entry goes after the text before the event, which is copied
+        // once it is there
+        size_t before = s - copied;
+        while (entry != NULL &&
+               (out == NULL || out_len + before + len + strlen(end) >= cap)) {
+            cap = out == NULL ? cap + len : cap * 2;
+            char *grown = realloc(out, cap);
+            if (grown == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            out = grown;
+        }
+        if (entry == NULL || !copy_entry(out + out_len + before, entry, len)) {
+            fprintf(stderr, "pish: %.*s: event not found\n", (int)(end - s), s);
+            free(out);
+            *error = 1;
+            return NULL;
+        }
+        memcpy(out + out_len, copied, before);
+        out_len += before + len;
+        copied = end;
+        s = end - 1;
+    }
+    if (out == NULL) {
+        return NULL;
+    }
+    strcpy(out + out_len, copied);
+    return out;
+}
+
+/*
+ * Append a command line to the history file at pish_history_path. Runs of
+ * spaces and tabs are stored as a single space, and leading and trailing
+ * whitespace is dropped. The entry is batched in memory, see
+ * flush_history().
+ */
+void add_history(const char *line) {
+    load_history();
+    if (open_history() < 0) {
+        return;
+    }
+    size_t len = strlen(line);
+    reserve_pending(len + 1);
+    size_t start = pending_len;
+    char *out = pending + pending_len;
+    for (const char *s = line; *s != '\0'; s++) {
+        if (*s == ' ' || *s == '\t') {
+            // a space only between two words
+            if (out > pending + start && out[-1] != ' ') {
+                *out++ = ' ';
+            }
+        } else {
+            *out++ = *s;
+        }
+    }
+    if (out > pending + start && out[-1] == ' ') {
+        out--;
+    }
+    if (out == pending + start) {
+        return;
+    }
+    if (start == 0) {
+        pending_since = now_ms();
+    }
+    *out++ = '\n';
+    pending_len = out - pending;
+    remember(pending + start, pending_len - start - 1);
+    if (pending_len >= HISTORY_FLUSH_SIZE ||
+        now_ms() - pending_since >= HISTORY_FLUSH_INTERVAL) {
+        flush_history();
     }
-    fprintf(history,"%s\n",buffer);
-    fclose(history);
 }
 
 /*
@@ -59,28 +867,49 @@ void add_history(const struct pish_arg *arg) {
  * Then, this function should print:
  * 1 echo Hello 1
  * 2 pwd
+ *
+ * The entries come from the mapped file and the ring, see load_history().
  */
 void print_history() {
-    if (!(*pish_history_path)) {
-        set_history_path();
-    }
-    FILE *history = fopen(pish_history_path,"r");
-    char line[256];
-    int count = 1;
-    while(fgets(line,256,history)!=NULL){
-        printf("%d %s",count,line);
-        count++;
+    // make sure all the file lines which are shown are indexed, which drops
+    // them if the file was truncated meanwhile
+    index_visible();
+    long last = history_last();
+    size_t visible = (size_t)last < ring_max ? (size_t)last : ring_max;
+    struct pish_buf line = {0};
+    for (size_t back = visible; back > 0; back--) {
+        size_t len;
+        const char *entry = history_recent(back - 1, &len);
+        // printf() is not left in the middle by a fault, the entry is copied
+        // out of the mapping first
+        buf_reserve(&line, entry != NULL ? len : 0);
+        if (entry == NULL || !copy_entry(line.data, entry, len)) {
+            continue;
+        }
+        printf("%ld %.*s\n", last - (long)back + 1, (int)len, line.data);
     }
-    fclose(history);
+    buf_free(&line);
 }
 
 /*
- * Clear the contents of the file at pish_history_path.
+ * Clear the contents of the file at pish_history_path, along with the
+ * in-memory history.
  */
 void clear_history() {
     if (!(*pish_history_path)) {
         set_history_path();
     }
+    load_history();
+    pending_len = 0;
+    ring_head = 0;
+    ring_count = 0;
+    arena_len = 0;
+    session_added = 0;
+    unmap_file();
+    file_tail_count = 0;
+    file_indexed = 1;
+    file_lines = 0;
+    reset_trigrams();
     FILE *history = fopen(pish_history_path,"w");
     if(history==NULL){
         perror(pish_history_path);
@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pish_input.h"
+
+/*
+ * Start reading lines from fd
+ */
+void reader_init(struct pish_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->buf = NULL;
+    reader->start = 0;
+    reader->end = 0;
+    reader->cap = 0;
+    reader->eof = 0;
+}
+
+/*
+ * Read more input into the buffer. Unread data is moved to the front first,
+ * and the buffer doubles when a single line fills all of it.
+ * @return          The number of bytes read, 0 at end of input
+ */
+static ssize_t fill(struct pish_reader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->cap - reader->end < READER_BLOCK_SIZE / 2) {
+        size_t cap = reader->cap ? reader->cap * 2 : READER_BLOCK_SIZE;
+        char *grown = realloc(reader->buf, cap);
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        reader->buf = grown;
+        reader->cap = cap;
+    }
+    ssize_t n;
+    do {
+        // keep one byte for the NUL terminator of the line
+        n = read(reader->fd, reader->buf + reader->end,
+                 reader->cap - reader->end - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("read");
+        n = 0;
+    }
+    if (n == 0) {
+        reader->eof = 1;
+    }
+    reader->end += n;
+    return n;
+}
+
+/*
+ * Read the next line of input.
+ * @param reader    The reader to read from
+ * @param line      Set to the line, without its new line and NUL-terminated.
+ * It stays valid until the next call.
+ * @return          The length of the line, or -1 at the end of the input
+ */
+ssize_t read_line(struct pish_reader *reader, char **line) {
+    size_t scanned = 0; // bytes of the line already searched for a new line
+    while (1) {
+        char *start = reader->buf + reader->start;
+        size_t avail = reader->end - reader->start;
+        char *nl = avail > scanned ? memchr(start + scanned, '\n',
+                                            avail - scanned)
+                                   : NULL;
+        if (nl != NULL) {
+            *nl = '\0';
+            *line = start;
+            reader->start += nl - start + 1;
+            return nl - start;
+        }
+        scanned = avail;
+        if (reader->eof || fill(reader) == 0) {
+            break;
+        }
+    }
+    // the last line of the input has no new line
+    size_t avail = reader->end - reader->start;
+    if (avail == 0) {
+        return -1;
+    }
+    *line = reader->buf + reader->start;
+    (*line)[avail] = '\0';
+    reader->start = reader->end;
+    return avail;
+}
+
+/*
+ * Wait for more input, unless a whole line is already buffered
+ * @param reader    The reader to wait for
+ * @param timeout   How long to wait at most in ms
+ * @return          0 if the time ran out, 1 otherwise
+ */
+int reader_wait(struct pish_reader *reader, int timeout) {
+    size_t avail = reader->end - reader->start;
+    if (reader->eof ||
+        (avail > 0 && memchr(reader->buf + reader->start, '\n', avail))) {
+        return 1;
+    }
+    struct pollfd poll_fd = {reader->fd, POLLIN, 0};
+    return poll(&poll_fd, 1, timeout) != 0;
+}
+
+/*
+ * Release the buffer of the reader
+ */
+void reader_free(struct pish_reader *reader) {
+    free(reader->buf);
+    reader->buf = NULL;
+}
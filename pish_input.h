@@ -0,0 +1,27 @@
+#ifndef __PISH_INPUT_H__
+#define __PISH_INPUT_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Reads the input of the shell line by line with read(2) in large blocks.
+ * Lines have no length limit, the buffer grows to hold the longest one.
+ */
+#define READER_BLOCK_SIZE 65536
+
+struct pish_reader {
+    int fd;
+    char *buf;
+    size_t start; /* Start of the unread data in buf */
+    size_t end;   /* End of the data read into buf */
+    size_t cap;
+    int eof;
+};
+
+void reader_init(struct pish_reader *reader, int fd);
+ssize_t read_line(struct pish_reader *reader, char **line);
+int reader_wait(struct pish_reader *reader, int timeout);
+void reader_free(struct pish_reader *reader);
+
+#endif // __PISH_INPUT_H__
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pish_jobs.h"
+#include "pish_profile.h"
+
+enum job_state {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+};
+
+/*
+ * One background job. A job is a single process, either the command itself
+ * or a child shell running a pipeline or list, so with job control its pid
+ * is also its process group.
+ */
+struct job {
+    int id;          /* The number shown as [id] and used as %id */
+    pid_t pid;
+    enum job_state state;
+    int status;      /* The last status from waitpid() */
+    int changed;     /* Set when the job stopped and was not reported yet */
+    char *command;   /* The command line, see format_node() */
+};
+
+/* The table is kept in the order jobs were started, so ids are increasing */
+static struct job *jobs = NULL;
+static int njobs = 0;
+static int jobs_capacity = 0;
+/* Set for interactive shells, which report jobs which finish or stop */
+static int notify = 0;
+/* Set when jobs get their own process group and the terminal with fg */
+static int control = 0;
+static pid_t shell_pgid = 0;
+static volatile sig_atomic_t child_changed = 0;
+
+static void sigchld_handler(int sig) {
+    (void)sig;
+    child_changed = 1;
+}
+
+/*
+ * Install the SIGCHLD handler. It restarts interrupted system calls so the
+ * blocking waits and reads of the shell are not disturbed.
+ * @param interactive   1 if the shell reads commands from its user
+ */
+void jobs_init(int interactive) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    notify = interactive;
+    control = interactive && isatty(STDIN_FILENO);
+    if (control) {
+        shell_pgid = getpgrp();
+    }
+}
+
+/*
+ * @return          1 if background jobs run in their own process group
+ */
+int job_control(void) {
+    return control;
+}
+
+/*
+ * Convert a status from waitpid() into a shell exit status
+ * @param status    The status filled in by waitpid()
+ * @return          The exit code, or 128 plus the signal number if the process
+ * was killed or stopped by a signal
+ */
+int exit_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    } else if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 1;
+}
+
+/*
+ * Add a job which was just started to the table
+ * @param pid       The process running the job
+ * @param command   The command line of the job, it is copied
+ * @return          The id of the job
+ */
+int job_add(pid_t pid, const char *command) {
+    if (njobs == jobs_capacity) {
+        int capacity = jobs_capacity ? jobs_capacity * 2 : 8;
+        struct job *grown = realloc(jobs, capacity * sizeof(struct job));
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        jobs = grown;
+        jobs_capacity = capacity;
+    }
+    struct job *job = &jobs[njobs];
+    job->id = njobs ? jobs[njobs - 1].id + 1 : 1;
+    job->pid = pid;
+    job->state = JOB_RUNNING;
+    job->status = 0;
+    job->changed = 0;
+    job->command = strdup(command);
+    if (job->command == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    njobs++;
+    if (notify) {
+        fprintf(stderr, "[%d] %d\n", job->id, (int)pid);
+    }
+    return job->id;
+}
+
+static void remove_job(int i) {
+    free(jobs[i].command);
+    memmove(&jobs[i], &jobs[i + 1], (njobs - i - 1) * sizeof(struct job));
+    njobs--;
+}
+
+/*
+ * Record a status returned by waitpid() for a job
+ */
+static void update_job(struct job *job, int status) {
+    job->status = status;
+    if (WIFSTOPPED(status)) {
+        job->state = JOB_STOPPED;
+        job->changed = 1;
+    } else if (WIFCONTINUED(status)) {
+        job->state = JOB_RUNNING;
+    } else {
+        job->state = JOB_DONE;
+    }
+}
+
+/*
+ * Collect the status of every job which finished, stopped or continued since
+ * the last call. It never blocks, and does nothing unless a SIGCHLD arrived.
+ * Only the pids of jobs are waited for, so the children of a foreground
+ * command are left to the waitpid() which runs it.
+ */
+void jobs_reap(void) {
+    if (!child_changed) {
+        return;
+    }
+    child_changed = 0;
+    for (int i = 0; i < njobs; i++) {
+        struct job *job = &jobs[i];
+        int status;
+        pid_t pid = 0;
+        while (job->state != JOB_DONE &&
+               (pid = wait_process(job->pid, &status,
+                                   WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+            update_job(job, status);
+        }
+        if (job->state != JOB_DONE && pid < 0 && errno == ECHILD) {
+            // somebody else waited for it, the status is lost
+            job->state = JOB_DONE;
+            job->status = 127 << 8;
+        }
+    }
+}
+
+/*
+ * Print a line of the jobs table, the way the jobs built-in shows it. The
+ * most recent job is marked with + and the one before it with -.
+ */
+static void print_job(int i) {
+    struct job *job = &jobs[i];
+    char state[64];
+    if (job->state == JOB_RUNNING) {
+        strcpy(state, "Running");
+    } else if (job->state == JOB_STOPPED) {
+        strcpy(state, "Stopped");
+    } else if (WIFSIGNALED(job->status)) {
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(job->status)));
+    } else if (exit_status(job->status) != 0) {
+        snprintf(state, sizeof(state), "Exit %d", exit_status(job->status));
+    } else {
+        strcpy(state, "Done");
+    }
+    char mark = i == njobs - 1 ? '+' : i == njobs - 2 ? '-' : ' ';
+    printf("[%d]%c  %-24s%s\n", job->id, mark, state, job->command);
+}
+
+/*
+ * Report the jobs which finished or stopped, called before every prompt.
+ * Finished jobs are dropped once they are reported. Shells which are not
+ * interactive report nothing and keep finished jobs for wait and jobs.
+ */
+void jobs_notify(void) {
+    jobs_reap();
+    if (!notify) {
+        return;
+    }
+    for (int i = 0; i < njobs; i++) {
+        if (jobs[i].state == JOB_DONE) {
+            print_job(i);
+            remove_job(i--);
+        } else if (jobs[i].changed) {
+            jobs[i].changed = 0;
+            print_job(i);
+        }
+    }
+    fflush(stdout);
+}
+
+/*
+ * Empty the table without waiting, in a forked child where the jobs of the
+ * parent are not children of the process
+ */
+void jobs_forget(void) {
+    for (int i = 0; i < njobs; i++) {
+        free(jobs[i].command);
+    }
+    njobs = 0;
+    child_changed = 0;
+}
+
+/*
+ * The jobs built-in, print the table and drop the jobs which are done
+ * @return          The exit status of the built-in
+ */
+int jobs_print(void) {
+    jobs_reap();
+    for (int i = 0; i < njobs; i++) {
+        print_job(i);
+        jobs[i].changed = 0;
+        if (jobs[i].state == JOB_DONE) {
+            remove_job(i--);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Find the job a job spec refers to: %n or n for job n, %% or %+ for the
+ * most recent job and %- for the one before it
+ * @param builtin   The built-in asking, for the error message
+ * @param spec      The job spec, or NULL for the most recent job
+ * @return          The index of the job in the table, or -1 if there is none
+ */
+static int find_job(const char *builtin, const char *spec) {
+    int i = -1;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 ||
+        strcmp(spec, "%") == 0) {
+        i = njobs - 1;
+    } else if (strcmp(spec, "%-") == 0) {
+        i = njobs - 2;
+    } else {
+        char *end;
+        long id = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+        if (*end == '\0') {
+            for (int j = 0; j < njobs; j++) {
+                if (jobs[j].id == id) {
+                    i = j;
+                }
+            }
+        }
+    }
+    if (i < 0) {
+        fprintf(stderr, "pish: %s: %s: no such job\n", builtin,
+                spec ? spec : "current");
+    }
+    return i;
+}
+
+/*
+ * Block until a job is done, or also until it stops if flags has WUNTRACED
+ * @return          The exit status of the job
+ */
+static int wait_job(struct job *job, int flags) {
+    while (job->state != JOB_DONE) {
+        int status;
+        if (wait_process(job->pid, &status, flags) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            job->state = JOB_DONE;
+            job->status = 127 << 8;
+            break;
+        }
+        update_job(job, status);
+        if (job->state == JOB_STOPPED && (flags & WUNTRACED)) {
+            break;
+        }
+    }
+    return exit_status(job->status);
+}
+
+/*
+ * The wait built-in. Without arguments it waits for every running job,
+ * otherwise for each job spec or pid given.
+ * @param argc      The number of arguments, including "wait"
+ * @param argv      The arguments, argv[0] is "wait"
+ * @return          The exit status of the last job waited for, 0 if there
+ * were no arguments, or 127 if the last one was not a job
+ */
+int jobs_wait(int argc, char **argv) {
+    int status = 0;
+    if (argc == 1) {
+        for (int i = 0; i < njobs; i++) {
+            if (jobs[i].state != JOB_STOPPED) {
+                wait_job(&jobs[i], 0);
+            }
+        }
+        for (int i = 0; i < njobs; i++) {
+            if (jobs[i].state == JOB_DONE) {
+                remove_job(i--);
+            }
+        }
+        return 0;
+    }
+    for (int arg = 1; arg < argc; arg++) {
+        int i = -1;
+        if (argv[arg][0] == '%') {
+            i = find_job("wait", argv[arg]);
+        } else {
+            char *end;
+            long pid = strtol(argv[arg], &end, 10);
+            for (int j = 0; *end == '\0' && j < njobs; j++) {
+                if (jobs[j].pid == pid) {
+                    i = j;
+                }
+            }
+            if (i < 0) {
+                fprintf(stderr,
+                        "pish: wait: pid %s is not a child of this shell\n",
+                        argv[arg]);
+            }
+        }
+        if (i < 0) {
+            status = 127;
+            continue;
+        }
+        status = wait_job(&jobs[i], 0);
+        remove_job(i);
+    }
+    return status;
+}
+
+/*
+ * Give the terminal to a process group. SIGTTOU is blocked since the shell
+ * itself may be in the background when it takes the terminal back.
+ */
+static void give_terminal(pid_t pgid) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * The fg built-in, continue a job in the foreground and wait until it is done
+ * or stops again
+ * @param spec      The job spec, or NULL for the most recent job
+ * @return          The exit status of the job
+ */
+int jobs_fg(const char *spec) {
+    jobs_reap();
+    int i = find_job("fg", spec);
+    if (i < 0) {
+        return 1;
+    }
+    struct job *job = &jobs[i];
+    printf("%s\n", job->command);
+    fflush(stdout);
+    if (control) {
+        give_terminal(job->pid);
+    }
+    if (job->state == JOB_STOPPED) {
+        kill(control ? -job->pid : job->pid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    int status = wait_job(job, WUNTRACED);
+    if (control) {
+        give_terminal(shell_pgid);
+    }
+    if (job->state == JOB_DONE) {
+        remove_job(i);
+    } else {
+        job->changed = 0;
+        printf("\n");
+        print_job(i);
+    }
+    return status;
+}
+
+/*
+ * The bg built-in, continue a stopped job in the background
+ * @param spec      The job spec, or NULL for the most recent job
+ * @return          The exit status of the built-in
+ */
+int jobs_bg(const char *spec) {
+    jobs_reap();
+    int i = find_job("bg", spec);
+    if (i < 0) {
+        return 1;
+    }
+    struct job *job = &jobs[i];
+    if (job->state != JOB_STOPPED) {
+        fprintf(stderr, "pish: bg: job %d already in background\n", job->id);
+        return 0;
+    }
+    kill(control ? -job->pid : job->pid, SIGCONT);
+    job->state = JOB_RUNNING;
+    printf("[%d]%c %s &\n", job->id, i == njobs - 1 ? '+' : ' ', job->command);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __PISH_JOBS_H__
+#define __PISH_JOBS_H__
+
+#include <sys/types.h>
+
+/*
+ * Background jobs started with '&'. The SIGCHLD handler only sets a flag,
+ * jobs_reap() then collects the statuses of the jobs without blocking
+ * between commands. Interactive shells on a terminal also get job control:
+ * every job runs in its own process group, which fg hands the terminal to.
+ */
+void jobs_init(int interactive);
+int job_control(void);
+int job_add(pid_t pid, const char *command);
+void jobs_reap(void);
+void jobs_notify(void);
+void jobs_forget(void);
+int jobs_print(void);
+int jobs_wait(int argc, char **argv);
+int jobs_fg(const char *spec);
+int jobs_bg(const char *spec);
+int exit_status(int status);
+
+#endif // __PISH_JOBS_H__
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pish_buf.h"
+#include "pish_copy.h"
+#include "pish_input.h"
+#include "pish_jobs.h"
+#include "pish_parallel.h"
+#include "pish_profile.h"
+#include "pish_trace.h"
+
+/*
+ * The stdout of every job goes through a pipe to the shell, so the output of
+ * the jobs can be written in the order the jobs were given no matter in which
+ * order they finish. The oldest job which has not been written yet streams
+ * its output straight through, the later ones are held in memory until it is
+ * their turn. stderr is not grouped.
+ */
+struct parallel_job {
+    char *tag;           /* The argument or input line, for --tag */
+    int index;           /* Which job it is, counting from 0 */
+    pid_t pid;
+    int fd;              /* Read end of the output pipe, -1 after EOF */
+    int status;          /* The exit status, -1 while the job runs */
+    int line_start;      /* The next output byte starts a line */
+    enum copy_method relay; /* How its output streams to stdout */
+    struct pish_buf out; /* Output waiting for the turn of the job */
+};
+
+struct parallel {
+    /* Jobs which have not been written yet are jobs[first] to jobs[count-1] */
+    struct parallel_job *jobs;
+    size_t first;
+    size_t count;
+    size_t capacity;
+    /* Indexes into jobs of the jobs whose pipe is still open */
+    size_t *active;
+    struct pollfd *pollfds; /* Filled in from active for poll() */
+    int nactive;
+    int active_capacity;
+    int max_jobs;
+    int tag;
+    int failed;
+    /* The command the arguments are added to, may be empty */
+    char **words;
+    int nwords;
+    /* Arguments after :::, or NULL to read stdin */
+    char **args;
+    int nargs;
+    int next_arg;
+    struct pish_reader reader;
+    int null_fd;
+    int (*run_line)(const char *line);
+    /* The trees run by parallel_nodes() instead of command lines */
+    struct pish_node **roots;
+    int nroots;
+    int (*run_node)(struct pish_node *node);
+    int *statuses; /* The status of every job, for parallel_nodes() */
+    int started;
+};
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/*
+ * Write all of data to stdout, even a pipe which takes it a part at a time
+ */
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write output of a job, putting its tag in front of every line with --tag
+ */
+static void emit(struct parallel *par, struct parallel_job *job,
+                 const char *data, size_t len) {
+    if (!par->tag) {
+        write_all(data, len);
+        return;
+    }
+    while (len > 0) {
+        if (job->line_start) {
+            write_all(job->tag, strlen(job->tag));
+            write_all("\t", 1);
+        }
+        const char *nl = memchr(data, '\n', len);
+        size_t part = nl ? (size_t)(nl - data) + 1 : len;
+        write_all(data, part);
+        job->line_start = nl != NULL;
+        data += part;
+        len -= part;
+    }
+}
+
+/*
+ * Build the command line of a job from the command and one argument
+ * @return          A malloc'd command line
+ */
+static char *build_line(struct parallel *par, const char *arg) {
+    struct pish_buf line = {0};
+    int replaced = 0;
+    size_t arg_len = strlen(arg);
+    for (int i = 0; i < par->nwords; i++) {
+        if (i > 0) {
+            buf_append(&line, " ", 1);
+        }
+        const char *word = par->words[i];
+        const char *brace;
+        while ((brace = strstr(word, "{}")) != NULL) {
+            buf_append(&line, word, brace - word);
+            buf_append(&line, arg, arg_len);
+            word = brace + 2;
+            replaced = 1;
+        }
+        buf_append(&line, word, strlen(word));
+    }
+    if (!replaced) {
+        if (par->nwords > 0) {
+            buf_append(&line, " ", 1);
+        }
+        buf_append(&line, arg, arg_len);
+    }
+    return line.data;
+}
+
+/*
+ * Get the argument of the next job, from the list after ::: or from stdin
+ * where empty lines are skipped
+ * @return          The argument, or NULL when there are no more jobs. It stays
+ * valid until the next call.
+ */
+static const char *next_arg(struct parallel *par) {
+    if (par->args != NULL) {
+        return par->next_arg < par->nargs ? par->args[par->next_arg++] : NULL;
+    }
+    char *line;
+    ssize_t len;
+    while ((len = read_line(&par->reader, &line)) == 0) {
+    }
+    return len < 0 ? NULL : line;
+}
+
+/*
+ * Fork a copy of the shell which runs a command line with its stdout going
+ * into a new pipe
+ * @param arg       The argument of the job, or NULL for the next tree of
+ * parallel_nodes()
+ * @return          0 if the job was started, -1 otherwise
+ */
+static int start_job(struct parallel *par, const char *arg) {
+    if (par->count == par->capacity) {
+        // drop the jobs which have been written before growing
+        if (par->first > 0) {
+            memmove(par->jobs, par->jobs + par->first,
+                    (par->count - par->first) * sizeof(struct parallel_job));
+            for (int i = 0; i < par->nactive; i++) {
+                par->active[i] -= par->first;
+            }
+            par->count -= par->first;
+            par->first = 0;
+        }
+        if (par->count == par->capacity) {
+            par->capacity = par->capacity ? par->capacity * 2 : 16;
+            par->jobs = realloc(par->jobs,
+                                par->capacity * sizeof(struct parallel_job));
+            if (par->jobs == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    char *line = arg != NULL ? build_line(par, arg) : NULL;
+    struct pish_node *root = arg == NULL ? par->roots[par->started] : NULL;
+    struct timespec start;
+    profile_clock(&start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        free(line);
+        return -1;
+    } else if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        // jobs read from stdin get /dev/null, it holds the job list
+        if (par->null_fd >= 0) {
+            dup2(par->null_fd, STDIN_FILENO);
+        }
+        jobs_forget();
+        // the shell ignores SIGPIPE while a built-in writes into a pipeline
+        signal(SIGPIPE, SIG_DFL);
+        int status = root ? par->run_node(root) : par->run_line(line);
+        trace_flush();
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+    close(fds[1]);
+    profile_launch(pid, &start, root, line);
+    free(line);
+    struct parallel_job *job = &par->jobs[par->count];
+    job->tag = arg != NULL ? strdup(arg) : NULL;
+    if (arg != NULL && job->tag == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    job->index = par->started++;
+    job->pid = pid;
+    job->fd = fds[0];
+    job->status = -1;
+    job->line_start = 1;
+    job->relay = copy_method(job->fd, STDOUT_FILENO);
+    memset(&job->out, 0, sizeof(job->out));
+    par->active[par->nactive++] = par->count++;
+    return 0;
+}
+
+/*
+ * Write the jobs whose turn it is: the oldest unwritten job writes what it
+ * has held so far, and if it is already done the next one takes its turn
+ */
+static void emit_ready(struct parallel *par) {
+    while (par->first < par->count) {
+        struct parallel_job *job = &par->jobs[par->first];
+        if (job->out.len > 0) {
+            emit(par, job, job->out.data, job->out.len);
+            job->out.len = 0;
+        }
+        if (job->status < 0) {
+            return;
+        }
+        buf_free(&job->out);
+        free(job->tag);
+        par->first++;
+    }
+}
+
+/*
+ * Read what the running jobs have written, waiting until at least one of
+ * them writes something or finishes. A job whose pipe reaches EOF is waited
+ * for and no longer counts as running.
+ */
+static void collect_output(struct parallel *par) {
+    struct pollfd *fds = par->pollfds;
+    for (int i = 0; i < par->nactive; i++) {
+        fds[i].fd = par->jobs[par->active[i]].fd;
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    if (poll(fds, par->nactive, -1) < 0) {
+        if (errno != EINTR) {
+            perror("poll");
+        }
+        return;
+    }
+    char data[65536];
+    int kept = 0;
+    for (int i = 0; i < par->nactive; i++) {
+        size_t index = par->active[i];
+        struct parallel_job *job = &par->jobs[index];
+        if (fds[i].revents != 0) {
+            ssize_t n;
+            if (index == par->first && !par->tag) {
+                // the oldest job streams, without passing through here
+                // if the kernel can splice the pipe into stdout
+                n = copy_some(job->fd, STDOUT_FILENO, sizeof(data),
+                              &job->relay);
+            } else if ((n = read(job->fd, data, sizeof(data))) > 0) {
+                // the others wait their turn
+                if (index == par->first) {
+                    emit(par, job, data, n);
+                } else {
+                    buf_append(&job->out, data, n);
+                }
+            }
+            if (n == 0 || (n < 0 && errno != EINTR)) {
+                close(job->fd);
+                job->fd = -1;
+                int status;
+                pid_t pid;
+                while ((pid = wait_process(job->pid, &status, 0)) < 0 &&
+                       errno == EINTR) {
+                }
+                job->status = pid < 0 ? 127 : exit_status(status);
+                if (par->statuses != NULL) {
+                    par->statuses[job->index] = job->status;
+                }
+                if (job->status != 0) {
+                    par->failed++;
+                }
+                continue;
+            }
+        }
+        par->active[kept++] = index;
+    }
+    par->nactive = kept;
+}
+
+/*
+ * Double the room for running jobs, for -j N with a large N
+ */
+static void grow_active(struct parallel *par) {
+    par->active_capacity *= 2;
+    par->active = realloc(par->active, par->active_capacity * sizeof(size_t));
+    par->pollfds =
+        realloc(par->pollfds, par->active_capacity * sizeof(struct pollfd));
+    if (par->active == NULL || par->pollfds == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Start the jobs with at most max_jobs of them running at once, and write
+ * their output in order until all of them are done
+ */
+static void run_jobs(struct parallel *par) {
+    par->active_capacity = par->max_jobs < 1024 ? par->max_jobs : 1024;
+    par->active = xmalloc(par->active_capacity * sizeof(size_t));
+    par->pollfds = xmalloc(par->active_capacity * sizeof(struct pollfd));
+    // anything the shell printed must come out before the jobs
+    fflush(stdout);
+    int more = 1;
+    while (1) {
+        while (more && par->nactive < par->max_jobs) {
+            const char *arg = NULL;
+            if (par->roots != NULL ? par->started == par->nroots
+                                   : (arg = next_arg(par)) == NULL) {
+                more = 0;
+                break;
+            }
+            if (par->nactive == par->active_capacity) {
+                grow_active(par);
+            }
+            if (start_job(par, arg) < 0) {
+                par->failed++;
+                more = 0;
+            }
+        }
+        if (par->nactive == 0) {
+            break;
+        }
+        collect_output(par);
+        emit_ready(par);
+    }
+    emit_ready(par);
+    free(par->jobs);
+    free(par->active);
+    free(par->pollfds);
+}
+
+/*
+ * Run parsed command lines at once, one job per CPU at most or as many as
+ * $PISH_BATCH_JOBS says, with their output written in order like parallel
+ * does, ie for set -o batch
+ * @param roots     The trees to run
+ * @param count     The number of trees
+ * @param run_node  Runs one tree in the forked job and returns its status.
+ * With a single CPU the trees run one after the other in the shell itself,
+ * so run_node must not change the state of the shell.
+ * @param statuses  Filled with the exit status of every tree, in order. A
+ * tree which could not be started gets 1.
+ */
+void parallel_nodes(struct pish_node **roots, int count,
+                    int (*run_node)(struct pish_node *node), int *statuses) {
+    struct parallel par;
+    memset(&par, 0, sizeof(par));
+    par.roots = roots;
+    par.nroots = count;
+    par.run_node = run_node;
+    par.statuses = statuses;
+    par.null_fd = -1;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *jobs = getenv("PISH_BATCH_JOBS");
+    if (jobs != NULL && atol(jobs) > 0) {
+        ncpus = atol(jobs) < 1024 ? atol(jobs) : 1024;
+    }
+    par.max_jobs = ncpus > 1 ? (int)ncpus : 1;
+    if (par.max_jobs > count) {
+        par.max_jobs = count;
+    }
+    if (par.max_jobs == 1) {
+        // one at a time, the shell runs them itself without the forks
+        for (int i = 0; i < count; i++) {
+            statuses[i] = run_node(roots[i]);
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        statuses[i] = 1;
+    }
+    run_jobs(&par);
+}
+
+/*
+ * Parse the options and run every job
+ * @param argc      The number of arguments, including "parallel"
+ * @param argv      The arguments of the built-in
+ * @param run_line  Runs one command line and returns its exit status
+ * @return          The number of jobs which failed, at most 101, or 1 on a
+ * usage error
+ */
+int parallel_main(int argc, char **argv, int (*run_line)(const char *line)) {
+    struct parallel par;
+    memset(&par, 0, sizeof(par));
+    par.run_line = run_line;
+    par.null_fd = -1;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    par.max_jobs = ncpus > 0 ? (int)ncpus : 1;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        const char *value = NULL;
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "--tag") == 0) {
+            par.tag = 1;
+            continue;
+        } else if (strcmp(argv[i], "-j") == 0 ||
+                   strcmp(argv[i], "--jobs") == 0) {
+            value = i + 1 < argc ? argv[++i] : NULL;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            value = argv[i] + 2;
+        }
+        char *end;
+        long n = value ? strtol(value, &end, 10) : -1;
+        if (value == NULL || *end != '\0' || end == value || n < 0) {
+            fprintf(stderr, "pish: parallel: usage: parallel [-j N] [--tag] "
+                            "[command ...] [::: arg ...]\n");
+            return 1;
+        }
+        if (n == 0) {
+            // -j 0 runs as many jobs at once as there are fds for
+            long open_max = sysconf(_SC_OPEN_MAX);
+            n = open_max > 32 ? (open_max - 16) / 2 : 8;
+        }
+        par.max_jobs = n > INT_MAX ? INT_MAX : (int)n;
+    }
+    par.words = argv + i;
+    for (; i < argc && strcmp(argv[i], ":::") != 0; i++) {
+        par.nwords++;
+    }
+    if (i < argc) {
+        par.args = argv + i + 1;
+        par.nargs = argc - i - 1;
+        if (par.max_jobs > par.nargs) {
+            par.max_jobs = par.nargs > 0 ? par.nargs : 1;
+        }
+    } else {
+        reader_init(&par.reader, STDIN_FILENO);
+        par.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    run_jobs(&par);
+    if (par.args == NULL) {
+        reader_free(&par.reader);
+        if (par.null_fd >= 0) {
+            close(par.null_fd);
+        }
+    }
+    return par.failed > 101 ? 101 : par.failed;
+}
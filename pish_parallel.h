@@ -0,0 +1,20 @@
+#ifndef __PISH_PARALLEL_H__
+#define __PISH_PARALLEL_H__
+
+#include "pish_parse.h"
+
+/*
+ * The parallel built-in, which runs many command lines with a bounded number
+ * of them in flight at once:
+ *   parallel [-j N] [--tag] [command ...] ::: arg ...
+ *   parallel [-j N] [--tag] [command ...] < lines
+ * Each argument, or each line of stdin, is appended to the command (or
+ * replaces every {} in it), or is a command line by itself without one.
+ * Every job runs in a forked copy of the shell through run_line.
+ * parallel_nodes() runs parsed command lines the same way, for set -o batch.
+ */
+int parallel_main(int argc, char **argv, int (*run_line)(const char *line));
+void parallel_nodes(struct pish_node **roots, int count,
+                    int (*run_node)(struct pish_node *node), int *statuses);
+
+#endif // __PISH_PARALLEL_H__
@@ -0,0 +1,993 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pish_arena.h"
+#include "pish_buf.h"
+#include "pish_parse.h"
+#include "pish_vars.h"
+
+enum pish_token_type {
+    TOK_WORD,
+    TOK_SEMI,   /* ; */
+    TOK_AND,    /* && */
+    TOK_OR,     /* || */
+    TOK_AMP,    /* & */
+    TOK_PIPE,   /* | */
+    TOK_LPAREN, /* ( */
+    TOK_RPAREN, /* ) */
+    TOK_BANG,   /* ! at the start of a command */
+    TOK_REDIR,  /* <, >, >>, <>, <&, >&, <<, <<-, <<< with an optional fd */
+    TOK_END,
+};
+
+struct pish_token {
+    enum pish_token_type type;
+    char *text;    /* The word for TOK_WORD, the operator otherwise */
+    int io_number; /* Leading fd of a TOK_REDIR, or -1 if none was given */
+    int expands;   /* A TOK_WORD with quotes, \ or $ to expand */
+    char *doc;     /* The here-document of a << once its lines were read */
+};
+
+struct pish_parser {
+    struct pish_arena *arena;
+    struct pish_token *tokens;
+    int count;
+    int capacity;
+    int pos;
+    int failed;
+    int quiet; /* Set by PARSE_QUIET, errors are not printed */
+    int *docs; /* The << tokens whose here-documents start at the next line */
+    int ndocs;
+    int docs_capacity;
+};
+
+static char *copy_range(struct pish_parser *p, const char *start, size_t len) {
+    return arena_strndup(p->arena, start, len);
+}
+
+static void push_token(struct pish_parser *p, enum pish_token_type type,
+                       char *text, int io_number) {
+    if (p->count == p->capacity) {
+        int capacity = p->capacity ? p->capacity * 2 : 16;
+        p->tokens = arena_grow(p->arena, p->tokens,
+                               p->capacity * sizeof(*p->tokens),
+                               capacity * sizeof(*p->tokens));
+        p->capacity = capacity;
+    }
+    p->tokens[p->count].type = type;
+    p->tokens[p->count].text = text;
+    p->tokens[p->count].io_number = io_number;
+    p->tokens[p->count].expands = 0;
+    p->tokens[p->count].doc = NULL;
+    p->count++;
+}
+
+/*
+ * Characters which end a word because they start an operator
+ */
+static int is_operator_char(const char *s) {
+    return *s == ';' || *s == '|' || *s == '(' || *s == ')' || *s == '<' ||
+           *s == '>' || *s == '&';
+}
+
+/*
+ * Length of the redirection operator at s, or 0 if there is none
+ */
+static int redir_length(const char *s) {
+    if (*s == '>') {
+        return (s[1] == '>' || s[1] == '&') ? 2 : 1;
+    }
+    if (*s == '<') {
+        if (s[1] == '<') {
+            return (s[2] == '<' || s[2] == '-') ? 3 : 2;
+        }
+        return (s[1] == '>' || s[1] == '&') ? 2 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Check whether the redirection operator at s starts a here-document, ie
+ * << or <<-, which a here-string <<< does not
+ */
+static int is_document_op(const char *s) {
+    return s[0] == '<' && s[1] == '<' && s[2] != '<';
+}
+
+static void parse_error(struct pish_parser *p, const char *format, ...);
+
+/*
+ * Characters of a word which are not the start of a quote, \ or $
+ */
+static int is_plain_char(char c) {
+    return c != '\\' && c != '\'' && c != '"' && c != '$';
+}
+
+/*
+ * Skip one part of a word: a character, a \ and the character it quotes, a
+ * quoted string, or a $(...) or ${...} with all they contain. Spaces and
+ * operators inside them belong to the word.
+ * @param s         The start of the part
+ * @param missing   Set to the character which closes the part when the
+ * line ends before it
+ * @return          Where the part ends, or NULL if it is not closed
+ */
+const char *word_part_end(const char *s, char *missing) {
+    if (s[0] == '\\') {
+        return s[1] != '\0' ? s + 2 : s + 1;
+    }
+    if (s[0] == '\'') {
+        const char *end = strchr(s + 1, '\'');
+        *missing = '\'';
+        return end != NULL ? end + 1 : NULL;
+    }
+    if (s[0] == '"') {
+        for (s++; s != NULL && *s != '"';) {
+            if (*s == '\0') {
+                *missing = '"';
+                return NULL;
+            }
+            s = *s == '\\' || *s == '$' ? word_part_end(s, missing) : s + 1;
+        }
+        return s != NULL ? s + 1 : NULL;
+    }
+    if (s[0] == '$' && s[1] == '{') {
+        const char *end = strchr(s + 2, '}');
+        *missing = '}';
+        return end != NULL ? end + 1 : NULL;
+    }
+    if (s[0] == '$' && s[1] == '(') {
+        int depth = 0;
+        for (s += 2; s != NULL && (*s != ')' || depth > 0);) {
+            if (*s == '\0') {
+                *missing = ')';
+                return NULL;
+            }
+            if (*s == '(' || *s == ')') {
+                depth += *s == '(' ? 1 : -1;
+                s++;
+            } else {
+                s = word_part_end(s, missing);
+            }
+        }
+        return s != NULL ? s + 1 : NULL;
+    }
+    return s + 1;
+}
+
+/*
+ * Append a word without its quotes, ie the delimiter of a here-document
+ * @param out       Where the word is appended
+ * @param s         The word, which may not be NUL-terminated
+ * @param len       Its length
+ */
+static void unquote(struct pish_buf *out, const char *s, size_t len) {
+    const char *end = s + len;
+    char quote = 0;
+    for (; s < end; s++) {
+        if (*s == quote) {
+            quote = 0;
+        } else if (quote == 0 && (*s == '\'' || *s == '"')) {
+            quote = *s;
+        } else if (*s == '\\' && quote != '\'' && s + 1 < end) {
+            buf_append(out, ++s, 1);
+        } else {
+            buf_append(out, s, 1);
+        }
+    }
+}
+
+/*
+ * Check whether a line of a here-document is its delimiter
+ * @param strip     1 for <<-, which strips the tabs the line starts with
+ */
+static int is_delimiter(const char *line, size_t len, const char *delimiter,
+                        size_t delimiter_len, int strip) {
+    for (; strip && len > 0 && *line == '\t'; line++, len--) {
+    }
+    return len == delimiter_len && memcmp(line, delimiter, len) == 0;
+}
+
+/*
+ * Record a redirection operator ending at s. A here-document is read from
+ * the lines after the one it is in, see read_documents().
+ */
+static void push_redir(struct pish_parser *p, const char *s, int len,
+                       int io_number) {
+    push_token(p, TOK_REDIR, copy_range(p, s, len), io_number);
+    if (!is_document_op(s)) {
+        return;
+    }
+    if (p->ndocs == p->docs_capacity) {
+        int grown = p->docs_capacity ? p->docs_capacity * 2 : 4;
+        p->docs = arena_grow(p->arena, p->docs,
+                             p->docs_capacity * sizeof(*p->docs),
+                             grown * sizeof(*p->docs));
+        p->docs_capacity = grown;
+    }
+    p->docs[p->ndocs++] = p->count - 1;
+}
+
+/*
+ * Read the here-documents of the line which just ended, one after the
+ * other, each up to the line which is its delimiter or the end of the chain
+ * @param s         The first line after the one with the <<
+ * @return          Where the chain goes on after the last delimiter
+ */
+static const char *read_documents(struct pish_parser *p, const char *s) {
+    struct pish_buf text = {0};
+    for (int i = 0; i < p->ndocs; i++) {
+        struct pish_token *op = &p->tokens[p->docs[i]];
+        struct pish_token *word = op + 1;
+        // a << without a word is left for parse_redirect() to report
+        if (word >= &p->tokens[p->count] || word->type != TOK_WORD) {
+            continue;
+        }
+        int strip = op->text[2] == '-';
+        buf_set(&text, "", 0);
+        unquote(&text, word->text, strlen(word->text));
+        char *delimiter = copy_range(p, text.data, text.len);
+        size_t delimiter_len = text.len;
+        buf_set(&text, "", 0);
+        while (*s != '\0') {
+            const char *end = s + strcspn(s, "\n");
+            if (is_delimiter(s, end - s, delimiter, delimiter_len, strip)) {
+                s = *end != '\0' ? end + 1 : end;
+                break;
+            }
+            for (; strip && *s == '\t'; s++) {
+            }
+            buf_append(&text, s, end - s);
+            buf_append(&text, "\n", 1);
+            s = *end != '\0' ? end + 1 : end;
+        }
+        op->doc = copy_range(p, text.data, text.len);
+    }
+    p->ndocs = 0;
+    buf_free(&text);
+    return s;
+}
+
+/*
+ * Break the whole command line into tokens in a single pass.
+ */
+static void tokenize(struct pish_parser *p, const char *s) {
+    // a '!' is only a negation when it starts a command
+    int command_start = 1;
+    while (*s != '\0') {
+        if (*s == '\n' && p->ndocs > 0) {
+            s = read_documents(p, s + 1);
+            continue;
+        }
+        if (isspace((unsigned char)*s)) {
+            s++;
+            continue;
+        }
+        if ((s[0] == '&' && s[1] == '&') || (s[0] == '|' && s[1] == '|')) {
+            push_token(p, s[0] == '&' ? TOK_AND : TOK_OR, copy_range(p, s, 2),
+                       -1);
+            s += 2;
+            command_start = 1;
+        } else if (*s == ';' || *s == '&' || *s == '|' || *s == '(' ||
+                   *s == ')') {
+            enum pish_token_type type = *s == ';'   ? TOK_SEMI
+                                        : *s == '&' ? TOK_AMP
+                                        : *s == '|' ? TOK_PIPE
+                                        : *s == '(' ? TOK_LPAREN
+                                                    : TOK_RPAREN;
+            push_token(p, type, copy_range(p, s, 1), -1);
+            command_start = type != TOK_RPAREN;
+            s++;
+        } else if (*s == '!' && command_start) {
+            push_token(p, TOK_BANG, copy_range(p, s, 1), -1);
+            s++;
+        } else if (redir_length(s)) {
+            int len = redir_length(s);
+            push_redir(p, s, len, -1);
+            s += len;
+            command_start = 0;
+        } else {
+            const char *start = s;
+            char missing;
+            int expands = 0;
+            while (s != NULL && *s != '\0' && !isspace((unsigned char)*s) &&
+                   !is_operator_char(s)) {
+                if (is_plain_char(*s)) {
+                    s++;
+                } else {
+                    s = word_part_end(s, &missing);
+                    expands = 1;
+                }
+            }
+            if (s == NULL) {
+                parse_error(p,
+                            "pish: syntax error: unexpected end of line "
+                            "while looking for matching `%c'\n",
+                            missing);
+                break;
+            }
+            // a word made only of digits directly followed by a redirection
+            // operator is the fd to redirect, ie 2> or 1>>
+            int digits = 1;
+            for (const char *c = start; c < s; c++) {
+                if (!isdigit((unsigned char)*c)) {
+                    digits = 0;
+                    break;
+                }
+            }
+            if (digits && redir_length(s) && s - start < 10) {
+                int len = redir_length(s);
+                push_redir(p, s, len, atoi(start));
+                s += len;
+            } else {
+                push_token(p, TOK_WORD, copy_range(p, start, s - start), -1);
+                p->tokens[p->count - 1].expands = expands;
+            }
+            // the time keyword can be followed by !
+            command_start = command_start && s - start == 4 &&
+                            strncmp(start, "time", 4) == 0;
+        }
+    }
+    push_token(p, TOK_END, NULL, -1);
+}
+
+static struct pish_node *new_node(struct pish_parser *p,
+                                  enum pish_node_kind kind) {
+    struct pish_node *node = arena_alloc(p->arena, sizeof(struct pish_node));
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    return node;
+}
+
+static struct pish_token *peek(struct pish_parser *p) {
+    return &p->tokens[p->pos];
+}
+
+/*
+ * Mark the line as invalid and print why, unless the parser is quiet
+ */
+static void parse_error(struct pish_parser *p, const char *format, ...) {
+    p->failed = 1;
+    if (p->quiet) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+/*
+ * Report a syntax error at the current token. Only the first error of a line
+ * is printed.
+ */
+static void syntax_error(struct pish_parser *p) {
+    if (p->failed) {
+        return;
+    }
+    struct pish_token *tok = peek(p);
+    if (tok->type == TOK_END) {
+        parse_error(p, "pish: syntax error: unexpected end of line\n");
+    } else {
+        parse_error(p, "pish: syntax error near unexpected token `%s'\n",
+                    tok->text);
+    }
+}
+
+static struct pish_node *parse_list(struct pish_parser *p);
+
+/*
+ * Parse the redirection operator at the current token together with its
+ * target word.
+ */
+static int parse_redirect(struct pish_parser *p, struct pish_redir *redir) {
+    struct pish_token *op = peek(p);
+    p->pos++;
+    struct pish_token *target = peek(p);
+    if (target->type != TOK_WORD) {
+        syntax_error(p);
+        return -1;
+    }
+    p->pos++;
+    int is_input = op->text[0] == '<';
+    redir->fd = op->io_number >= 0 ? op->io_number
+                                   : (is_input ? STDIN_FILENO : STDOUT_FILENO);
+    redir->path = NULL;
+    if (op->text[1] == '&') {
+        // <&- and >&- close the fd, <&N and >&N duplicate N onto it
+        if (strcmp(target->text, "-") == 0) {
+            redir->kind = REDIR_CLOSE;
+            return 0;
+        }
+        char *end;
+        long dup_fd = strtol(target->text, &end, 10);
+        if (*end != '\0' || end == target->text || dup_fd < 0) {
+            parse_error(p, "pish: %s: ambiguous redirect\n", target->text);
+            return -1;
+        }
+        redir->kind = REDIR_DUP;
+        redir->dup_fd = (int)dup_fd;
+        return 0;
+    }
+    if (op->text[1] == '<') {
+        redir->kind = REDIR_DOC;
+        redir->flags = 0;
+        if (op->text[2] == '<') {
+            // a here-string is its word and a new line
+            if (target->expands) {
+                redir->path = target->text;
+                redir->flags = DOC_WORD;
+            } else {
+                size_t len = strlen(target->text);
+                redir->path = arena_alloc(p->arena, len + 2);
+                memcpy(redir->path, target->text, len);
+                memcpy(redir->path + len, "\n", 2);
+            }
+            return 0;
+        }
+        // only a here-document whose delimiter is not quoted is expanded
+        redir->path = op->doc != NULL ? op->doc : copy_range(p, "", 0);
+        if (!target->expands && strpbrk(redir->path, "$\\") != NULL) {
+            redir->flags = DOC_EXPAND;
+        }
+        return 0;
+    }
+    redir->kind = REDIR_FILE;
+    redir->path = target->text;
+    if (strcmp(op->text, "<") == 0) {
+        redir->flags = O_RDONLY;
+    } else if (strcmp(op->text, "<>") == 0) {
+        redir->flags = O_RDWR | O_CREAT;
+    } else if (strcmp(op->text, ">>") == 0) {
+        redir->flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    return 0;
+}
+
+/*
+ * Check whether a word is an assignment, NAME=value
+ */
+static int is_assignment(const char *word) {
+    size_t len = var_name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+/*
+ * Parse a subshell or a simple command along with any redirections, which
+ * are attached to the node itself. The assignments in front of a command
+ * are kept apart from its argv.
+ */
+static struct pish_node *parse_command(struct pish_parser *p) {
+    struct pish_node *node;
+    if (peek(p)->type == TOK_LPAREN) {
+        p->pos++;
+        node = new_node(p, NODE_SUBSHELL);
+        node->child = parse_list(p);
+        if (p->failed) {
+            return NULL;
+        }
+        if (peek(p)->type != TOK_RPAREN) {
+            if (peek(p)->type == TOK_END) {
+                parse_error(p, "pish: syntax error: missing ')'\n");
+            } else {
+                syntax_error(p);
+            }
+            return NULL;
+        }
+        p->pos++;
+    } else {
+        node = new_node(p, NODE_COMMAND);
+    }
+
+    int capacity = 0;
+    int assign_capacity = 0;
+    int redir_capacity = 0;
+    while (!p->failed) {
+        struct pish_token *tok = peek(p);
+        if (tok->type == TOK_REDIR) {
+            if (node->nredirs == redir_capacity) {
+                int grown = redir_capacity ? redir_capacity * 2 : 2;
+                node->redirs = arena_grow(p->arena, node->redirs,
+                                          redir_capacity * sizeof(*node->redirs),
+                                          grown * sizeof(*node->redirs));
+                redir_capacity = grown;
+            }
+            if (parse_redirect(p, &node->redirs[node->nredirs]) == 0) {
+                struct pish_redir *redir = &node->redirs[node->nredirs];
+                if ((redir->kind == REDIR_FILE &&
+                     p->tokens[p->pos - 1].expands) ||
+                    (redir->kind == REDIR_DOC && redir->flags != 0)) {
+                    node->flags |= NODE_EXPAND;
+                }
+                node->nredirs++;
+            }
+        } else if (tok->type == TOK_WORD && node->kind == NODE_COMMAND &&
+                   node->argc == 0 && is_assignment(tok->text)) {
+            if (node->nassigns == assign_capacity) {
+                int grown = assign_capacity ? assign_capacity * 2 : 2;
+                node->assigns = arena_grow(p->arena, node->assigns,
+                                           assign_capacity * sizeof(char *),
+                                           grown * sizeof(char *));
+                assign_capacity = grown;
+            }
+            node->assigns[node->nassigns++] = tok->text;
+            node->flags |= tok->expands ? NODE_EXPAND : 0;
+            p->pos++;
+        } else if (tok->type == TOK_WORD && node->kind == NODE_COMMAND) {
+            if (node->argc + 1 >= capacity) {
+                int grown = capacity ? capacity * 2 : 8;
+                node->argv = arena_grow(p->arena, node->argv,
+                                        capacity * sizeof(char *),
+                                        grown * sizeof(char *));
+                capacity = grown;
+            }
+            node->argv[node->argc++] = tok->text;
+            node->argv[node->argc] = NULL;
+            node->flags |= tok->expands ? NODE_EXPAND : 0;
+            p->pos++;
+        } else {
+            break;
+        }
+    }
+    if (!p->failed && node->kind == NODE_COMMAND && node->argc == 0 &&
+        node->nassigns == 0 && node->nredirs == 0) {
+        syntax_error(p);
+    }
+    if (p->failed) {
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ * Append a node to the children of a sequence or pipeline node, growing the
+ * array by doubling.
+ */
+static void add_child(struct pish_parser *p, struct pish_node *parent,
+                      struct pish_node *child, int *capacity) {
+    if (parent->nchildren == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 4;
+        parent->children = arena_grow(p->arena, parent->children,
+                                      *capacity * sizeof(*parent->children),
+                                      grown * sizeof(*parent->children));
+        *capacity = grown;
+    }
+    parent->children[parent->nchildren++] = child;
+}
+
+/*
+ * Parse commands separated by '|'. All the stages of a pipeline become the
+ * children of a single node so they can be started together.
+ */
+static struct pish_node *parse_pipeline(struct pish_parser *p) {
+    struct pish_node *node = parse_command(p);
+    if (p->failed || peek(p)->type != TOK_PIPE) {
+        return node;
+    }
+    struct pish_node *pipeline = new_node(p, NODE_PIPELINE);
+    int capacity = 0;
+    add_child(p, pipeline, node, &capacity);
+    while (!p->failed && peek(p)->type == TOK_PIPE) {
+        p->pos++;
+        node = parse_command(p);
+        if (node != NULL) {
+            add_child(p, pipeline, node, &capacity);
+        }
+    }
+    return pipeline;
+}
+
+/*
+ * Parse a pipeline with an optional leading '!', which negates the exit
+ * status of the whole pipeline.
+ */
+static struct pish_node *parse_bang(struct pish_parser *p) {
+    if (peek(p)->type == TOK_BANG) {
+        p->pos++;
+        struct pish_node *node = new_node(p, NODE_BANG);
+        node->child = parse_bang(p);
+        return node;
+    }
+    return parse_pipeline(p);
+}
+
+/*
+ * Parse a pipeline with an optional leading time keyword, which reports how
+ * long the pipeline took and what it used.
+ */
+static struct pish_node *parse_time(struct pish_parser *p) {
+    struct pish_token *tok = peek(p);
+    if (tok->type == TOK_WORD && strcmp(tok->text, "time") == 0) {
+        p->pos++;
+        struct pish_node *node = new_node(p, NODE_TIME);
+        tok = peek(p);
+        // time on its own, ie time; or time && cmd
+        if (tok->type == TOK_WORD || tok->type == TOK_BANG ||
+            tok->type == TOK_LPAREN || tok->type == TOK_REDIR) {
+            node->child = parse_bang(p);
+        }
+        return node;
+    }
+    return parse_bang(p);
+}
+
+/*
+ * Parse pipelines separated by '&&' and '||'. Both operators have the same
+ * precedence and are left associative.
+ */
+static struct pish_node *parse_and_or(struct pish_parser *p) {
+    struct pish_node *node = parse_time(p);
+    while (!p->failed &&
+           (peek(p)->type == TOK_AND || peek(p)->type == TOK_OR)) {
+        struct pish_node *op_node =
+            new_node(p, peek(p)->type == TOK_AND ? NODE_AND : NODE_OR);
+        p->pos++;
+        op_node->left = node;
+        op_node->right = parse_time(p);
+        node = op_node;
+    }
+    return node;
+}
+
+/*
+ * Parse and-or lists separated by ';' or '&'. An and-or list followed by '&'
+ * is wrapped in a background node. Empty commands between semi-colons are
+ * skipped. Returns NULL if the list is empty.
+ */
+static struct pish_node *parse_list(struct pish_parser *p) {
+    struct pish_node *seq = NULL;
+    struct pish_node *first = NULL;
+    int capacity = 0;
+    while (!p->failed) {
+        enum pish_token_type type = peek(p)->type;
+        if (type == TOK_SEMI) {
+            p->pos++;
+            continue;
+        }
+        if (type == TOK_END || type == TOK_RPAREN) {
+            break;
+        }
+        struct pish_node *node = parse_and_or(p);
+        if (!p->failed && peek(p)->type == TOK_AMP) {
+            p->pos++;
+            struct pish_node *background = new_node(p, NODE_BACKGROUND);
+            background->child = node;
+            node = background;
+        } else if (!p->failed && peek(p)->type != TOK_SEMI &&
+                   peek(p)->type != TOK_END && peek(p)->type != TOK_RPAREN) {
+            syntax_error(p);
+        }
+        if (p->failed) {
+            break;
+        }
+        if (first == NULL) {
+            first = node;
+            continue;
+        }
+        // only build a sequence node once there is more than one command
+        if (seq == NULL) {
+            seq = new_node(p, NODE_SEQUENCE);
+            add_child(p, seq, first, &capacity);
+        }
+        add_child(p, seq, node, &capacity);
+    }
+    if (p->failed) {
+        return NULL;
+    }
+    return seq ? seq : first;
+}
+
+/*
+ * Parse a full command line into a tree of nodes.
+ *
+ * @param arena     Everything the tree needs is allocated from this arena, it
+ * lives until the arena is released
+ * @param chain     The command line to parse
+ * @param flags     PARSE_QUIET to not print syntax errors
+ * @param error     Set to 1 if the line has a syntax error (which has already
+ * been printed unless quiet), 0 otherwise
+ * @return          The root of the tree, or NULL if the line is empty or
+ * invalid
+ */
+struct pish_node *parse_chain(struct pish_arena *arena, const char *chain,
+                              int flags, int *error) {
+    struct pish_parser p = {0};
+    p.arena = arena;
+    p.quiet = (flags & PARSE_QUIET) != 0;
+    tokenize(&p, chain);
+    struct pish_node *root = parse_list(&p);
+    if (!p.failed && peek(&p)->type != TOK_END) {
+        syntax_error(&p);
+        root = NULL;
+    }
+    *error = p.failed;
+    return root;
+}
+
+/*
+ * Append a document as the quoted word of a here-string, which has the
+ * same content, so a here-document fits on the line
+ */
+static void format_document(const struct pish_redir *redir,
+                            struct pish_buf *out) {
+    // the new line a here-string adds is the one the document ends with
+    size_t len = strlen(redir->path);
+    len -= len > 0 && redir->path[len - 1] == '\n';
+    // a document to expand keeps its $ inside "", where a " is escaped
+    char quote = redir->flags == DOC_EXPAND ? '"' : '\'';
+    buf_append(out, &quote, 1);
+    for (const char *c = redir->path; c < redir->path + len; c++) {
+        if (*c == quote && quote == '"') {
+            buf_append(out, "\\\"", 2);
+        } else if (*c == quote) {
+            buf_append(out, "'\\''", 4);
+        } else {
+            buf_append(out, c, 1);
+        }
+    }
+    buf_append(out, &quote, 1);
+}
+
+/*
+ * Append the redirections of a node in the form they are written in
+ */
+static void format_redirs(const struct pish_node *node, struct pish_buf *out) {
+    for (int i = 0; i < node->nredirs; i++) {
+        const struct pish_redir *redir = &node->redirs[i];
+        char text[32];
+        const char *op;
+        int default_fd;
+        if (redir->kind == REDIR_FILE) {
+            int mode = redir->flags & O_ACCMODE;
+            op = mode == O_RDONLY                 ? "<"
+                 : mode == O_RDWR                 ? "<>"
+                 : (redir->flags & O_APPEND) != 0 ? ">>"
+                                                  : ">";
+            default_fd = mode == O_WRONLY ? STDOUT_FILENO : STDIN_FILENO;
+        } else if (redir->kind == REDIR_DOC) {
+            op = "<<< ";
+            default_fd = STDIN_FILENO;
+        } else {
+            op = redir->fd == STDIN_FILENO ? "<&" : ">&";
+            default_fd =
+                redir->fd == STDIN_FILENO ? STDIN_FILENO : STDOUT_FILENO;
+        }
+        int len;
+        if (redir->fd == default_fd) {
+            len = snprintf(text, sizeof(text), " %s", op);
+        } else {
+            len = snprintf(text, sizeof(text), " %d%s", redir->fd, op);
+        }
+        buf_append(out, text, len);
+        if (redir->kind == REDIR_FILE ||
+            (redir->kind == REDIR_DOC && redir->flags == DOC_WORD)) {
+            buf_append(out, redir->path, strlen(redir->path));
+        } else if (redir->kind == REDIR_DOC) {
+            format_document(redir, out);
+        } else if (redir->kind == REDIR_DUP) {
+            len = snprintf(text, sizeof(text), "%d", redir->dup_fd);
+            buf_append(out, text, len);
+        } else {
+            buf_append(out, "-", 1);
+        }
+    }
+}
+
+/*
+ * The kinds of token a struct pish_scan remembers as the last one
+ */
+enum scan_token {
+    SCAN_NONE,     /* Nothing yet, or only ; or & */
+    SCAN_WORD,     /* A word or ) */
+    SCAN_OPERATOR, /* &&, ||, |, ( or a redirection, which need more */
+};
+
+/*
+ * Start scanning a new command
+ */
+void scan_begin(struct pish_scan *scan) {
+    scan->depth = 0;
+    scan->last = SCAN_NONE;
+    scan->quote = 0;
+    scan->ndocs = 0;
+    scan->docs = (struct pish_buf){0};
+    scan->doc = 0;
+    scan->want_doc = 0;
+}
+
+/*
+ * Free what scanning a command needed, once it was read
+ */
+void scan_end(struct pish_scan *scan) {
+    buf_free(&scan->docs);
+}
+
+/*
+ * Scan the next line of a command, from where the last line left off. The
+ * operators are found like tokenize() finds them.
+ * @param scan      The state of the command so far, see scan_begin()
+ * @param line      The line, with its whitespace already trimmed
+ * @param len       The length of the line. A trailing \ which is not
+ * quoted is removed from the line and len is updated.
+ * @return          Whether and how the command goes on in the next line
+ */
+enum scan_result scan_line(struct pish_scan *scan, char *line, size_t *len) {
+    const char *s = line;
+    const char *end = line + *len;
+    // the line ends in a \ which quotes the line break
+    int splice = 0;
+    while (s < end) {
+        if (scan->quote != 0) {
+            // inside "" a \ quotes the next character, inside '' nothing
+            if (*s == scan->quote) {
+                scan->quote = 0;
+            } else if (*s == '\\' && scan->quote == '"') {
+                splice = ++s == end;
+            }
+            s++;
+        } else if (isspace((unsigned char)*s)) {
+            s++;
+        } else if ((s[0] == '&' && s[1] == '&') ||
+                   (s[0] == '|' && s[1] == '|')) {
+            scan->last = SCAN_OPERATOR;
+            s += 2;
+        } else if (*s == '|' || *s == '(') {
+            scan->depth += *s == '(';
+            scan->last = SCAN_OPERATOR;
+            s++;
+        } else if (*s == ';' || *s == '&') {
+            scan->last = SCAN_NONE;
+            s++;
+        } else if (*s == ')') {
+            // an unmatched ) is left for the parser to report
+            scan->depth -= scan->depth > 0;
+            scan->last = SCAN_WORD;
+            s++;
+        } else if (redir_length(s)) {
+            scan->want_doc = !is_document_op(s) ? 0 : s[2] == '-' ? '-' : ' ';
+            scan->last = SCAN_OPERATOR;
+            s += redir_length(s);
+        } else if (scan->want_doc) {
+            // the word after a << is the delimiter of a here-document
+            const char *start = s;
+            char missing;
+            while (s != NULL && s < end && !isspace((unsigned char)*s) &&
+                   !is_operator_char(s)) {
+                s = is_plain_char(*s) ? s + 1 : word_part_end(s, &missing);
+            }
+            if (s == NULL || s > end) {
+                s = end;
+            }
+            char strip = scan->want_doc;
+            buf_append(&scan->docs, &strip, 1);
+            unquote(&scan->docs, start, s - start);
+            buf_append(&scan->docs, "", 1);
+            scan->ndocs++;
+            scan->want_doc = 0;
+            scan->last = SCAN_WORD;
+        } else {
+            while (s < end && !isspace((unsigned char)*s) &&
+                   !is_operator_char(s)) {
+                if (*s == '\'' || *s == '"') {
+                    scan->quote = *s++;
+                    break;
+                }
+                if (*s == '\\') {
+                    splice = ++s == end;
+                }
+                s++;
+            }
+            scan->last = SCAN_WORD;
+        }
+    }
+    if (splice) {
+        line[--*len] = '\0';
+        return SCAN_SPLICE;
+    }
+    if (scan->quote != 0) {
+        return SCAN_QUOTE;
+    }
+    if (scan->last == SCAN_OPERATOR) {
+        return SCAN_JOIN;
+    }
+    if (scan->depth > 0) {
+        return scan->last == SCAN_WORD ? SCAN_NEWLINE : SCAN_JOIN;
+    }
+    return SCAN_DONE;
+}
+
+/*
+ * Scan a line of the here-documents a command is waiting for, which ends
+ * the current one if it is its delimiter
+ * @param scan      The state of the command, see scan_line()
+ * @param line      The line as it was read
+ * @param len       The length of the line
+ * @return          The number of here-documents still due after the line
+ */
+int scan_document(struct pish_scan *scan, const char *line, size_t len) {
+    const char *delimiter = scan->docs.data + scan->doc;
+    size_t delimiter_len = strlen(delimiter + 1);
+    if (is_delimiter(line, len, delimiter + 1, delimiter_len,
+                     *delimiter == '-')) {
+        scan->doc += delimiter_len + 2;
+        if (--scan->ndocs == 0) {
+            buf_set(&scan->docs, "", 0);
+            scan->doc = 0;
+        }
+    }
+    return scan->ndocs;
+}
+
+/*
+ * Turn a tree back into a command line, ie to show what a job is running.
+ * The result parses into the same tree.
+ * @param node      The root of the tree
+ * @param out       The command line is appended to this buffer
+ */
+void format_node(const struct pish_node *node, struct pish_buf *out) {
+    const char *separator = NULL;
+    switch (node->kind) {
+    case NODE_SEQUENCE:
+    case NODE_PIPELINE:
+        separator = node->kind == NODE_SEQUENCE ? "; " : " | ";
+        for (int i = 0; i < node->nchildren; i++) {
+            // a background node already ends in its own separator
+            if (i > 0 && node->children[i - 1]->kind == NODE_BACKGROUND) {
+                buf_append(out, " ", 1);
+            } else if (i > 0) {
+                buf_append(out, separator, strlen(separator));
+            }
+            format_node(node->children[i], out);
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        format_node(node->left, out);
+        separator = node->kind == NODE_AND ? " && " : " || ";
+        buf_append(out, separator, 4);
+        format_node(node->right, out);
+        break;
+    case NODE_SUBSHELL:
+        buf_append(out, "(", 1);
+        if (node->child != NULL) {
+            format_node(node->child, out);
+        }
+        buf_append(out, ")", 1);
+        format_redirs(node, out);
+        break;
+    case NODE_BANG:
+        buf_append(out, "! ", 2);
+        format_node(node->child, out);
+        break;
+    case NODE_BACKGROUND:
+        format_node(node->child, out);
+        buf_append(out, " &", 2);
+        break;
+    case NODE_TIME:
+        buf_append(out, "time", 4);
+        if (node->child != NULL) {
+            buf_append(out, " ", 1);
+            format_node(node->child, out);
+        }
+        break;
+    case NODE_COMMAND:
+        for (int i = 0; i < node->nassigns + node->argc; i++) {
+            const char *word = i < node->nassigns
+                                   ? node->assigns[i]
+                                   : node->argv[i - node->nassigns];
+            if (i > 0) {
+                buf_append(out, " ", 1);
+            }
+            buf_append(out, word, strlen(word));
+        }
+        format_redirs(node, out);
+        break;
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef __PISH_PARSE_H__
+#define __PISH_PARSE_H__
+
+#include "pish_arena.h"
+#include "pish_buf.h"
+
+/*
+ * The kinds of nodes a command line is parsed into. Operator precedence
+ * (lowest to highest) is: ';' and '&', then '&&' / '||', then time, then '!',
+ * then '|', then redirections, subshells and simple commands.
+ */
+enum pish_node_kind {
+    NODE_SEQUENCE,   /* children[0] ; children[1] ; ... */
+    NODE_AND,        /* left && right */
+    NODE_OR,         /* left || right */
+    NODE_PIPELINE,   /* children[0] | children[1] | ... */
+    NODE_SUBSHELL,   /* ( child ) */
+    NODE_BANG,       /* ! child */
+    NODE_BACKGROUND, /* child & */
+    NODE_TIME,       /* time child */
+    NODE_COMMAND,    /* argv[0] argv[1] ... */
+};
+
+/*
+ * The kinds of redirection a command or subshell can apply.
+ *   REDIR_FILE   open() path with flags and dup2() it onto fd
+ *   REDIR_DUP    dup2() dup_fd onto fd, ie 2>&1
+ *   REDIR_CLOSE  close fd, ie 2>&-
+ *   REDIR_DOC    make path the content of fd, ie <<EOF or <<< word
+ */
+enum pish_redir_kind {
+    REDIR_FILE,
+    REDIR_DUP,
+    REDIR_CLOSE,
+    REDIR_DOC,
+};
+
+struct pish_redir {
+    enum pish_redir_kind kind;
+    int fd;     /* The file descriptor being redirected */
+    int flags;  /* open() flags for REDIR_FILE, DOC_ flags for REDIR_DOC */
+    int dup_fd; /* Source file descriptor for REDIR_DUP */
+    char *path; /* Target file for REDIR_FILE, the document for REDIR_DOC */
+};
+
+/* Flags of a REDIR_DOC */
+#define DOC_EXPAND 1 /* A here-document whose $ and \ are still to expand */
+#define DOC_WORD 2   /* A here-string whose word is still to expand */
+
+/*
+ * A node of the parsed command tree. Which fields are used depends on kind:
+ *   NODE_SEQUENCE/PIPELINE     children, nchildren
+ *   NODE_AND/OR                left, right
+ *   NODE_SUBSHELL              child, redirs, nredirs
+ *   NODE_BANG/BACKGROUND/TIME  child, which may be NULL for NODE_TIME
+ *   NODE_COMMAND               argc, argv (NULL-terminated, like execvp wants),
+ *                              assigns, nassigns, redirs, nredirs
+ * Redirections are stored in the order they were written and are applied
+ * from first to last. The NAME=value words in front of a command are its
+ * assigns. Words are kept as they were written, with their quotes and $,
+ * and are only expanded when the command runs, see pish_expand.h. The
+ * parser flags the nodes which have words to expand with NODE_EXPAND, the
+ * other flags are set by passes which run over the tree before it executes.
+ */
+struct pish_node {
+    enum pish_node_kind kind;
+    struct pish_node *left;
+    struct pish_node *right;
+    struct pish_node *child;
+    struct pish_node **children;
+    int nchildren;
+    struct pish_redir *redirs;
+    int nredirs;
+    int argc;
+    char **argv;
+    int nassigns;
+    char **assigns;
+    int flags;
+};
+
+/* Flags of a node */
+#define NODE_INLINE 1 /* A subshell which can run without forking */
+#define NODE_EXPAND 2 /* A command or subshell with words to expand */
+
+/* Flags of parse_chain() */
+#define PARSE_QUIET 1 /* Do not print syntax errors */
+
+/*
+ * Finds where a command of the input ends while it is read line by line.
+ * Every line is scanned once when it is added, and the open parentheses and
+ * the last operator are kept from one line to the next, so a command which
+ * spans many lines costs no more than one long line. A command goes on
+ * while a ( or quote is open, or when a line ends in \, &&, ||, | or a
+ * redirection. The lines after one with a <<WORD are a here-document up
+ * to a line which is WORD, they are passed to scan_document() instead.
+ */
+struct pish_scan {
+    int depth; /* The number of open parentheses */
+    int last;  /* The kind of the last token, see pish_parse.c */
+    int quote; /* The quote which is open, ' or ", 0 if none is */
+    int ndocs; /* The number of here-documents whose lines are still due */
+    /* Their delimiters, each as - or a space for <<- or << and the word */
+    struct pish_buf docs;
+    size_t doc;   /* Where the delimiter of the current one starts in docs */
+    int want_doc; /* A << was the last token, so its word is a delimiter */
+};
+
+/* What scan_line() found about the end of a line */
+enum scan_result {
+    SCAN_DONE,    /* The command is complete */
+    SCAN_JOIN,    /* It goes on in the next line, joined with a space */
+    SCAN_SPLICE,  /* The line ended in \, which was removed, the next line
+                     follows without a space */
+    SCAN_NEWLINE, /* The line break is inside parentheses and ends a
+                     command there, it is joined with "; " */
+    SCAN_QUOTE,   /* The line break is inside quotes and is kept */
+};
+
+const char *word_part_end(const char *s, char *missing);
+void scan_begin(struct pish_scan *scan);
+enum scan_result scan_line(struct pish_scan *scan, char *line, size_t *len);
+int scan_document(struct pish_scan *scan, const char *line, size_t len);
+void scan_end(struct pish_scan *scan);
+struct pish_node *parse_chain(struct pish_arena *arena, const char *chain,
+                              int flags, int *error);
+void format_node(const struct pish_node *node, struct pish_buf *out);
+
+#endif // __PISH_PARSE_H__
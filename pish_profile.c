@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pish_buf.h"
+#include "pish_jobs.h"
+#include "pish_profile.h"
+
+/*
+ * A launched process which is logged once it is reaped
+ */
+struct launch {
+    pid_t pid;
+    struct timespec start; /* When the shell began to launch it */
+    long spawn_us;         /* How long fork or posix_spawn took */
+    char *command;
+};
+
+/* The PISH_PROFILE file, or -1 when not profiling */
+static int profile_fd = -1;
+static struct launch *launches = NULL;
+static int nlaunches = 0;
+static int launches_capacity = 0;
+/* The usage of every child reaped so far, see usage_begin() */
+static struct timeval child_utime;
+static struct timeval child_stime;
+static long child_maxrss = 0;
+
+/*
+ * Open the PISH_PROFILE file if it is set. It is opened for appending, so
+ * the lines of shells which share it, ie jobs of parallel, are not mixed up.
+ */
+void profile_init(void) {
+    const char *path = getenv("PISH_PROFILE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    profile_fd =
+        open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (profile_fd < 0) {
+        perror(path);
+    }
+}
+
+static long elapsed_us(const struct timespec *from,
+                       const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000L +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static long timeval_us(const struct timeval *tv) {
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+/*
+ * Take the time right before a process is launched, for profile_launch().
+ * Nothing is done unless profiling.
+ */
+void profile_clock(struct timespec *start) {
+    if (profile_fd >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, start);
+    }
+}
+
+/*
+ * Remember a process which was just launched, so it can be logged when it
+ * is reaped. Nothing is done unless profiling.
+ * @param start     From profile_clock() right before the launch
+ * @param node      What the process runs, or NULL to use text instead
+ * @param text      The command line when there is no node
+ */
+void profile_launch(pid_t pid, const struct timespec *start,
+                    const struct pish_node *node, const char *text) {
+    if (profile_fd < 0 || pid <= 0) {
+        return;
+    }
+    if (nlaunches == launches_capacity) {
+        launches_capacity = launches_capacity ? launches_capacity * 2 : 16;
+        launches =
+            realloc(launches, launches_capacity * sizeof(struct launch));
+        if (launches == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct launch *launch = &launches[nlaunches++];
+    launch->pid = pid;
+    launch->start = *start;
+    launch->spawn_us = elapsed_us(start, &now);
+    if (node != NULL) {
+        struct pish_buf command = {0};
+        format_node(node, &command);
+        launch->command = command.data ? command.data : strdup("");
+    } else {
+        launch->command = strdup(text);
+    }
+    if (launch->command == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Write the line of a launched process which was reaped, with a single
+ * write() so lines of several shells appending to the file stay whole
+ */
+static void profile_reaped(pid_t pid, int status, const struct rusage *ru) {
+    int i = nlaunches - 1;
+    while (i >= 0 && launches[i].pid != pid) {
+        i--;
+    }
+    if (i < 0) {
+        return;
+    }
+    struct launch *launch = &launches[i];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char fields[256];
+    int len = snprintf(fields, sizeof(fields),
+                       "pid=%d spawn_us=%ld run_us=%ld user_us=%ld "
+                       "sys_us=%ld maxrss_kb=%ld status=%d command=",
+                       (int)pid, launch->spawn_us,
+                       elapsed_us(&launch->start, &now),
+                       timeval_us(&ru->ru_utime), timeval_us(&ru->ru_stime),
+                       ru->ru_maxrss, exit_status(status));
+    struct pish_buf line = {0};
+    buf_append(&line, fields, len);
+    buf_append(&line, launch->command, strlen(launch->command));
+    buf_append(&line, "\n", 1);
+    if (write(profile_fd, line.data, line.len) < 0) {
+        perror("PISH_PROFILE");
+    }
+    buf_free(&line);
+    free(launch->command);
+    *launch = launches[--nlaunches];
+}
+
+/*
+ * waitpid() which also keeps the resource usage of the child once it is
+ * done, for the time keyword and PISH_PROFILE
+ * @return          Like waitpid()
+ */
+pid_t wait_process(pid_t pid, int *status, int options) {
+    struct rusage ru;
+    pid_t done = wait4(pid, status, options, &ru);
+    if (done > 0 && (WIFEXITED(*status) || WIFSIGNALED(*status))) {
+        timeradd(&child_utime, &ru.ru_utime, &child_utime);
+        timeradd(&child_stime, &ru.ru_stime, &child_stime);
+        if (ru.ru_maxrss > child_maxrss) {
+            child_maxrss = ru.ru_maxrss;
+        }
+        if (profile_fd >= 0) {
+            profile_reaped(done, *status, &ru);
+        }
+    }
+    return done;
+}
+
+/*
+ * Start timing a command for the time keyword
+ */
+void usage_begin(struct usage_mark *mark) {
+    clock_gettime(CLOCK_MONOTONIC, &mark->wall);
+    getrusage(RUSAGE_SELF, &mark->self);
+    mark->child_utime = child_utime;
+    mark->child_stime = child_stime;
+    mark->child_maxrss = child_maxrss;
+    // the largest child is only looked for among the timed ones
+    child_maxrss = 0;
+}
+
+static void print_time(const char *name, long us) {
+    fprintf(stderr, "%s\t%ldm%ld.%03lds\n", name, us / 60000000,
+            us / 1000000 % 60, us / 1000 % 1000);
+}
+
+/*
+ * Print how long a timed command took and what it used, like the time of
+ * bash plus the largest resident set of its processes. The user and sys
+ * times add up the shell itself and every child reaped meanwhile.
+ * @param mark      From usage_begin() before the command ran
+ */
+void usage_report(const struct usage_mark *mark) {
+    struct timespec now;
+    struct rusage self;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &self);
+    struct timeval user, sys, part;
+    timersub(&self.ru_utime, &mark->self.ru_utime, &user);
+    timersub(&child_utime, &mark->child_utime, &part);
+    timeradd(&user, &part, &user);
+    timersub(&self.ru_stime, &mark->self.ru_stime, &sys);
+    timersub(&child_stime, &mark->child_stime, &part);
+    timeradd(&sys, &part, &sys);
+    // a command made only of built-ins ran in the shell itself
+    long maxrss = child_maxrss ? child_maxrss : self.ru_maxrss;
+    fflush(stdout);
+    fputc('\n', stderr);
+    print_time("real", elapsed_us(&mark->wall, &now));
+    print_time("user", timeval_us(&user));
+    print_time("sys", timeval_us(&sys));
+    fprintf(stderr, "maxrss\t%ldk\n", maxrss);
+    if (mark->child_maxrss > child_maxrss) {
+        child_maxrss = mark->child_maxrss;
+    }
+}
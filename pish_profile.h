@@ -0,0 +1,33 @@
+#ifndef __PISH_PROFILE_H__
+#define __PISH_PROFILE_H__
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "pish_parse.h"
+
+/*
+ * Every child of the shell is reaped through wait_process(), which keeps the
+ * resource usage wait4() reports instead of only the exit status. The time
+ * keyword reports the part of it a pipeline used, and with
+ * PISH_PROFILE=file set every process the shell launches is logged to file,
+ * one line per process once it is reaped.
+ */
+struct usage_mark {
+    struct timespec wall; /* When the timed command started */
+    struct rusage self;   /* The usage of the shell itself by then */
+    struct timeval child_utime;
+    struct timeval child_stime;
+    long child_maxrss; /* The largest child so far, restored afterwards */
+};
+
+void profile_init(void);
+void profile_clock(struct timespec *start);
+void profile_launch(pid_t pid, const struct timespec *start,
+                    const struct pish_node *node, const char *text);
+pid_t wait_process(pid_t pid, int *status, int options);
+void usage_begin(struct usage_mark *mark);
+void usage_report(const struct usage_mark *mark);
+
+#endif // __PISH_PROFILE_H__
@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pish_jobs.h"
+#include "pish_serve.h"
+
+#define SERVE_MAGIC 0x70697368u /* "pish" */
+/* The longest command line a client may send */
+#define SERVE_MAX_ARG (64 << 20)
+
+/*
+ * What a client sends first, together with its stdin, stdout and stderr.
+ * The working directory and then the argument follow, without NULs.
+ */
+struct serve_request {
+    uint32_t magic;
+    uint32_t kind;    /* enum serve_kind */
+    uint32_t cwd_len;
+    uint32_t arg_len;
+};
+
+/* Set by the signal handler of the server to shut down */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+/*
+ * Fill in the address of the socket at path
+ * @return          0, or -1 if the path is too long
+ */
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "pish: %s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * Write all of len bytes to a socket
+ * @return          0, or -1 on an error
+ */
+static int send_all(int fd, const void *data, size_t len) {
+    const char *s = data;
+    while (len > 0) {
+        ssize_t n = send(fd, s, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Read exactly len bytes from a socket
+ * @return          0, or -1 on an error or if the peer closed it early
+ */
+static int recv_all(int fd, void *data, size_t len) {
+    char *s = data;
+    while (len > 0) {
+        ssize_t n = recv(fd, s, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Send data together with fds over a Unix socket
+ * @return          0, or -1 on an error
+ */
+static int send_fds(int sock, const void *data, size_t len, const int *fds,
+                    int nfds) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {(void *)data, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Receive exactly len bytes of data and the nfds fds sent with them, at most
+ * three. The fds are close on exec.
+ * @return          0, or -1 on an error or if anything else arrived
+ */
+static int recv_fds(int sock, void *data, size_t len, int *fds, int nfds) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {data, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 &&
+           errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int passed[3];
+    memcpy(passed, CMSG_DATA(cmsg), received * sizeof(int));
+    if (n != (ssize_t)len || received != nfds) {
+        for (int i = 0; i < received; i++) {
+            close(passed[i]);
+        }
+        return -1;
+    }
+    memcpy(fds, passed, nfds * sizeof(int));
+    return 0;
+}
+
+/*
+ * Read a request from a client and run it, in the ready copy of a worker
+ * which it was handed to. The fds of the client become its stdin, stdout
+ * and stderr. Never returns.
+ */
+static void answer_request(int conn,
+                        int (*run)(enum serve_kind kind, const char *arg)) {
+    struct serve_request request;
+    int fds[3];
+    if (recv_fds(conn, &request, sizeof(request), fds, 3) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (request.magic != SERVE_MAGIC || request.kind > SERVE_COMMAND ||
+        request.cwd_len >= PATH_MAX || request.arg_len > SERVE_MAX_ARG) {
+        exit(EXIT_FAILURE);
+    }
+    char *cwd = malloc(request.cwd_len + 1);
+    char *arg = malloc(request.arg_len + 1);
+    if (cwd == NULL || arg == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (recv_all(conn, cwd, request.cwd_len) < 0 ||
+        recv_all(conn, arg, request.arg_len) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    cwd[request.cwd_len] = '\0';
+    arg[request.arg_len] = '\0';
+    // the status goes back through the worker
+    close(conn);
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != i) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+    }
+    if (chdir(cwd) < 0) {
+        perror(cwd);
+        exit(EXIT_FAILURE);
+    }
+    exit(run(request.kind, arg));
+}
+
+/*
+ * Fork the copy of a worker which runs the next request. It waits on a
+ * socket pair until the worker hands it a connection, so the fork is done
+ * before the request comes in.
+ * @param busy      The connection the worker is answering, or -1
+ * @param handoff   Set to the end of the pair the worker hands it over on
+ * @return          Its pid, or -1 if it could not be started
+ */
+static pid_t start_ready(int listen_fd, int busy, int *handoff,
+                         int (*run)(enum serve_kind kind, const char *arg)) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    } else if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        close(listen_fd);
+        if (busy >= 0) {
+            close(busy);
+        }
+        close(pair[0]);
+        char byte;
+        int conn;
+        // the worker closes its end when it stops
+        if (recv_fds(pair[1], &byte, 1, &conn, 1) < 0) {
+            exit(EXIT_SUCCESS);
+        }
+        close(pair[1]);
+        answer_request(conn, run);
+    }
+    close(pair[1]);
+    *handoff = pair[0];
+    return pid;
+}
+
+/*
+ * Accept and answer requests one at a time until stopped. Every worker
+ * waits in accept() on the same socket, the kernel wakes one for each
+ * connection. The connection is handed to a ready copy of the worker, so no
+ * request sees what an earlier one did to the shell, and the next copy is
+ * forked while it runs. The worker keeps the connection to send the exit
+ * status of the copy, which also covers exit and being killed.
+ * The handler of the server is inherited, so SIGTERM lets a request which
+ * is running finish first.
+ */
+static void worker(int listen_fd,
+                   int (*run)(enum serve_kind kind, const char *arg)) {
+    int handoff = -1;
+    pid_t ready = -1;
+    while (!stopping) {
+        if (ready < 0) {
+            ready = start_ready(listen_fd, -1, &handoff, run);
+            if (ready < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        int handed = send_fds(handoff, "r", 1, &conn, 1);
+        close(handoff);
+        pid_t pid = ready;
+        ready = -1;
+        if (handed == 0) {
+            ready = start_ready(listen_fd, conn, &handoff, run);
+        }
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        int32_t result = exit_status(status);
+        if (handed == 0) {
+            send_all(conn, &result, sizeof(result));
+        }
+        close(conn);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Create the listening socket. A socket file left behind by a server which
+ * is gone is replaced, one which still answers is not.
+ * @return          The socket, or -1 on an error
+ */
+static int listen_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (bound < 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0 &&
+            connect(probe, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+            errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        if (probe >= 0) {
+            close(probe);
+        }
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (bound < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Fork a worker
+ * @return          Its pid, or -1 if fork() failed
+ */
+static pid_t start_worker(int listen_fd,
+                          int (*run)(enum serve_kind kind, const char *arg)) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+    } else if (pid == 0) {
+        worker(listen_fd, run);
+    }
+    return pid;
+}
+
+/*
+ * Serve requests on the socket at path until SIGTERM or SIGINT. Workers
+ * which die are replaced, and on shutdown they are stopped and the socket
+ * is removed.
+ * @param workers   How many requests can run at once
+ * @param run       Runs a request in the forked copy of a worker
+ * @return          The exit status of the server
+ */
+int serve_main(const char *path, int workers,
+               int (*run)(enum serve_kind kind, const char *arg)) {
+    if (workers < 1) {
+        fprintf(stderr, "pish: --serve: invalid number of workers\n");
+        return EXIT_FAILURE;
+    }
+    int listen_fd = listen_socket(path);
+    if (listen_fd < 0) {
+        return EXIT_FAILURE;
+    }
+    // no SA_RESTART, so wait() returns for the signal
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    if (pids == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < workers; i++) {
+        pids[i] = start_worker(listen_fd, run);
+    }
+    while (!stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == ECHILD) {
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] == pid && !stopping) {
+                pids[i] = start_worker(listen_fd, run);
+            }
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    unlink(path);
+    close(listen_fd);
+    free(pids);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Send a request to a server and wait until it ran
+ * @return          The exit status of the request, or 1 if the server could
+ * not run it
+ */
+int client_main(const char *path, enum serve_kind kind, const char *arg) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) < 0) {
+        return EXIT_FAILURE;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("getcwd");
+        return EXIT_FAILURE;
+    }
+    struct serve_request request = {SERVE_MAGIC, kind, strlen(cwd),
+                                    strlen(arg)};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int32_t status;
+    if (send_fds(fd, &request, sizeof(request), fds, 3) < 0 ||
+        send_all(fd, cwd, request.cwd_len) < 0 ||
+        send_all(fd, arg, request.arg_len) < 0 ||
+        recv_all(fd, &status, sizeof(status)) < 0) {
+        fprintf(stderr, "pish: %s: the server did not run the request\n",
+                path);
+        status = EXIT_FAILURE;
+    }
+    free(cwd);
+    close(fd);
+    return status;
+}
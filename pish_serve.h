@@ -0,0 +1,28 @@
+#ifndef __PISH_SERVE_H__
+#define __PISH_SERVE_H__
+
+/*
+ * A server which runs scripts and command lines for clients over a Unix
+ * socket, so a task costs a round trip instead of starting a new shell:
+ *   pish --serve SOCKET [WORKERS]
+ *   pish --client SOCKET script
+ *   pish --client SOCKET -c command
+ * The server keeps WORKERS processes waiting on the socket. A client sends
+ * its working directory and the request, and passes its stdin, stdout and
+ * stderr with SCM_RIGHTS, so the output of the request goes straight to the
+ * client's fds. The worker which accepts it forks a copy of itself to run
+ * the request, so no request sees what an earlier one did to the shell, and
+ * sends the exit status back for the client to exit with.
+ */
+enum serve_kind {
+    SERVE_SCRIPT,  /* The request is the path of a script */
+    SERVE_COMMAND, /* The request is a command line */
+};
+
+#define SERVE_WORKERS 4 /* The number of workers without WORKERS */
+
+int serve_main(const char *path, int workers,
+               int (*run)(enum serve_kind kind, const char *arg));
+int client_main(const char *path, enum serve_kind kind, const char *arg);
+
+#endif // __PISH_SERVE_H__
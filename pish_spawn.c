@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pish_hash.h"
+#include "pish_heredoc.h"
+#include "pish_spawn.h"
+#include "pish_vars.h"
+
+/*
+ * The fds opened in the parent for redirections are moved to this fd or
+ * above so they never collide with the fds the child is going to use.
+ */
+#define SPAWN_FD_BASE 10
+
+/*
+ * Open the target of a file redirection or the document of a here-document
+ * in the parent. The fd is close on exec, the child only keeps the copy it
+ * gets from dup2.
+ * @param redir     The redirection to open the file for
+ * @return          The opened fd, or -1 if the file could not be opened
+ */
+static int open_redirect(struct pish_redir *redir) {
+    int fd;
+    if (redir->kind == REDIR_DOC) {
+        if ((fd = heredoc_open(redir->path, strlen(redir->path))) < 0) {
+            return -1;
+        }
+    } else {
+        // 0644 means that the file can be read by owner, users in the file
+        // group, and anyone else on the system
+        fd = open(redir->path, redir->flags | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(redir->path);
+            return -1;
+        }
+    }
+    if (fd < SPAWN_FD_BASE) {
+        int high_fd = fcntl(fd, F_DUPFD_CLOEXEC, SPAWN_FD_BASE);
+        close(fd);
+        if (high_fd < 0) {
+            perror("fcntl");
+            return -1;
+        }
+        fd = high_fd;
+    }
+    return fd;
+}
+
+/*
+ * Launch a simple external command without forking the shell. The
+ * redirections of the command are turned into spawn file actions, in order,
+ * after stdin and stdout have been connected to in_fd and out_fd.
+ *
+ * @param cmd       The command node to launch, it must not be a built-in
+ * @param in_fd     The fd to use as stdin, or -1 to keep the shell's stdin
+ * @param out_fd    The fd to use as stdout, or -1 to keep the shell's stdout
+ * @param pgid      The process group to put the command in, 0 for a new group
+ * led by the command, or -1 to stay in the group of the shell
+ * @param pid       The pid of the launched process is stored here
+ * @return          0 if the command was launched, otherwise the exit status
+ * the command should have (1 for a failed redirection, 127 if it could not be
+ * executed)
+ */
+int spawn_command(struct pish_node *cmd, int in_fd, int out_fd, pid_t pgid,
+                  pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int opened[cmd->nredirs + 1];
+    int nopened = 0;
+    int result = 0;
+    int err;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    }
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < cmd->nredirs; i++) {
+        struct pish_redir *redir = &cmd->redirs[i];
+        if (redir->kind == REDIR_CLOSE) {
+            posix_spawn_file_actions_addclose(&actions, redir->fd);
+        } else if (redir->kind == REDIR_DUP) {
+            posix_spawn_file_actions_adddup2(&actions, redir->dup_fd,
+                                             redir->fd);
+        } else {
+            int fd = open_redirect(redir);
+            if (fd < 0) {
+                result = 1;
+                goto out;
+            }
+            opened[nopened++] = fd;
+            posix_spawn_file_actions_adddup2(&actions, fd, redir->fd);
+        }
+    }
+    // commands are found through the hash table instead of letting
+    // posix_spawnp() search $PATH every time
+    const char *path = hash_lookup(cmd->argv[0]);
+    char **envp = vars_environ();
+    err = path ? posix_spawn(pid, path, &actions, &attr, cmd->argv, envp)
+               : ENOENT;
+    if (err == ENOENT && path != NULL && path != cmd->argv[0]) {
+        // the cached path is gone, search $PATH again
+        hash_forget(cmd->argv[0]);
+        path = hash_lookup(cmd->argv[0]);
+        err = path ? posix_spawn(pid, path, &actions, &attr, cmd->argv, envp)
+                   : ENOENT;
+    }
+    if (err == EBADF) {
+        // a dup2 action failed, ie 2>&5 when fd 5 is not open
+        fprintf(stderr, "dup2: %s\n", strerror(err));
+        result = 1;
+    } else if (err != 0) {
+        // the same message the forked child prints with perror()
+        fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(err));
+        result = 127;
+    }
+out:
+    for (int i = 0; i < nopened; i++) {
+        close(opened[i]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return result;
+}
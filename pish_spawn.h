@@ -0,0 +1,22 @@
+#ifndef __PISH_SPAWN_H__
+#define __PISH_SPAWN_H__
+
+#include <sys/types.h>
+
+#include "pish_parse.h"
+
+/*
+ * Simple external commands are launched with posix_spawn(), which on Linux
+ * uses a CLONE_VM|CLONE_VFORK child and so never copies the page tables of
+ * the shell. Build with -DPISH_NO_SPAWN to always use fork() instead.
+ */
+#ifndef PISH_NO_SPAWN
+#define PISH_USE_SPAWN 1
+#else
+#define PISH_USE_SPAWN 0
+#endif
+
+int spawn_command(struct pish_node *cmd, int in_fd, int out_fd, pid_t pgid,
+                  pid_t *pid);
+
+#endif // __PISH_SPAWN_H__
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pish_buf.h"
+#include "pish_trace.h"
+
+/* The most written at once, so records of shells sharing a pipe never mix */
+#define TRACE_BUFFER_SIZE PIPE_BUF
+/* The most of the name of a command a record keeps, and the longest record */
+#define TRACE_NAME_MAX 256
+#define TRACE_RECORD_MAX (TRACE_NAME_MAX * 6 + 256)
+
+/* The PISH_TRACE file descriptor, or -1 when not tracing */
+static int trace_fd = -1;
+static struct pish_buf records = {0};
+/* How many nodes are running, from the root of the command line down */
+static int depth = 0;
+/* The pid of the shell, which a forked child updates */
+static pid_t trace_pid = 0;
+
+static const char *const kind_names[] = {
+    [NODE_SEQUENCE] = "sequence",     [NODE_AND] = "and",
+    [NODE_OR] = "or",                 [NODE_PIPELINE] = "pipeline",
+    [NODE_SUBSHELL] = "subshell",     [NODE_BANG] = "bang",
+    [NODE_BACKGROUND] = "background", [NODE_TIME] = "time",
+    [NODE_COMMAND] = "command",
+};
+
+/*
+ * A forked child starts without the records of its parent, which the parent
+ * writes itself
+ */
+static void forget_records(void) {
+    records.len = 0;
+    trace_pid = getpid();
+}
+
+/*
+ * Start tracing to the file descriptor in PISH_TRACE if it is set
+ */
+void trace_init(void) {
+    const char *value = getenv("PISH_TRACE");
+    if (value == NULL || *value == '\0') {
+        return;
+    }
+    char *end;
+    long fd = strtol(value, &end, 10);
+    if (*end != '\0' || fd < 0 || fd > INT_MAX || fcntl(fd, F_GETFL) < 0) {
+        fprintf(stderr, "pish: PISH_TRACE: %s: not an open file descriptor\n",
+                value);
+        return;
+    }
+    trace_fd = fd;
+    trace_pid = getpid();
+    buf_reserve(&records, TRACE_BUFFER_SIZE);
+    pthread_atfork(NULL, NULL, forget_records);
+    atexit(trace_flush);
+}
+
+/*
+ * Write the buffered records
+ */
+void trace_flush(void) {
+    size_t written = 0;
+    while (trace_fd >= 0 && written < records.len) {
+        ssize_t n =
+            write(trace_fd, records.data + written, records.len - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("PISH_TRACE");
+            trace_fd = -1;
+            break;
+        }
+        written += n;
+    }
+    records.len = 0;
+}
+
+/*
+ * Take the time a node starts at, if tracing
+ * @param start     Set to the time
+ * @return          1 if tracing, then trace_end() must be called once the
+ * node is done, 0 otherwise
+ */
+int trace_begin(struct timespec *start) {
+    if (trace_fd < 0) {
+        return 0;
+    }
+    depth++;
+    clock_gettime(CLOCK_MONOTONIC, start);
+    return 1;
+}
+
+/*
+ * Records are made in place with these instead of buf_append() or snprintf()
+ * per field, which would cost as much as the built-ins they measure
+ */
+static char *put(char *p, const char *text, size_t len) {
+    memcpy(p, text, len);
+    return p + len;
+}
+
+#define PUT_LITERAL(p, text) put(p, text, sizeof(text) - 1)
+
+static char *put_number(char *p, long long n) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *s = end;
+    unsigned long long value = n < 0 ? 0 - (unsigned long long)n
+                                     : (unsigned long long)n;
+    do {
+        *--s = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    if (n < 0) {
+        *--s = '-';
+    }
+    return put(p, s, end - s);
+}
+
+/*
+ * Put a string as JSON, in quotes and with what has to be escaped, cut at
+ * TRACE_NAME_MAX bytes
+ */
+static char *put_json(char *p, const char *text) {
+    *p++ = '"';
+    for (size_t i = 0; text[i] != '\0' && i < TRACE_NAME_MAX; i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < ' ') {
+            p = PUT_LITERAL(p, "\\u00");
+            *p++ = "0123456789abcdef"[c >> 4];
+            *p++ = "0123456789abcdef"[c & 15];
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+/*
+ * Start a record with the fields every node has, after the node is done
+ * @return          Where the fields of its kind go
+ */
+static char *record_begin(char *p, const struct timespec *start,
+                          const struct pish_node *node) {
+    depth--;
+    p = PUT_LITERAL(p, "{\"ts_ns\":");
+    p = put_number(p, start->tv_sec * 1000000000LL + start->tv_nsec);
+    p = PUT_LITERAL(p, ",\"pid\":");
+    p = put_number(p, trace_pid);
+    p = PUT_LITERAL(p, ",\"depth\":");
+    p = put_number(p, depth);
+    p = PUT_LITERAL(p, ",\"kind\":\"");
+    p = put(p, kind_names[node->kind], strlen(kind_names[node->kind]));
+    *p++ = '"';
+    return p;
+}
+
+/*
+ * End a record with how long the node took and its status, and add it to
+ * the buffer
+ */
+static void record_end(char *record, char *p, const struct timespec *start,
+                       const struct timespec *now, int status) {
+    p = PUT_LITERAL(p, ",\"dur_ns\":");
+    p = put_number(p, (now->tv_sec - start->tv_sec) * 1000000000LL +
+                          (now->tv_nsec - start->tv_nsec));
+    p = PUT_LITERAL(p, ",\"status\":");
+    p = put_number(p, status);
+    p = PUT_LITERAL(p, "}\n");
+    size_t len = p - record;
+    if (records.len + len > TRACE_BUFFER_SIZE) {
+        trace_flush();
+    }
+    buf_append(&records, record, len);
+}
+
+/*
+ * Add the record of a node which is done to the buffer
+ * @param start     From trace_begin() right before the node started
+ * @param node      The node
+ * @param status    Its exit status
+ */
+void trace_end(const struct timespec *start, const struct pish_node *node,
+               int status) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char record[TRACE_RECORD_MAX];
+    char *p = record_begin(record, start, node);
+    if (node->kind == NODE_COMMAND && node->argc > 0) {
+        p = PUT_LITERAL(p, ",\"name\":");
+        p = put_json(p, node->argv[0]);
+    }
+    if (node->kind == NODE_PIPELINE) {
+        p = PUT_LITERAL(p, ",\"stages\":");
+        p = put_number(p, node->nchildren);
+    }
+    if (node->kind == NODE_COMMAND || node->kind == NODE_SUBSHELL) {
+        p = PUT_LITERAL(p, ",\"redirs\":");
+        p = put_number(p, node->nredirs);
+    }
+    if (node->kind == NODE_SUBSHELL) {
+        p = node->flags & NODE_INLINE ? PUT_LITERAL(p, ",\"inline\":true")
+                                      : PUT_LITERAL(p, ",\"inline\":false");
+    }
+    record_end(record, p, start, &now, status);
+}
+
+/*
+ * Add the record of an operator of an and-or list which is done. The list
+ * runs flat, see run_and_or() in pish.c, so every operator starts with the
+ * list, and its left side is the operators below it.
+ * @param start     From trace_begin() right before the list started
+ * @param op        The && or || node
+ * @param left      The status of its left side
+ * @param ran       1 if its right side ran, 0 if the left decided
+ * @param status    Its exit status
+ */
+void trace_operator(const struct timespec *start, const struct pish_node *op,
+                    int left, int ran, int status) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char record[TRACE_RECORD_MAX];
+    char *p = record_begin(record, start, op);
+    p = PUT_LITERAL(p, ",\"left_status\":");
+    p = put_number(p, left);
+    p = ran ? PUT_LITERAL(p, ",\"right_ran\":true")
+            : PUT_LITERAL(p, ",\"right_ran\":false");
+    record_end(record, p, start, &now, status);
+}
+
+/*
+ * Append a word for set -x, in single quotes unless it is only made of
+ * characters which mean nothing to the shell
+ */
+static void append_word(struct pish_buf *out, const char *word) {
+    size_t plain = strspn(word, "abcdefghijklmnopqrstuvwxyz"
+                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                "0123456789_-+./:,@%^=");
+    if (*word != '\0' && word[plain] == '\0') {
+        buf_append(out, word, strlen(word));
+        return;
+    }
+    buf_append(out, "'", 1);
+    for (const char *s = word; *s != '\0'; s++) {
+        if (*s == '\'') {
+            buf_append(out, "'\\''", 4);
+        } else {
+            buf_append(out, s, 1);
+        }
+    }
+    buf_append(out, "'", 1);
+}
+
+/*
+ * Print a simple command for set -x, as + and its expanded words, with a
+ * single write so it is not mixed up with the output of other processes
+ * @param cmd       The expanded command node
+ */
+void trace_command(const struct pish_node *cmd) {
+    struct pish_buf line = {0};
+    buf_append(&line, "+", 1);
+    for (int i = 0; i < cmd->nassigns; i++) {
+        const char *assign = cmd->assigns[i];
+        const char *value = strchr(assign, '=') + 1;
+        buf_append(&line, " ", 1);
+        buf_append(&line, assign, value - assign);
+        if (*value != '\0') {
+            append_word(&line, value);
+        }
+    }
+    for (int i = 0; i < cmd->argc; i++) {
+        buf_append(&line, " ", 1);
+        append_word(&line, cmd->argv[i]);
+    }
+    buf_append(&line, "\n", 1);
+    fflush(stdout);
+    fwrite(line.data, 1, line.len, stderr);
+    buf_free(&line);
+}
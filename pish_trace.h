@@ -0,0 +1,38 @@
+#ifndef __PISH_TRACE_H__
+#define __PISH_TRACE_H__
+
+#include <time.h>
+
+#include "pish_parse.h"
+
+/*
+ * Tracing of what the shell runs. set -x prints every simple command to
+ * stderr once its words are expanded, like other shells do. With
+ * PISH_TRACE=fd set every node the shell executes is written to that file
+ * descriptor as one JSON object on a line of its own, once it is done, ie
+ *   {"ts_ns":7305321794012,"pid":4210,"depth":1,"kind":"pipeline",
+ *    "stages":2,"dur_ns":1843210,"status":0}
+ * ts_ns is when the node started on CLOCK_MONOTONIC, depth how deep it is in
+ * the tree of its command line, and kind one of sequence, and, or, pipeline,
+ * subshell, bang, background, time or command. A command also has its name
+ * as it was written, a command or subshell its number of redirs, and a
+ * subshell whether it ran inline without a fork. Every && and || of a list
+ * has a record, with the left_status it saw and whether right_ran. The
+ * stages of a pipeline have no records of their own, since they are spawned
+ * or forked without going through execute_node(), the pipeline record covers
+ * them. The nodes inside a child, ie in a stage which is a subshell, are
+ * traced with the pid of the child. The records are buffered and written
+ * whole, up to PIPE_BUF at a time, when the buffer fills, before the shell
+ * waits for input and when it or a child exits. The nodes which are measured
+ * only pay for a write() once per buffer full, not once per record.
+ */
+void trace_init(void);
+int trace_begin(struct timespec *start);
+void trace_end(const struct timespec *start, const struct pish_node *node,
+               int status);
+void trace_operator(const struct timespec *start, const struct pish_node *op,
+                    int left, int ran, int status);
+void trace_flush(void);
+void trace_command(const struct pish_node *cmd);
+
+#endif // __PISH_TRACE_H__
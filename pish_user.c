@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pish_user.h"
+#include "pish_vars.h"
+
+static const struct passwd *user = NULL;
+static int looked_up = 0;
+
+/*
+ * @return          The passwd entry of the user, or NULL if there is none
+ */
+const struct passwd *current_user(void) {
+    if (looked_up) {
+        return user;
+    }
+    looked_up = 1;
+#ifdef PISH_STATIC
+    FILE *passwd = fopen("/etc/passwd", "re");
+    if (passwd != NULL) {
+        uid_t uid = getuid();
+        struct passwd *entry;
+        // the entry stays valid as long as fgetpwent() is not called again
+        while ((entry = fgetpwent(passwd)) != NULL && entry->pw_uid != uid) {
+        }
+        user = entry;
+        fclose(passwd);
+    }
+#else
+    user = getpwuid(getuid());
+#endif
+    return user;
+}
+
+/*
+ * @return          $HOME, or the home directory of the passwd entry if it
+ * is not set. The passwd entry is not looked up when $HOME is set.
+ */
+const char *home_dir(void) {
+    const char *home = var_get("HOME");
+    if (home != NULL && *home != '\0') {
+        return home;
+    }
+    const struct passwd *entry = current_user();
+    return entry != NULL ? entry->pw_dir : "/";
+}
@@ -0,0 +1,15 @@
+#ifndef __PISH_USER_H__
+#define __PISH_USER_H__
+
+#include <pwd.h>
+
+/*
+ * The user running the shell. The passwd entry is only looked up when it is
+ * first needed, and only once. Static builds (-DPISH_STATIC) read
+ * /etc/passwd instead of calling getpwuid(), which would load the NSS
+ * modules of the shared glibc at run time.
+ */
+const struct passwd *current_user(void);
+const char *home_dir(void);
+
+#endif // __PISH_USER_H__
@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pish_vars.h"
+
+extern char **environ;
+
+/*
+ * One variable. The table uses open addressing with linear probing, a slot
+ * is empty when entry is NULL.
+ */
+struct var_entry {
+    char *entry;     /* NAME=value, the form the environment wants */
+    size_t name_len; /* The length of NAME */
+    int exported;    /* It goes into the environment of commands */
+    int set;         /* 0 for a name which was exported without a value */
+};
+
+static struct var_entry *table = NULL;
+static size_t table_size = 0; /* Always a power of two */
+static size_t table_count = 0;
+/*
+ * The environment built from the exported variables, NULL as long as the
+ * one the shell got is still right
+ */
+static char **envp = NULL;
+/* An exported variable changed since envp was built */
+static int envp_stale = 0;
+/* Replaced entries of exported variables, which envp may still point to */
+static char **retired = NULL;
+static size_t nretired = 0;
+static size_t retired_capacity = 0;
+
+/*
+ * FNV-1a hash of a variable name
+ */
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Find the slot of a name, or the empty slot where it would be inserted
+ */
+static size_t find_slot(const char *name, size_t len) {
+    size_t mask = table_size - 1;
+    size_t i = hash_name(name, len) & mask;
+    while (table[i].entry != NULL &&
+           (table[i].name_len != len ||
+            memcmp(table[i].entry, name, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void grow_table(void) {
+    struct var_entry *old = table;
+    size_t old_size = table_size;
+    table_size = table_size ? table_size * 2 : 64;
+    table = calloc(table_size, sizeof(struct var_entry));
+    if (table == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].entry != NULL) {
+            table[find_slot(old[i].entry, old[i].name_len)] = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+ * Build the NAME=value string of a variable
+ */
+static char *make_entry(const char *name, size_t name_len,
+                        const char *value) {
+    size_t value_len = strlen(value);
+    char *entry = malloc(name_len + value_len + 2);
+    if (entry == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+    return entry;
+}
+
+/*
+ * Let go of the entry of a variable. The one of an exported variable is
+ * kept until the environment is built again, since environ points to it.
+ */
+static void drop_entry(struct var_entry *var) {
+    if (!var->exported) {
+        free(var->entry);
+        return;
+    }
+    if (nretired == retired_capacity) {
+        retired_capacity = retired_capacity ? retired_capacity * 2 : 16;
+        retired = realloc(retired, retired_capacity * sizeof(char *));
+        if (retired == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    retired[nretired++] = var->entry;
+    envp_stale = 1;
+}
+
+/*
+ * Find the slot of a variable, filling the table from the environment the
+ * first time
+ */
+static size_t lookup(const char *name, size_t len) {
+    if (table == NULL) {
+        grow_table();
+        for (char **env = environ; *env != NULL; env++) {
+            const char *eq = strchr(*env, '=');
+            if (eq == NULL) {
+                continue;
+            }
+            if ((table_count + 1) * 2 > table_size) {
+                grow_table();
+            }
+            // like getenv(), the first of two entries with a name wins
+            size_t i = find_slot(*env, eq - *env);
+            if (table[i].entry == NULL) {
+                table[i].entry = strdup(*env);
+                if (table[i].entry == NULL) {
+                    perror("strdup");
+                    exit(EXIT_FAILURE);
+                }
+                table[i].name_len = eq - *env;
+                table[i].exported = 1;
+                table[i].set = 1;
+                table_count++;
+            }
+        }
+    }
+    return find_slot(name, len);
+}
+
+/*
+ * The slot of a variable, which is added unset if it does not exist yet
+ */
+static struct var_entry *lookup_or_add(const char *name, size_t len) {
+    size_t i = lookup(name, len);
+    if (table[i].entry == NULL) {
+        if ((table_count + 1) * 2 > table_size) {
+            grow_table();
+            i = find_slot(name, len);
+        }
+        table[i].entry = make_entry(name, len, "");
+        table[i].name_len = len;
+        table[i].exported = 0;
+        table[i].set = 0;
+        table_count++;
+    }
+    return &table[i];
+}
+
+/*
+ * Give a variable a value and set whether it is exported
+ */
+static void store(const char *name, size_t len, const char *value,
+                  int exported) {
+    size_t i = lookup(name, len);
+    char *entry = make_entry(name, len, value);
+    if (table[i].entry != NULL) {
+        drop_entry(&table[i]);
+    } else {
+        if ((table_count + 1) * 2 > table_size) {
+            grow_table();
+            i = find_slot(name, len);
+        }
+        table[i].name_len = len;
+        table_count++;
+    }
+    table[i].entry = entry;
+    table[i].exported = exported;
+    table[i].set = 1;
+    envp_stale |= exported;
+}
+
+/*
+ * @param s         The text which may start with a name
+ * @return          The length of the variable name s starts with, 0 if it
+ * does not start with one
+ */
+size_t var_name_length(const char *s) {
+    if (!isalpha((unsigned char)*s) && *s != '_') {
+        return 0;
+    }
+    size_t len = 1;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_') {
+        len++;
+    }
+    return len;
+}
+
+/*
+ * @param name      The name of the variable, which need not be
+ * NUL-terminated
+ * @param len       The length of the name
+ * @return          Its value, or NULL if it is not set. The string stays
+ * valid until the variable changes.
+ */
+const char *var_value(const char *name, size_t len) {
+    size_t i = lookup(name, len);
+    if (table[i].entry == NULL || !table[i].set) {
+        return NULL;
+    }
+    return table[i].entry + len + 1;
+}
+
+/*
+ * Like var_value(), for a NUL-terminated name
+ */
+const char *var_get(const char *name) {
+    return var_value(name, strlen(name));
+}
+
+/*
+ * Set a variable
+ * @param name      The name, which need not be NUL-terminated
+ * @param name_len  The length of the name
+ * @param value     The new value
+ * @param export    1 to export the variable, 0 to leave it exported only if
+ * it already is
+ */
+void var_set(const char *name, size_t name_len, const char *value,
+             int export) {
+    size_t i = lookup(name, name_len);
+    int exported = export || (table[i].entry != NULL && table[i].exported);
+    store(name, name_len, value, exported);
+}
+
+/*
+ * Set a variable from an assignment word which was already expanded
+ * @param assignment NAME=value
+ * @param export    Like for var_set()
+ */
+void var_assign(const char *assignment, int export) {
+    const char *eq = strchr(assignment, '=');
+    var_set(assignment, eq - assignment, eq + 1, export);
+}
+
+/*
+ * Remove a variable, nothing happens if it does not exist. Later entries of
+ * the probe sequence are shifted back so lookups never stop at the hole.
+ */
+void var_unset(const char *name) {
+    size_t len = strlen(name);
+    size_t i = lookup(name, len);
+    if (table[i].entry == NULL) {
+        return;
+    }
+    drop_entry(&table[i]);
+    table[i].entry = NULL;
+    table_count--;
+    size_t mask = table_size - 1;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (table[j].entry == NULL) {
+            break;
+        }
+        size_t home = hash_name(table[j].entry, table[j].name_len) & mask;
+        // move the entry into the hole unless its home slot lies cyclically
+        // in (i, j]
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            table[j].entry = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Remember a variable before a command changes it for as long as it runs
+ * @param name      The name, which need not be NUL-terminated
+ * @param name_len  The length of the name
+ * @param saved     Filled with the variable, see var_restore()
+ */
+void var_save(const char *name, size_t name_len, struct var_saved *saved) {
+    size_t i = lookup(name, name_len);
+    int set = table[i].entry != NULL && table[i].set;
+    saved->name = strndup(name, name_len);
+    saved->entry = set ? strdup(table[i].entry) : NULL;
+    saved->exported = set && table[i].exported;
+    if (saved->name == NULL || (set && saved->entry == NULL)) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Put back a variable which var_save() remembered
+ */
+void var_restore(struct var_saved *saved) {
+    if (saved->entry != NULL) {
+        size_t len = strlen(saved->name);
+        store(saved->name, len, saved->entry + len + 1, saved->exported);
+    } else {
+        var_unset(saved->name);
+    }
+    free(saved->name);
+    free(saved->entry);
+}
+
+/*
+ * The environment for the commands the shell runs, which environ is also
+ * set to. It is only built again when an exported variable changed since
+ * the last call.
+ * @return          The NULL-terminated NAME=value of every exported variable
+ */
+char **vars_environ(void) {
+    if (!envp_stale) {
+        return envp != NULL ? envp : environ;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < table_size; i++) {
+        count += table[i].entry != NULL && table[i].exported && table[i].set;
+    }
+    envp = realloc(envp, (count + 1) * sizeof(char *));
+    if (envp == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    count = 0;
+    for (size_t i = 0; i < table_size; i++) {
+        if (table[i].entry != NULL && table[i].exported && table[i].set) {
+            envp[count++] = table[i].entry;
+        }
+    }
+    envp[count] = NULL;
+    environ = envp;
+    for (size_t i = 0; i < nretired; i++) {
+        free(retired[i]);
+    }
+    nretired = 0;
+    envp_stale = 0;
+    return envp;
+}
+
+static int compare_entry(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Print every exported variable, sorted, in the form which sets it again
+ */
+static void print_exported(void) {
+    // lookup() fills the table before it is walked
+    lookup("", 0);
+    char **entries = malloc((table_count + 1) * sizeof(char *));
+    if (entries == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < table_size; i++) {
+        if (table[i].entry != NULL && table[i].exported) {
+            entries[count++] = table[i].entry;
+        }
+    }
+    qsort(entries, count, sizeof(char *), compare_entry);
+    for (size_t i = 0; i < count; i++) {
+        const char *eq = strchr(entries[i], '=');
+        size_t slot = find_slot(entries[i], eq - entries[i]);
+        printf("export %.*s", (int)(eq - entries[i]), entries[i]);
+        if (!table[slot].set) {
+            printf("\n");
+            continue;
+        }
+        // single quoted, where a ' is written as '\''
+        printf("='");
+        for (const char *c = eq + 1; *c != '\0'; c++) {
+            if (*c == '\'') {
+                printf("'\\''");
+            } else {
+                putchar(*c);
+            }
+        }
+        printf("'\n");
+    }
+    free(entries);
+}
+
+/*
+ * Check that an argument of export or unset starts with a valid name
+ * @return          The length of the name, 0 after an error was printed
+ */
+static size_t argument_name(const char *builtin, const char *arg,
+                            int assignment) {
+    size_t len = var_name_length(arg);
+    if (len == 0 || (arg[len] != '\0' && (!assignment || arg[len] != '='))) {
+        fprintf(stderr, "pish: %s: `%s': not a valid identifier\n", builtin,
+                arg);
+        return 0;
+    }
+    return len;
+}
+
+/*
+ * export NAME[=value] ... to export variables, export alone to list them
+ */
+int builtin_export(int argc, char **argv) {
+    if (argc == 1) {
+        print_exported();
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        size_t len = argument_name("export", argv[i], 1);
+        if (len == 0) {
+            status = 1;
+        } else if (argv[i][len] == '=') {
+            var_set(argv[i], len, argv[i] + len + 1, 1);
+        } else {
+            struct var_entry *var = lookup_or_add(argv[i], len);
+            envp_stale |= !var->exported && var->set;
+            var->exported = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * unset NAME ...
+ */
+int builtin_unset(int argc, char **argv) {
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argument_name("unset", argv[i], 0) == 0) {
+            status = 1;
+        } else {
+            var_unset(argv[i]);
+        }
+    }
+    return status;
+}
@@ -0,0 +1,37 @@
+#ifndef __PISH_VARS_H__
+#define __PISH_VARS_H__
+
+#include <stddef.h>
+
+/*
+ * The variables of the shell, in a hash table with open addressing. The
+ * table starts out as a copy of the environment the shell got, and the
+ * exported variables are the environment of every command it runs. That
+ * environment is only built again by vars_environ() once an exported
+ * variable changed, so launching a command does not copy it each time.
+ */
+
+/*
+ * What a variable was before a command changed it for a while, ie for
+ * X=1 cmd, see var_save()
+ */
+struct var_saved {
+    char *entry;  /* The malloc'd NAME=value, or NULL if it was unset */
+    int exported; /* Whether it was exported */
+    char *name;   /* The malloc'd name, to unset it again */
+};
+
+size_t var_name_length(const char *s);
+const char *var_value(const char *name, size_t len);
+const char *var_get(const char *name);
+void var_set(const char *name, size_t name_len, const char *value,
+             int export);
+void var_assign(const char *assignment, int export);
+void var_unset(const char *name);
+void var_save(const char *name, size_t name_len, struct var_saved *saved);
+void var_restore(struct var_saved *saved);
+char **vars_environ(void);
+int builtin_export(int argc, char **argv);
+int builtin_unset(int argc, char **argv);
+
+#endif // __PISH_VARS_H__